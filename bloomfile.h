@@ -0,0 +1,185 @@
+#ifndef BLOOMFILE_H
+#define BLOOMFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Serialized Bloom filter format and the hashes that index it, shared by the command line
+ * tool and the Python bindings so both agree on every bit.
+ */
+
+#define FILTER_MAGIC "BLOOMF01"
+#define FILTER_HASH_APHASH 1
+#define FILTER_HASH_DOUBLE 2
+
+/**
+ * Header of a serialized Bloom filter file.
+ *
+ * The header is followed by (m + 63) / 64 little-endian 64-bit words holding bit i of
+ * the filter at bit i % 64 of word i / 64. With FILTER_HASH_APHASH the bits of a word are
+ * set at APHashWithSalt(word, h, m) for h in [0, k); with FILTER_HASH_DOUBLE they are set
+ * at doubleHashIndex(FNVHash64(word), h, m).
+ */
+typedef struct {
+    char magic[8];                  // FILTER_MAGIC.
+    unsigned int k;                 // Number of hash functions.
+    unsigned int hash;              // Hash family, FILTER_HASH_APHASH or FILTER_HASH_DOUBLE.
+    unsigned long long m;           // Number of bits.
+    unsigned long long numInserted; // Number of words inserted when the filter was built.
+} FilterFileHeader;
+
+/**
+ * A serialized filter mapped read-only into memory.
+ */
+typedef struct {
+    const FilterFileHeader *header; // Start of the mapping.
+    const uint64_t *words;          // The packed filter bits, directly after the header.
+    size_t size;                    // Length of the mapping in bytes.
+} MappedFilter;
+
+/**
+ * APHash with a salt over at most 'length' bytes of 'str', stopping early at a NUL byte.
+ * Strings that are NUL-terminated before 'length' hash exactly as they do in
+ * APHashRawWithSalt, which lets fixed-width and offset-delimited buffers be hashed in place.
+ *
+ * @param str     The input bytes.
+ * @param length  The maximum number of bytes to hash.
+ * @param salt    The salt value used to modify the hash calculation.
+ *
+ * @return The unreduced hash value.
+ */
+static inline unsigned int APHashRawWithSaltN(const char *str, size_t length, unsigned int salt) {
+    unsigned int hash = salt; // Initialize the hash with the provided salt.
+
+    for (size_t i = 0; i < length && str[i]; i++) {
+        if (i % 2 == 1) { // Check if the current character's position is odd.
+            // Calculate a new hash by XOR-ing the current hash, left-shifting it by 7 bits,
+            // XOR-ing it with the current character, and right-shifting it by 3 bits.
+            hash ^= ((hash << 7) ^ str[i] ^ (hash >> 3));
+        } else {
+            // Calculate a new hash by XOR-ing the current hash with the bitwise complement of
+            // (left-shifting the hash by 11 bits, XOR-ing it with the current character, and right-shifting it by 5 bits).
+            hash ^= (~((hash << 11) ^ str[i] ^ (hash >> 5)));
+        }
+    }
+
+    return hash;
+}
+
+/**
+ * FNV-1a over at most 'length' bytes of 'str', stopping early at a NUL byte, followed by
+ * a murmur finaliser so every output bit depends on the whole string.
+ *
+ * @param str     The input bytes.
+ * @param length  The maximum number of bytes to hash.
+ *
+ * @return The 64-bit hash value.
+ */
+static inline uint64_t FNVHash64N(const char *str, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length && str[i]; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Derives probe 'i' of a key from its 64-bit fingerprint by Kirsch-Mitzenmacher double
+ * hashing: the low and high halves are the two base hashes, and the step is forced odd
+ * so the probes of a key do not collapse onto one bit.
+ *
+ * @param fingerprint  The 64-bit fingerprint of the key (FNVHash64).
+ * @param i            The probe number.
+ * @param m            The number of bits.
+ *
+ * @return The bit index of the probe.
+ */
+static inline unsigned int doubleHashIndex(uint64_t fingerprint, unsigned int i, unsigned int m) {
+    uint64_t first = (uint32_t)fingerprint;
+    uint64_t step = (fingerprint >> 32) | 1;
+    return (first + i * step) % m;
+}
+
+/**
+ * Maps a serialized filter file read-only and validates its header.
+ *
+ * @param filename  The filter file.
+ * @param filter    Receives the mapping.
+ * @return 0 on success, -1 if the file cannot be mapped or is not a valid filter.
+ */
+static inline int mapFilterFile(const char *filename, MappedFilter *filter) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FilterFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    const FilterFileHeader *header = mapping;
+    size_t numWords = (header->m + 63) / 64;
+    if (memcmp(header->magic, FILTER_MAGIC, sizeof(header->magic)) != 0 ||
+        (header->hash != FILTER_HASH_APHASH && header->hash != FILTER_HASH_DOUBLE) || header->m == 0 || header->m > UINT32_MAX ||
+        (size_t)st.st_size < sizeof(FilterFileHeader) + numWords * sizeof(uint64_t)) {
+        munmap(mapping, st.st_size);
+        return -1;
+    }
+    filter->header = header;
+    filter->words = (const uint64_t *)(header + 1);
+    filter->size = st.st_size;
+    return 0;
+}
+
+/**
+ * Unmaps a filter mapped with mapFilterFile.
+ *
+ * @param filter  The mapped filter.
+ */
+static inline void unmapFilterFile(MappedFilter *filter) {
+    if (filter->header != NULL) {
+        munmap((void *)filter->header, filter->size);
+        filter->header = NULL;
+    }
+}
+
+/**
+ * Tests a word, given as at most 'length' bytes, against a mapped filter.
+ *
+ * @param filter  The mapped filter.
+ * @param str     The word bytes.
+ * @param length  The maximum number of bytes, as for APHashRawWithSaltN.
+ * @return 1 if every probe bit is set, 0 otherwise.
+ */
+static inline int lookUpMapped(const MappedFilter *filter, const char *str, size_t length) {
+    unsigned int m = filter->header->m;
+    int doubleHashing = filter->header->hash == FILTER_HASH_DOUBLE;
+    uint64_t fingerprint = doubleHashing ? FNVHash64N(str, length) : 0;
+    for (unsigned int h = 0; h < filter->header->k; h++) {
+        unsigned int index = doubleHashing ? doubleHashIndex(fingerprint, h, m) : APHashRawWithSaltN(str, length, h) % m;
+        if (!(filter->words[index / 64] >> (index % 64) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#endif
@@ -4,12 +4,105 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <limits.h>
+#include <errno.h>
 #include <omp.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "bloomfile.h"
+#include "serialinsert.h"
 
 #define MAX_WORD_LENGTH 100
+#define WORD_FORMAT "%99s"        // Reads at most MAX_WORD_LENGTH - 1 bytes.
 #define MAX_FP 0.01
+#define MAX_K 32
+#define CMS_WIDTH 262144
+#define MAX_TOP_K 4096
+#define HLL_PRECISION 14
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+#define SAMPLE_BYTES 65536
+#define SIZING_HEADROOM 1.1
+#define STREAM_BATCH 65536
+#define MAX_STAGES 32
+#define STAGE0_FP_SHARE 0.9
+#define SPARSE_MAX_DENSITY (1.0 / 32)
+#define L2_BUDGET_BYTES (256 * 1024)
+#define FRONT_BITS_PER_WORD 8
+#define FRONT_BLOCK_WORDS 8
+#define BENCH_QUERIES 1000000
+#define PATTERN_TABLE_SIZE 1024
+#define LEARNED_FEATURES 4096
+#define LEARNED_NGRAM 3
+#define LEARNED_EPOCHS 4
+#define LEARNED_BATCH 1024
+#define LEARNED_RATE 0.5
+#define LEARNED_THRESHOLDS 256
+#define WEIGHTED_CLASSES 16
+#define MAX_PREFIX_LENGTHS 16
+#define PREFIX_FP 0.01
+#define RANGE_KEY_BITS 64
+#define RANGE_LEVEL_FP 0.01
+#define TYPO_BITS_PER_WORD 16
+#define TYPO_PROBES 7
+#define TYPO_BATCH 16
+#define TYPO_BASE 0x100000001b3ULL
+#define TYPO_BENCH_QUERIES 100000
+#define RETRIEVAL_OVERHEAD 1.23
+#define RETRIEVAL_EXTRA_SLOTS 32
+#define RETRIEVAL_MAX_ATTEMPTS 16
+#define IBLT_KEY_WORDS ((MAX_WORD_LENGTH + 8) / 8)
+#define IBLT_OVERHEAD 1.5
+#define IBLT_EXTRA_CELLS 10
+#define IBLT_DEFAULT_DIFFERENCE 64
+#define IBLT_MAX_ATTEMPTS 24
+#define FINGERPRINT_MAGIC "BLOOMFP1"
+#define MALLOC_OVERHEAD 16
+#define TRACE_SPANS_PER_THREAD 4096
+#define TRACE_MAX_THREADS 256
+#define METRICS_SHARDS 256
+#define METRICS_BUCKETS 12
+#define METRICS_SAMPLE_INTERVAL 64
+#define METRICS_INSERT_INTERVAL 4096
+#define METRICS_ACCEPT_BACKOFF_MS 100
+#define VERIFY_THREADS {1, 2, 4, 8}
+#define VERIFY_FP_TOLERANCE 0.1
+#define SBBF_MIN_BYTES 32
+#define SBBF_MAX_BYTES (128 * 1024 * 1024)
+#define SBBF_PREFETCH_DISTANCE 16
+#define SORTED_INSERT_BATCH 65536
+#define CACHE_LINE_BYTES 64
+#define POOL_SLAB_BYTES (2 * 1024 * 1024)
+#define POOL_CLASSES 16
+#define POOL_MAX_BLOCK ((size_t)CACHE_LINE_BYTES << (POOL_CLASSES - 1))
+#define POOL_VERIFY_FILTERS 4
+#define RADIX_BITS 11
+#define SORTED_INSERT_MIN_BYTES (2 * 1024 * 1024)
 
 int k;
+volatile int benchmarkSink; // Receives benchmark results so the measured lookups are not optimised away.
+
+/**
+ *
+ * This function calculates a hash value for the input string 'str' using the provided salt value.
+ * It employs the APHash algorithm with added salting to generate different hashes for the same string.
+ * The result is not reduced, so the same probe hash can index structures of different sizes.
+ *
+ * @param str   The input string for which the hash is computed.
+ * @param salt  The salt value used to modify the hash calculation.
+ *
+ * @return The computed hash value for the input string with the added salt value.
+ */
+unsigned int APHashRawWithSalt(char *str, unsigned int salt) {
+    return APHashRawWithSaltN(str, SIZE_MAX, salt);
+}
 
 /**
  *
@@ -23,255 +116,6693 @@ int k;
  * @return The computed hash value for the input string with the added salt value, modulo 'm'.
  */
 unsigned int APHashWithSalt(char *str, unsigned int salt, int m) {
-    unsigned int hash = salt; // Initialize the hash with the provided salt.
+    // Return the computed hash value, limited to a the range of the bitArray.
+    return APHashRawWithSalt(str, salt) % m;
+}
+
+/**
+ * Computes a 64-bit hash of a string (FNV-1a followed by a murmur finaliser).
+ *
+ * Used where 32 bits of APHash are not enough, such as HyperLogLog ranks.
+ *
+ * @param str  The input string.
+ * @return The 64-bit hash value.
+ */
+unsigned long long FNVHash64(const char *str) {
+    return FNVHash64N(str, SIZE_MAX);
+}
+
+/**
+ * HyperLogLog registers used to estimate the number of distinct words.
+ */
+typedef struct {
+    unsigned char registers[HLL_REGISTERS];
+} HyperLogLog;
+
+/**
+ * Adds a 64-bit hash to a HyperLogLog.
+ *
+ * The top HLL_PRECISION bits select the register, which keeps the largest
+ * position of the first set bit seen in the remaining bits.
+ *
+ * @param hll   The HyperLogLog to update.
+ * @param hash  The 64-bit hash of the element.
+ */
+void addHyperLogLog(HyperLogLog *hll, unsigned long long hash) {
+    unsigned int index = hash >> (64 - HLL_PRECISION);
+    // The sentinel bit bounds the rank when all remaining bits are zero
+    unsigned long long rest = (hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+    unsigned char rank = __builtin_clzll(rest) + 1;
+    if (rank > hll->registers[index]) {
+        hll->registers[index] = rank;
+    }
+}
+
+/**
+ * Merges one HyperLogLog into another by taking the maximum of each register.
+ *
+ * @param into  The HyperLogLog that receives the union.
+ * @param from  The HyperLogLog to merge.
+ */
+void mergeHyperLogLog(HyperLogLog *into, const HyperLogLog *from) {
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        if (from->registers[i] > into->registers[i]) {
+            into->registers[i] = from->registers[i];
+        }
+    }
+}
+
+/**
+ * Estimates the number of distinct elements added to a HyperLogLog.
+ *
+ * Uses linear counting for small cardinalities, where the raw estimate is biased.
+ *
+ * @param hll  The HyperLogLog.
+ * @return The estimated number of distinct elements.
+ */
+double estimateHyperLogLog(const HyperLogLog *hll) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -hll->registers[i]);
+        if (hll->registers[i] == 0) {
+            zeros++;
+        }
+    }
+    double registers = HLL_REGISTERS;
+    double alpha = 0.7213 / (1 + 1.079 / registers);
+    double estimate = alpha * registers * registers / sum;
+    if (estimate <= 2.5 * registers && zeros > 0) {
+        estimate = registers * log(registers / zeros);
+    }
+    return estimate;
+}
+
+/**
+ * Categories of memory reported by printMemoryReport().
+ */
+enum MemoryCategory {
+    MEMORY_WORDS,       // Word list pointers and strings.
+    MEMORY_QUERIES,     // Query word pointers, strings and expected bits.
+    MEMORY_FILTER,      // Filter bits.
+    MEMORY_TEMPORARY,   // File buffers, sketches and other per-phase scratch space.
+    MEMORY_CATEGORIES
+};
+
+const char *memoryCategoryNames[MEMORY_CATEGORIES] = {"word list", "query buffers", "filter", "temporaries"};
+long memoryInUse[MEMORY_CATEGORIES];    // Bytes currently allocated in each category.
+long memoryPeak;                        // Largest total of memoryInUse seen so far.
+
+/**
+ * Records an allocation (positive 'bytes') or a release (negative 'bytes') in a memory category.
+ *
+ * Safe to call from several threads at once.
+ *
+ * @param category  The MemoryCategory of the memory.
+ * @param bytes     The number of bytes allocated, or minus the number released.
+ */
+void trackMemory(int category, long bytes) {
+    __atomic_add_fetch(&memoryInUse[category], bytes, __ATOMIC_RELAXED);
+    long total = 0;
+    for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+        total += __atomic_load_n(&memoryInUse[c], __ATOMIC_RELAXED);
+    }
+    long peak = __atomic_load_n(&memoryPeak, __ATOMIC_RELAXED);
+    while (total > peak && !__atomic_compare_exchange_n(&memoryPeak, &peak, total, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Prints the bytes held in each memory category, the tracked peak and the peak RSS.
+ *
+ * @param phase  The name of the phase that just finished.
+ */
+void printMemoryReport(const char *phase) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Memory after %s:", phase);
+    for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+        printf(" %s %ld,", memoryCategoryNames[c], memoryInUse[c]);
+    }
+    // ru_maxrss is in kilobytes on Linux
+    printf(" tracked peak %ld, peak RSS %ld bytes\n", memoryPeak, usage.ru_maxrss * 1024L);
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ *
+ * @param text  The text to parse.
+ * @return The number of bytes, or -1 if the text is not a valid size.
+ */
+long parseByteSize(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (toupper((unsigned char)*end)) {
+        case 'G': value *= 1024; // Fall through
+        case 'M': value *= 1024; // Fall through
+        case 'K': value *= 1024; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0' && toupper((unsigned char)*end) != 'B') {
+        return -1;
+    }
+    return value > 0 ? (long)value : -1;
+}
+
+/**
+ * A timed span of work on one thread, in microseconds since the program started.
+ */
+typedef struct {
+    const char *name;   // Static name of the span.
+    double start;       // Start time.
+    double end;         // End time.
+} TraceSpan;
+
+/**
+ * The spans recorded by one thread. Only the owning thread writes to it, so no locking is needed.
+ */
+typedef struct {
+    int id;                                 // Trace thread id.
+    int count;                              // Number of spans recorded.
+    int dropped;                            // Number of spans dropped because the buffer was full.
+    TraceSpan spans[TRACE_SPANS_PER_THREAD];
+} TraceBuffer;
+
+int tracingEnabled;                                 // 1 when --trace was given.
+struct timespec traceOrigin;                        // Time zero of the trace.
+TraceBuffer *traceBuffers[TRACE_MAX_THREADS];       // Every thread's buffer, in registration order.
+int traceNumBuffers;                                // Number of registered buffers.
+__thread TraceBuffer *traceLocal;                   // The calling thread's buffer.
+
+/**
+ * Returns the time since the trace origin in microseconds, or 0 when tracing is disabled.
+ */
+double traceNow(void) {
+    if (!tracingEnabled) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - traceOrigin.tv_sec) * 1e6 + (now.tv_nsec - traceOrigin.tv_nsec) * 1e-3;
+}
+
+/**
+ * Records a span from 'start' (a traceNow() value) until now on the calling thread.
+ *
+ * The first span of a thread allocates its buffer and claims a slot with an atomic
+ * compare-and-swap; afterwards recording is a plain write to thread-local memory.
+ *
+ * @param name   The span name; must outlive the program (a string literal).
+ * @param start  The start time returned by traceNow().
+ */
+void traceSpan(const char *name, double start) {
+    if (!tracingEnabled) {
+        return;
+    }
+    double end = traceNow();
+    if (traceLocal == NULL) {
+        // Claim a slot only while one is free, so the count saturates at TRACE_MAX_THREADS
+        int slot = __atomic_load_n(&traceNumBuffers, __ATOMIC_RELAXED);
+        do {
+            if (slot >= TRACE_MAX_THREADS) {
+                return;
+            }
+        } while (!__atomic_compare_exchange_n(&traceNumBuffers, &slot, slot + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        traceLocal = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+        if (traceLocal == NULL) {
+            return;
+        }
+        traceLocal->id = slot;
+        __atomic_store_n(&traceBuffers[slot], traceLocal, __ATOMIC_RELEASE);
+    }
+    if (traceLocal->count == TRACE_SPANS_PER_THREAD) {
+        traceLocal->dropped++;
+        return;
+    }
+    TraceSpan *span = &traceLocal->spans[traceLocal->count++];
+    span->name = name;
+    span->start = start;
+    span->end = end;
+}
+
+/**
+ * Writes every recorded span as Chrome trace event JSON and frees the buffers.
+ *
+ * The file can be opened in chrome://tracing or the Perfetto UI. Must be called once
+ * all parallel work has finished.
+ *
+ * @param filename  The output file.
+ * @return 0 on success, -1 on failure.
+ */
+int writeTrace(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror("Error opening file");
+        return -1;
+    }
+    int numBuffers = traceNumBuffers < TRACE_MAX_THREADS ? traceNumBuffers : TRACE_MAX_THREADS;
+    int first = 1;
+    long dropped = 0;
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (int b = 0; b < numBuffers; b++) {
+        TraceBuffer *buffer = traceBuffers[b];
+        if (buffer == NULL) {
+            continue;
+        }
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                first ? "" : ",\n", buffer->id, buffer->id);
+        first = 0;
+        for (int i = 0; i < buffer->count; i++) {
+            TraceSpan *span = &buffer->spans[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    span->name, buffer->id, span->start, span->end - span->start);
+        }
+        dropped += buffer->dropped;
+        free(buffer);
+        traceBuffers[b] = NULL;
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0) {
+        perror("Error writing trace file");
+        return -1;
+    }
+    if (dropped > 0) {
+        printf("Trace dropped %ld spans.\n", dropped);
+    }
+    return 0;
+}
+
+const char *traceFilename;  // Output of writeTraceAtExit().
+int lingerSeconds;          // Delay applied by lingerAtExit().
+
+/**
+ * atexit() handler that keeps the process, and so the metrics endpoint, alive for 'lingerSeconds'.
+ */
+void lingerAtExit(void) {
+    printf("Serving metrics for %d more seconds.\n", lingerSeconds);
+    fflush(stdout);
+    sleep(lingerSeconds);
+}
+
+/**
+ * atexit() handler that writes the trace to 'traceFilename'.
+ */
+void writeTraceAtExit(void) {
+    if (writeTrace(traceFilename) == 0) {
+        printf("Trace written to %s\n", traceFilename);
+    }
+}
+
+/**
+ * Counters of one thread, padded to a cache line so threads never share a line.
+ *
+ * Only the owning thread writes its shard, except for the last one, which threads beyond
+ * METRICS_SHARDS share; the metrics server sums all shards when scraped.
+ */
+typedef struct {
+    long inserts;                           // Words inserted.
+    long lookups;                           // Lookups performed.
+    long positives;                         // Lookups that returned "possibly in set".
+    long sampleCounter;                     // Lookups since the last latency sample.
+    long latencyBuckets[METRICS_BUCKETS];   // Sampled lookup latencies, bucket b holds < 2^(b + 6) ns.
+    long latencySumNs;                      // Sum of the sampled latencies.
+} __attribute__((aligned(64))) MetricsShard;
+
+int metricsEnabled;                         // 1 when a metrics endpoint is running.
+MetricsShard metricsShards[METRICS_SHARDS]; // Every thread's counters.
+int metricsNumShards;                       // Number of shards claimed.
+__thread MetricsShard *metricsLocal;        // The calling thread's shard.
+double metricsFillRatio;                    // Fraction of filter bits set, published after insertion.
+double metricsEstimatedFP;                  // False positive rate expected from the fill ratio.
 
-    for (int i = 0; str[i]; i++) {
-        if (i % 2 == 1) { // Check if the current character's position is odd.
-            // Calculate a new hash by XOR-ing the current hash, left-shifting it by 7 bits,
-            // XOR-ing it with the current character, and right-shifting it by 3 bits.
-            hash ^= ((hash << 7) ^ str[i] ^ (hash >> 3));
+/**
+ * Returns the calling thread's metrics shard, claiming one on first use.
+ */
+MetricsShard *metricsShard(void) {
+    if (metricsLocal == NULL) {
+        int slot = __atomic_fetch_add(&metricsNumShards, 1, __ATOMIC_RELAXED);
+        // Threads beyond the shard count share the last shard, which metricsAdd() updates atomically
+        metricsLocal = &metricsShards[slot < METRICS_SHARDS ? slot : METRICS_SHARDS - 1];
+    }
+    return metricsLocal;
+}
+
+/**
+ * Adds to a counter of the calling thread's shard. A plain load and store suffices when
+ * the shard has a single writer, and the relaxed atomics only keep the scraper's reads
+ * whole; the shared last shard needs a real atomic add.
+ *
+ * @param shard    The calling thread's shard.
+ * @param counter  A counter of the shard.
+ * @param value    The amount to add.
+ * @return The new value of the counter.
+ */
+long metricsAdd(MetricsShard *shard, long *counter, long value) {
+    if (shard == &metricsShards[METRICS_SHARDS - 1]) {
+        return __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+    }
+    long sum = __atomic_load_n(counter, __ATOMIC_RELAXED) + value;
+    __atomic_store_n(counter, sum, __ATOMIC_RELAXED);
+    return sum;
+}
+
+/**
+ * Records that 'count' words were inserted.
+ */
+void metricsRecordInserts(long count) {
+    if (metricsEnabled) {
+        MetricsShard *shard = metricsShard();
+        metricsAdd(shard, &shard->inserts, count);
+    }
+}
+
+/**
+ * Starts timing a lookup if it is one of the sampled ones.
+ *
+ * @return The start time in nanoseconds, or 0 if this lookup is not sampled or metrics are off.
+ */
+long metricsLookupStart(void) {
+    if (!metricsEnabled) {
+        return 0;
+    }
+    MetricsShard *shard = metricsShard();
+    if (metricsAdd(shard, &shard->sampleCounter, 1) < METRICS_SAMPLE_INTERVAL) {
+        return 0;
+    }
+    __atomic_store_n(&shard->sampleCounter, 0, __ATOMIC_RELAXED);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Records the outcome of a lookup and, if it was sampled, its latency.
+ *
+ * @param start   The value returned by metricsLookupStart().
+ * @param result  1 if the lookup returned "possibly in set".
+ */
+void metricsLookupEnd(long start, int result) {
+    if (!metricsEnabled) {
+        return;
+    }
+    MetricsShard *shard = metricsShard();
+    metricsAdd(shard, &shard->lookups, 1);
+    metricsAdd(shard, &shard->positives, result);
+    if (start != 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = now.tv_sec * 1000000000L + now.tv_nsec - start;
+        int bucket = 0;
+        while (bucket < METRICS_BUCKETS - 1 && elapsed >= (64L << bucket)) {
+            bucket++;
+        }
+        metricsAdd(shard, &shard->latencyBuckets[bucket], 1);
+        metricsAdd(shard, &shard->latencySumNs, elapsed);
+    }
+}
+
+/**
+ * Publishes the fill ratio of a filter and the false positive rate it implies.
+ *
+ * @param setBits    The number of bits set.
+ * @param totalBits  The number of bits in the filter.
+ * @param numHashes  The number of hash functions.
+ */
+void metricsPublishFill(long setBits, long totalBits, int numHashes) {
+    metricsFillRatio = totalBits > 0 ? (double)setBits / totalBits : 0;
+    metricsEstimatedFP = pow(metricsFillRatio, numHashes);
+}
+
+/**
+ * Counts the set bits of a packed bit array.
+ *
+ * @param words     The packed bits.
+ * @param numWords  The number of 64-bit words.
+ * @return The number of bits set.
+ */
+long countSetWords(const unsigned long long *words, long numWords) {
+    long setBits = 0;
+    #pragma omp parallel for reduction(+:setBits) schedule(static)
+    for (long w = 0; w < numWords; w++) {
+        setBits += __builtin_popcountll(words[w]);
+    }
+    return setBits;
+}
+
+/**
+ * Formats every metric in the Prometheus text exposition format.
+ *
+ * @param out       The output buffer.
+ * @param capacity  The size of the buffer.
+ * @return The number of characters written.
+ */
+int formatMetrics(char *out, size_t capacity) {
+    long inserts = 0, lookups = 0, positives = 0, sumNs = 0;
+    long buckets[METRICS_BUCKETS] = {0};
+    int numShards = metricsNumShards < METRICS_SHARDS ? metricsNumShards : METRICS_SHARDS;
+    for (int i = 0; i < numShards; i++) {
+        inserts += __atomic_load_n(&metricsShards[i].inserts, __ATOMIC_RELAXED);
+        lookups += __atomic_load_n(&metricsShards[i].lookups, __ATOMIC_RELAXED);
+        positives += __atomic_load_n(&metricsShards[i].positives, __ATOMIC_RELAXED);
+        sumNs += __atomic_load_n(&metricsShards[i].latencySumNs, __ATOMIC_RELAXED);
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            buckets[b] += __atomic_load_n(&metricsShards[i].latencyBuckets[b], __ATOMIC_RELAXED);
+        }
+    }
+
+    int length = snprintf(out, capacity,
+        "# HELP bloom_inserts_total Words inserted into the filter.\n# TYPE bloom_inserts_total counter\nbloom_inserts_total %ld\n"
+        "# HELP bloom_lookups_total Filter lookups.\n# TYPE bloom_lookups_total counter\nbloom_lookups_total %ld\n"
+        "# HELP bloom_positives_total Lookups that returned possibly in set.\n# TYPE bloom_positives_total counter\nbloom_positives_total %ld\n"
+        "# HELP bloom_fill_ratio Fraction of filter bits set.\n# TYPE bloom_fill_ratio gauge\nbloom_fill_ratio %lf\n"
+        "# HELP bloom_estimated_fp False positive rate implied by the fill ratio.\n# TYPE bloom_estimated_fp gauge\nbloom_estimated_fp %lf\n"
+        "# HELP bloom_lookup_latency_seconds Sampled lookup latency (1 in %d lookups).\n# TYPE bloom_lookup_latency_seconds histogram\n",
+        inserts, lookups, positives, metricsFillRatio, metricsEstimatedFP, METRICS_SAMPLE_INTERVAL);
+    long cumulative = 0;
+    for (int b = 0; b < METRICS_BUCKETS && length < (int)capacity; b++) {
+        cumulative += buckets[b];
+        if (b < METRICS_BUCKETS - 1) {
+            length += snprintf(out + length, capacity - length, "bloom_lookup_latency_seconds_bucket{le=\"%g\"} %ld\n",
+                               (64L << b) * 1e-9, cumulative);
         } else {
-            // Calculate a new hash by XOR-ing the current hash with the bitwise complement of
-            // (left-shifting the hash by 11 bits, XOR-ing it with the current character, and right-shifting it by 5 bits).
-            hash ^= (~((hash << 11) ^ str[i] ^ (hash >> 5)));
+            length += snprintf(out + length, capacity - length, "bloom_lookup_latency_seconds_bucket{le=\"+Inf\"} %ld\n", cumulative);
         }
     }
+    if (length < (int)capacity) {
+        length += snprintf(out + length, capacity - length, "bloom_lookup_latency_seconds_sum %lf\nbloom_lookup_latency_seconds_count %ld\n",
+                           sumNs * 1e-9, cumulative);
+    }
+    return length < (int)capacity ? length : (int)capacity - 1;
+}
 
-    // Return the computed hash value, limited to a the range of the bitArray.
-    return hash % m;
+/**
+ * Serves the metrics over HTTP to every connection on a listening socket.
+ *
+ * Runs on its own thread for the life of the process; any request gets the full metrics page.
+ * When the process is out of descriptors or buffers, accepting is retried after
+ * METRICS_ACCEPT_BACKOFF_MS instead of spinning, and on any other listener error the
+ * thread stops serving.
+ *
+ * @param argument  The listening socket, cast to a pointer.
+ */
+void *serveMetrics(void *argument) {
+    int listener = (int)(long)argument;
+    char request[1024];
+    char body[8192];
+    char header[256];
+    while (1) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                struct timespec backoff = {0, METRICS_ACCEPT_BACKOFF_MS * 1000000L};
+                nanosleep(&backoff, NULL);
+                continue;
+            }
+            perror("Error accepting metrics connection");
+            close(listener);
+            return NULL;
+        }
+        // Read (and ignore) the request line so the client sees a normal exchange
+        if (read(connection, request, sizeof(request)) >= 0) {
+            int bodyLength = formatMetrics(body, sizeof(body));
+            int headerLength = snprintf(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", bodyLength);
+            if (write(connection, header, headerLength) == headerLength) {
+                if (write(connection, body, bodyLength) != bodyLength) {
+                    perror("Error writing metrics");
+                }
+            }
+        }
+        close(connection);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the metrics endpoint on a local TCP port or a Unix socket.
+ *
+ * @param port        The TCP port on 127.0.0.1, used when 'socketPath' is NULL.
+ * @param socketPath  The Unix socket path, or NULL.
+ * @return 0 on success, -1 on failure.
+ */
+int startMetricsServer(int port, const char *socketPath) {
+    int listener;
+    if (socketPath != NULL) {
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+        unlink(socketPath);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            perror("Error binding metrics socket");
+            return -1;
+        }
+    } else {
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0) {
+            perror("Error creating metrics socket");
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            perror("Error binding metrics port");
+            return -1;
+        }
+    }
+    if (listen(listener, 16) != 0) {
+        perror("Error listening for metrics");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serveMetrics, (void *)(long)listener) != 0) {
+        printf("Could not start the metrics thread.\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    metricsEnabled = 1;
+    return 0;
 }
 
 /**
  * Reads words from a file and stores them in an array of strings and updates the arrayLength pointer.
  *
- * This function opens the specified file, reads its contents word by word, and stores
- * them in an array of strings. It also counts the number of words and updates'wordListLength' accordingly.
+ * This function reads the whole file into memory and splits it into words in parallel:
+ * each thread takes a chunk starting at a word boundary, counts its words and terminates
+ * them in place, then copies them to their final slots once the chunk offsets are known.
+ * If 'hll' is not NULL, every word is also added to a per-thread HyperLogLog during the
+ * counting pass and the thread registers are merged into 'hll' by maximum.
  *
  * @param filename         The name of the file to read words from.
  * @param wordListLength   A pointer to an integer where the word list length will be stored.
+ * @param hll              A HyperLogLog that receives every word, or NULL.
  *
  * @return An array of strings containing the words from the file, or NULL on failure.
  *         Memory for the array and its strings should be freed after use.
  */
-char** readWordsFromFile(const char *filename, int *wordListLength) {
+char** readWordsFromFile(const char *filename, int *wordListLength, HyperLogLog *hll) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         perror("Error opening file");
         return NULL;
     }
 
-    // Declare word, length and array variables
-    char word[MAX_WORD_LENGTH];
-    char **ppWordListArray = NULL;
-    int length = 0;
+    // Read the whole file into one buffer
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *buffer = (char *)malloc(size + 1);
+    if (buffer == NULL) {
+        printf("Memory allocation failed for file buffer.\n");
+        fclose(file);
+        return NULL;
+    }
+    trackMemory(MEMORY_TEMPORARY, size + 1);
+    if (fread(buffer, 1, size, file) != (size_t)size) {
+        printf("Error reading word from file.\n");
+        fclose(file);
+        free(buffer);
+        trackMemory(MEMORY_TEMPORARY, -(size + 1));
+        return NULL;
+    }
+    buffer[size] = '\0';
+    // Close file
+    fclose(file);
 
-    // Count the number of words in the file
-    while (fscanf(file, "%s", word) == 1) {
-        length++; // Increment for each word
+    int numChunks = omp_get_max_threads();
+    long *chunkStart = (long *)malloc((numChunks + 1) * sizeof(long));
+    int *chunkOffset = (int *)calloc(numChunks + 1, sizeof(int));
+    if (chunkStart == NULL || chunkOffset == NULL) {
+        printf("Memory allocation failed for chunk table.\n");
+        free(buffer);
+        trackMemory(MEMORY_TEMPORARY, -(size + 1));
+        free(chunkStart);
+        free(chunkOffset);
+        return NULL;
     }
-    // Reset the file pointer to the beginning of the file
-    fseek(file, 0, SEEK_SET);
+
+    // Move every chunk start forward to a word boundary so no word straddles two chunks
+    for (int c = 0; c <= numChunks; c++) {
+        long start = size * c / numChunks;
+        while (start > 0 && start < size && !isspace((unsigned char)buffer[start - 1])) {
+            start++;
+        }
+        chunkStart[c] = start;
+    }
+
+    // Count the words of each chunk, terminate them in place and feed the HyperLogLog
+    #pragma omp parallel for schedule(static, 1) num_threads(numChunks)
+    for (int c = 0; c < numChunks; c++) {
+        double spanStart = traceNow();
+        HyperLogLog *local = hll != NULL ? (HyperLogLog *)calloc(1, sizeof(HyperLogLog)) : NULL;
+        int count = 0;
+        long i = chunkStart[c];
+        while (i < chunkStart[c + 1]) {
+            if (isspace((unsigned char)buffer[i])) {
+                i++;
+                continue;
+            }
+            char *word = &buffer[i];
+            while (i < size && !isspace((unsigned char)buffer[i])) {
+                i++;
+            }
+            buffer[i++] = '\0';
+            if (local != NULL) {
+                addHyperLogLog(local, FNVHash64(word));
+            }
+            count++;
+        }
+        chunkOffset[c + 1] = count;
+        traceSpan("parse chunk", spanStart);
+
+        if (local != NULL) {
+            #pragma omp critical
+            mergeHyperLogLog(hll, local);
+            free(local);
+        }
+    }
+
+    // Turn the per-chunk counts into starting offsets
+    for (int c = 0; c < numChunks; c++) {
+        chunkOffset[c + 1] += chunkOffset[c];
+    }
+    int length = chunkOffset[numChunks];
 
     // Allocate memory for the word list
-    ppWordListArray = (char **)malloc(length * sizeof(char *));
+    char **ppWordListArray = (char **)malloc(length * sizeof(char *));
     if (ppWordListArray == NULL) {
         printf("Memory allocation failed for ppWordListArray.\n");
-        fclose(file);
+        free(buffer);
+        trackMemory(MEMORY_TEMPORARY, -(size + 1));
+        free(chunkStart);
+        free(chunkOffset);
         return NULL;
     }
 
-    // Read words from the file and store them in ppWordListArray
-    for (int i = 0; i < length; i++) {
-        if (fscanf(file, "%s", word) != 1) {
-            printf("Error reading word from file.\n");
-            fclose(file);
-            free(ppWordListArray); // Free previously allocated memory
-            return NULL;
+    // Copy the terminated words of each chunk into their slots
+    long stringBytes = 0;
+    #pragma omp parallel for schedule(static, 1) num_threads(numChunks) reduction(+:stringBytes)
+    for (int c = 0; c < numChunks; c++) {
+        double spanStart = traceNow();
+        int slot = chunkOffset[c];
+        long i = chunkStart[c];
+        while (i < chunkStart[c + 1]) {
+            if (buffer[i] == '\0' || isspace((unsigned char)buffer[i])) {
+                i++;
+                continue;
+            }
+            // Words are truncated to MAX_WORD_LENGTH - 1 bytes like every fscanf reader
+            long wordLength = strlen(&buffer[i]);
+            ppWordListArray[slot++] = strndup(&buffer[i], MAX_WORD_LENGTH - 1);
+            stringBytes += (wordLength < MAX_WORD_LENGTH - 1 ? wordLength : MAX_WORD_LENGTH - 1) + 1 + MALLOC_OVERHEAD;
+            i += wordLength;
+        }
+        traceSpan("copy chunk", spanStart);
+    }
+    trackMemory(MEMORY_WORDS, length * sizeof(char *) + stringBytes);
+
+    free(buffer);
+    trackMemory(MEMORY_TEMPORARY, -(size + 1));
+    free(chunkStart);
+    free(chunkOffset);
+
+    // Update the wordListLength pointer
+    *wordListLength = length; // Set the word list length
+
+    return ppWordListArray;
+}
+
+/**
+ * Frees a word list returned by readWordsFromFile().
+ */
+void freeWordList(char **words, int numWords) {
+    long stringBytes = 0;
+    for (int i = 0; i < numWords; i++) {
+        stringBytes += strlen(words[i]) + 1 + MALLOC_OVERHEAD;
+        free(words[i]);
+    }
+    free(words);
+    trackMemory(MEMORY_WORDS, -(numWords * (long)sizeof(char *) + stringBytes));
+}
+
+/**
+ * Frees the word list and the query buffers loaded by main.
+ */
+void freeWordsAndQueries(char **words, int numWords, char **queries, int *bits, int querySize) {
+    // Free memory for query words and bits
+    long stringBytes = 0;
+    for (int i = 0; i < querySize; i++) {
+        stringBytes += strlen(queries[i]) + 1 + MALLOC_OVERHEAD;
+        free(queries[i]);
+    }
+    free(queries);
+    free(bits);
+    trackMemory(MEMORY_QUERIES, -(querySize * (long)(sizeof(char *) + sizeof(int)) + stringBytes));
+
+    freeWordList(words, numWords);
+}
+
+/**
+ * Inserts words into a Bloom filter represented by a bit array.
+ *
+ * This function takes an array of words and inserts them into a Bloom filter
+ * represented by a bit array. It uses multiple hash functions to set the bits
+ * in the filter corresponding to the hashed values of each word.
+ *
+ * @param ppWordListArray  An array of strings containing words to insert.
+ * @param numToInsert      The number of words to insert from the array.
+ * @param bitArray         The bit array representing the Bloom filter.
+ * @param m                The size of the bit array (modulo value for hashing).
+ */
+void insertWords(char **ppWordListArray, int numToInsert, int* bitArray, int m) {
+    #pragma omp parallel
+    {
+        double spanStart = traceNow();
+        long pendingInserts = 0;
+        // Passes Bernsteins' condition
+        #pragma omp for collapse(2) schedule(static, 1) nowait
+        for (int i = 0; i < numToInsert; i++) {
+            for (int h = 0; h < k; h++) {
+                // Calculate the hash using APHashWithSalt
+                unsigned int hash = APHashWithSalt(ppWordListArray[i], h, m);
+                
+                // Set the corresponding bit in the bit array to 1
+                bitArray[hash] = 1;
+
+                // Publish the inserts counter every METRICS_INSERT_INTERVAL words so scrapes see progress
+                if (h == k - 1 && ++pendingInserts == METRICS_INSERT_INTERVAL) {
+                    metricsRecordInserts(pendingInserts);
+                    pendingInserts = 0;
+                }
+            }
+        }
+        metricsRecordInserts(pendingInserts);
+        traceSpan("insert chunk", spanStart);
+    }
+}
+
+/**
+ * Calculates the optimal size of a Bloom filter bit array for a given false positive rate.
+ *
+ * @param n   The expected number of elements to be inserted into the Bloom filter.
+ * @param fp  The desired maximum false positive rate.
+ * @return The optimal size of the bit array for the given parameters.
+ */
+int calculateArraySizeForFP(int n, double fp) {
+    // Calculate the optimal size using the formula for Bloom filter size
+    int m = ceil((n * log(fp)) / log(1 / pow(2, log(2))));
+    return m;
+}
+
+/**
+ * Calculates the optimal size of a Bloom filter bit array based on the expected number of elements.
+ *
+ * This function calculates the optimal size (number of bits) for a Bloom filter's
+ * bit array based on the expected number of elements to be inserted and the desired
+ * maximum false positive rate.
+ *
+ * @param n The expected number of elements to be inserted into the Bloom filter.
+ * @return The optimal size of the bit array for the given parameters.
+ */
+int calculateOptimalArraySize(int n) {
+    return calculateArraySizeForFP(n, MAX_FP);
+}
+
+/**
+ * Rounds a filter size up to a power of two, so that reducing a hash modulo the size is a
+ * mask and the filter can later be folded in half (see foldFilterFile).
+ *
+ * @param m  The number of bits, at most 2^31.
+ * @return The smallest power of two that is at least 'm' and at least 128.
+ */
+unsigned int roundUpToPowerOfTwo(unsigned int m) {
+    unsigned int rounded = 128;
+    while (rounded < m) {
+        rounded *= 2;
+    }
+    return rounded;
+}
+
+/**
+ * Checks whether a word is possibly in the Bloom filter's set based on its hashes.
+ *
+ * This function checks whether a given word is possibly in the Bloom filter's set
+ * based on its hash values for multiple hash functions.
+ *
+ * @param word                   The word to check.
+ * @param bitArray               The Bloom filter's bit array.
+ * @param m                      The size of the Bloom filter's bit array.
+ * @return isPossiblyInSet       Returns 1 if the word is possibly in the set, 0 otherwise.
+ */
+int lookUp(char* word, int* bitArray, int m) {
+    int isPossiblyInSet = 1;
+    // Iterate through the hash functions and check the corresponding bit
+    //#pragma omp parallel for reduction(&&:isPossiblyInSet)
+    for (int h = 0; h < k; h++) {
+        int index = APHashWithSalt(word, h, m); // Compute the hash index
+        isPossiblyInSet = (bitArray[index] && isPossiblyInSet); // Perform a logical AND operation
+    }
+    return isPossiblyInSet;
+}
+
+
+/**
+ * Checks whether a word is possibly in the Bloom filter's set from precomputed probe hashes.
+ *
+ * Same check as lookUp(), but the caller has already computed the raw probe hashes
+ * (one per salt) so they can be shared with other structures such as the count-min sketch.
+ *
+ * @param hashes                 The k raw probe hashes of the word (see APHashRawWithSalt).
+ * @param bitArray               The Bloom filter's bit array.
+ * @param m                      The size of the Bloom filter's bit array.
+ * @return isPossiblyInSet       Returns 1 if the word is possibly in the set, 0 otherwise.
+ */
+int lookUpHashes(const unsigned int *hashes, int* bitArray, int m) {
+    int isPossiblyInSet = 1;
+    for (int h = 0; h < k; h++) {
+        isPossiblyInSet = (bitArray[hashes[h] % (unsigned int)m] && isPossiblyInSet);
+    }
+    return isPossiblyInSet;
+}
+
+/**
+ * Count-min sketch used to estimate how often each query key appears.
+ *
+ * It has one row per Bloom filter probe so the raw probe hashes of a key can be reused
+ * as its column in every row, avoiding a second hashing pass.
+ */
+typedef struct {
+    int depth;              // Number of rows, equal to k.
+    unsigned int width;     // Number of counters in each row.
+    unsigned int *counters; // depth * width counters, row-major.
+} CountMinSketch;
+
+/**
+ * A heavy-hitter candidate kept while the sketch is updated.
+ */
+typedef struct {
+    char *word;                 // The query word (not owned).
+    unsigned int estimate;      // Estimated frequency of the word.
+    unsigned int hashes[MAX_K]; // The raw probe hashes, kept so the merged sketch can be read without rehashing.
+    unsigned int slot;          // The index slot that points at this candidate.
+} HeavyHitter;
+
+/**
+ * A bounded list of heavy-hitter candidates.
+ *
+ * The candidates form a min-heap on their estimates, so the estimate a new key has to beat
+ * is always at the root, and an open-addressed index keyed by the first probe hash finds
+ * a key already in the list without scanning it.
+ */
+typedef struct {
+    HeavyHitter *entries;   // Min-heap ordered by estimate.
+    int count;
+    int capacity;
+    int *index;             // Heap position + 1 of the candidate in each slot, 0 if the slot is empty.
+    unsigned int mask;      // Number of index slots minus one; at least twice the capacity.
+} HeavyHitterList;
+
+/**
+ * Allocates a zeroed count-min sketch.
+ *
+ * @param depth   The number of rows (the number of probe hashes per key).
+ * @param width   The number of counters in each row.
+ * @param sketch  The sketch to initialise.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int createCountMinSketch(int depth, unsigned int width, CountMinSketch *sketch) {
+    sketch->depth = depth;
+    sketch->width = width;
+    sketch->counters = (unsigned int *)calloc((size_t)depth * width, sizeof(unsigned int));
+    if (sketch->counters == NULL) {
+        printf("Memory allocation failed for count-min sketch.\n");
+        return -1;
+    }
+    trackMemory(MEMORY_TEMPORARY, (long)depth * width * sizeof(unsigned int));
+    return 0;
+}
+
+/**
+ * Estimates the frequency of a key as the minimum of its counters.
+ *
+ * @param sketch  The count-min sketch.
+ * @param hashes  The raw probe hashes of the key.
+ * @return The estimated number of occurrences (never an underestimate).
+ */
+unsigned int estimateCountMin(const CountMinSketch *sketch, const unsigned int *hashes) {
+    unsigned int estimate = UINT_MAX;
+    for (int r = 0; r < sketch->depth; r++) {
+        unsigned int count = sketch->counters[(size_t)r * sketch->width + hashes[r] % sketch->width];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * Adds one occurrence of a key using conservative update.
+ *
+ * Only the counters that are below the new estimate are raised, which keeps the
+ * overestimation caused by collisions much lower than a plain increment of every row.
+ *
+ * @param sketch  The count-min sketch.
+ * @param hashes  The raw probe hashes of the key.
+ * @return The new estimated frequency of the key.
+ */
+unsigned int updateCountMin(CountMinSketch *sketch, const unsigned int *hashes) {
+    unsigned int estimate = estimateCountMin(sketch, hashes) + 1;
+    for (int r = 0; r < sketch->depth; r++) {
+        unsigned int *count = &sketch->counters[(size_t)r * sketch->width + hashes[r] % sketch->width];
+        if (*count < estimate) {
+            *count = estimate;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * Allocates an empty candidate list.
+ *
+ * @param list      The list to initialise.
+ * @param capacity  The number of candidates it keeps.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int createHeavyHitterList(HeavyHitterList *list, int capacity) {
+    unsigned int slots = 16;
+    while (slots < 2 * (unsigned int)capacity) {
+        slots *= 2;
+    }
+    list->entries = (HeavyHitter *)malloc((size_t)capacity * sizeof(HeavyHitter));
+    list->index = (int *)calloc(slots, sizeof(int));
+    list->count = 0;
+    list->capacity = capacity;
+    list->mask = slots - 1;
+    if (list->entries == NULL || list->index == NULL) {
+        free(list->entries);
+        free(list->index);
+        list->entries = NULL;
+        list->index = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void freeHeavyHitterList(HeavyHitterList *list) {
+    free(list->entries);
+    free(list->index);
+}
+
+/**
+ * Returns the index slot of a key: the slot that points at it, or the empty slot where it
+ * would be inserted.
+ */
+unsigned int findHeavyHitterSlot(const HeavyHitterList *list, const char *word, const unsigned int *hashes) {
+    unsigned int slot = hashes[0] & list->mask;
+    while (list->index[slot] != 0) {
+        const HeavyHitter *entry = &list->entries[list->index[slot] - 1];
+        if (entry->hashes[0] == hashes[0] && strcmp(entry->word, word) == 0) {
+            break;
+        }
+        slot = (slot + 1) & list->mask;
+    }
+    return slot;
+}
+
+/**
+ * Empties an index slot, shifting later entries of the probe run back so every key stays
+ * reachable from its home slot.
+ */
+void removeHeavyHitterSlot(HeavyHitterList *list, unsigned int slot) {
+    unsigned int next = (slot + 1) & list->mask;
+    while (list->index[next] != 0) {
+        HeavyHitter *entry = &list->entries[list->index[next] - 1];
+        unsigned int home = entry->hashes[0] & list->mask;
+        // Move the entry back unless its home lies in the cyclic range (slot, next]
+        if (((next - home) & list->mask) >= ((next - slot) & list->mask)) {
+            list->index[slot] = list->index[next];
+            entry->slot = slot;
+            slot = next;
+        }
+        next = (next + 1) & list->mask;
+    }
+    list->index[slot] = 0;
+}
+
+/**
+ * Swaps two heap entries and repoints their index slots.
+ */
+void swapHeavyHitters(HeavyHitterList *list, int a, int b) {
+    HeavyHitter temp = list->entries[a];
+    list->entries[a] = list->entries[b];
+    list->entries[b] = temp;
+    list->index[list->entries[a].slot] = a + 1;
+    list->index[list->entries[b].slot] = b + 1;
+}
+
+/**
+ * Restores the heap order below 'position' after its estimate grew.
+ */
+void siftDownHeavyHitter(HeavyHitterList *list, int position) {
+    for (;;) {
+        int smallest = position;
+        for (int child = 2 * position + 1; child <= 2 * position + 2 && child < list->count; child++) {
+            if (list->entries[child].estimate < list->entries[smallest].estimate) {
+                smallest = child;
+            }
+        }
+        if (smallest == position) {
+            return;
+        }
+        swapHeavyHitters(list, position, smallest);
+        position = smallest;
+    }
+}
+
+/**
+ * Offers a key to a list of heavy-hitter candidates.
+ *
+ * The list keeps the 'capacity' keys with the largest estimates seen so far. A key whose
+ * estimate does not beat the smallest one of a full list is rejected in O(1); otherwise a
+ * key already present only has its estimate refreshed, and a new key replaces the smallest.
+ *
+ * @param list      The candidate list.
+ * @param word      The key that was just counted.
+ * @param hashes    The raw probe hashes of the key.
+ * @param estimate  The estimated frequency of the key.
+ */
+void offerHeavyHitter(HeavyHitterList *list, char *word, const unsigned int *hashes, unsigned int estimate) {
+    // A key at or below the minimum of a full list either is not worth adding or is listed already
+    if (list->count == list->capacity && estimate <= list->entries[0].estimate) {
+        return;
+    }
+    unsigned int slot = findHeavyHitterSlot(list, word, hashes);
+    if (list->index[slot] != 0) {
+        int position = list->index[slot] - 1;
+        list->entries[position].estimate = estimate;
+        siftDownHeavyHitter(list, position);
+        return;
+    }
+
+    int position;
+    if (list->count < list->capacity) {
+        // Append and sift up
+        position = list->count++;
+        while (position > 0 && list->entries[(position - 1) / 2].estimate > estimate) {
+            list->entries[position] = list->entries[(position - 1) / 2];
+            list->index[list->entries[position].slot] = position + 1;
+            position = (position - 1) / 2;
+        }
+    } else {
+        // Replace the root; removing its slot may shift the probe run, so find the slot again
+        removeHeavyHitterSlot(list, list->entries[0].slot);
+        slot = findHeavyHitterSlot(list, word, hashes);
+        position = 0;
+    }
+    HeavyHitter *entry = &list->entries[position];
+    entry->word = word;
+    entry->estimate = estimate;
+    memcpy(entry->hashes, hashes, k * sizeof(unsigned int));
+    entry->slot = slot;
+    list->index[slot] = position + 1;
+    siftDownHeavyHitter(list, position);
+}
+
+/**
+ * Orders heavy hitters by descending estimate, then by word so duplicates end up adjacent.
+ */
+int compareHeavyHitters(const void *a, const void *b) {
+    const HeavyHitter *left = (const HeavyHitter *)a;
+    const HeavyHitter *right = (const HeavyHitter *)b;
+    if (left->estimate != right->estimate) {
+        return left->estimate < right->estimate ? 1 : -1;
+    }
+    return strcmp(left->word, right->word);
+}
+
+/**
+ * Prints the most frequent query keys from the merged sketch and per-thread candidates.
+ *
+ * Each candidate is re-estimated against the merged sketch using its stored probe hashes,
+ * then duplicates found by several threads are dropped.
+ *
+ * @param sketch         The merged count-min sketch.
+ * @param candidates     The candidates collected by all threads.
+ * @param numCandidates  The number of candidates.
+ * @param topK           The number of keys to report.
+ */
+void reportHeavyHitters(const CountMinSketch *sketch, HeavyHitter *candidates, int numCandidates, int topK) {
+    for (int i = 0; i < numCandidates; i++) {
+        candidates[i].estimate = estimateCountMin(sketch, candidates[i].hashes);
+    }
+    qsort(candidates, numCandidates, sizeof(HeavyHitter), compareHeavyHitters);
+
+    printf("Top %d query keys by estimated frequency:\n", topK);
+    int reported = 0;
+    for (int i = 0; i < numCandidates && reported < topK; i++) {
+        if (i > 0 && strcmp(candidates[i].word, candidates[i - 1].word) == 0) {
+            continue;
+        }
+        printf("  %s %u\n", candidates[i].word, candidates[i].estimate);
+        reported++;
+    }
+}
+
+/**
+ * Estimates the number of records (lines) in a file without reading all of it.
+ *
+ * The file size comes from fstat and the average record length from a sampled prefix
+ * of at most SAMPLE_BYTES, so the cost does not grow with the file.
+ *
+ * @param file       The open file; its position is restored to the beginning.
+ * @param fileSize   A pointer where the file size in bytes is stored, or NULL.
+ * @return The estimated number of records, at least 1.
+ */
+long estimateRecordCount(FILE *file, long *fileSize) {
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0) {
+        return 1;
+    }
+    if (fileSize != NULL) {
+        *fileSize = info.st_size;
+    }
+
+    char sample[SAMPLE_BYTES];
+    size_t sampled = fread(sample, 1, sizeof(sample), file);
+    fseek(file, 0, SEEK_SET);
+
+    long records = 0;
+    for (size_t i = 0; i < sampled; i++) {
+        if (sample[i] == '\n') {
+            records++;
+        }
+    }
+    // A prefix without any newline is a single record
+    if (records == 0) {
+        return 1;
+    }
+    double averageLength = (double)sampled / records;
+    return (long)(info.st_size / averageLength) + 1;
+}
+
+/**
+ * Reads the next whitespace-separated word of a file into a MAX_WORD_LENGTH buffer.
+ * Longer words are truncated and the rest of them is skipped.
+ *
+ * @param file  The open file.
+ * @param word  The buffer, MAX_WORD_LENGTH bytes.
+ * @return 1 if a word was read, 0 at the end of the file.
+ */
+int readWord(FILE *file, char *word) {
+    if (fscanf(file, WORD_FORMAT, word) != 1) {
+        return 0;
+    }
+    fscanf(file, "%*[^ \t\r\n]");
+    return 1;
+}
+
+/**
+ * Reads query words and query bits from a file into memory.
+ *
+ * This function reads words and their corresponding query bits from a file and
+ * stores them in dynamically allocated memory. Each word[i] will have its respective
+ * bit stored in bits[i], indicating whether the word actually exists in the filter or 
+ * not. The buffers are sized from estimateRecordCount() with some headroom, so the file
+ * is read only once; they grow if the estimate turns out to be too small.
+ *
+ * @param fileName     The name of the file to read.
+ * @param wordsBuffer  A pointer to the buffer where word strings will be stored.
+ * @param bits         A pointer to the buffer where query bits will be stored for each respective word.
+ * @param length       A pointer to an integer that will store the length of the created arrays.
+ */
+void readQuery(const char *fileName, char ***wordsBuffer, int **bits, int *length) {
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        perror("Error opening file");
+        return;
+    }
+
+    char word[MAX_WORD_LENGTH];
+    int queryBit;
+    int fileLength = 0;
+    long capacity = estimateRecordCount(file, NULL) * SIZING_HEADROOM + 1;
+
+    *wordsBuffer = (char **)malloc(capacity * sizeof(char *));
+    *bits = (int *)malloc(capacity * sizeof(int));
+
+    if (*wordsBuffer == NULL || *bits == NULL) {
+        perror("Memory allocation failed");
+        fclose(file);
+        
+        // Free memory allocated for words and bits in case of an error
+        free(*wordsBuffer);
+        free(*bits);
+        *wordsBuffer = NULL;
+        *bits = NULL;
+        
+        return;
+    }
+
+    // Read words and query bits into the buffer
+    while (readWord(file, word) && fscanf(file, "%d", &queryBit) == 1) {
+        if (fileLength == capacity) {
+            // The sampled estimate was too low, double the buffers
+            capacity *= 2;
+            char **grownWords = (char **)realloc(*wordsBuffer, capacity * sizeof(char *));
+            if (grownWords != NULL) {
+                *wordsBuffer = grownWords;
+            }
+            int *grownBits = (int *)realloc(*bits, capacity * sizeof(int));
+            if (grownBits != NULL) {
+                *bits = grownBits;
+            }
+            if (grownWords == NULL || grownBits == NULL) {
+                perror("Memory allocation failed");
+                break;
+            }
+        }
+        (*wordsBuffer)[fileLength] = strdup(word);
+        (*bits)[fileLength] = queryBit;
+        trackMemory(MEMORY_QUERIES, strlen(word) + 1 + MALLOC_OVERHEAD);
+        fileLength++;
+    }
+    // Give back the unused headroom
+    if (fileLength > 0 && fileLength < capacity) {
+        char **shrunkWords = (char **)realloc(*wordsBuffer, fileLength * sizeof(char *));
+        if (shrunkWords != NULL) {
+            *wordsBuffer = shrunkWords;
+        }
+        int *shrunkBits = (int *)realloc(*bits, fileLength * sizeof(int));
+        if (shrunkBits != NULL) {
+            *bits = shrunkBits;
+        }
+    }
+    trackMemory(MEMORY_QUERIES, fileLength * (sizeof(char *) + sizeof(int)));
+    // Close file and then update the length of the query Array
+    fclose(file);
+    *length = fileLength;
+}
+
+/**
+ * Outcome counts of a set of labelled queries.
+ */
+typedef struct {
+    long totalPositive;
+    long totalNegative;
+    long fNegative;
+    long fPositive;
+} QueryCounts;
+
+/**
+ * Prints the false negative and false positive percentages of a set of queries; a rate with
+ * no queries to measure it on is printed as 0.
+ */
+void printQueryCounts(const QueryCounts *counts) {
+    printf("False Negative Percentage: %lf%%\n", counts->totalPositive > 0 ? (double)counts->fNegative / counts->totalPositive * 100 : 0);
+    printf("False Positive Percentage: %lf%%\n", counts->totalNegative > 0 ? (double)counts->fPositive / counts->totalNegative * 100 : 0);
+}
+
+/**
+ * Adds the outcomes of a batch of queries, counted from its packed result bitmap, to
+ * 'counts' and prints the batch's false negatives in query order.
+ *
+ * The result of query i is bit i % 64 of results[i / 64]. The expected bits are packed the
+ * same way into a positive and a negative bitmap, so every count is the popcount of an AND
+ * or ANDNOT of two bitmaps, with no branch per query; queries whose expected bit is
+ * neither 0 nor 1 are in neither bitmap. The false negatives are read back from their
+ * bitmap after the counts, so the lookup loops never print.
+ *
+ * @param results  The packed lookup results, (length + 63) / 64 words with the unused bits clear.
+ * @param words    The query words.
+ * @param bits     The expected query bits.
+ * @param length   The number of queries.
+ * @param counts   The counts to add to.
+ */
+void countQueryResults(const unsigned long long *results, char **words, const int *bits, int length, QueryCounts *counts) {
+    int numWords = (length + 63) / 64;
+    unsigned long long *expected = (unsigned long long *)malloc(2 * ((size_t)numWords + 1) * sizeof(unsigned long long));
+    if (expected == NULL) {
+        printf("Memory allocation failed for the expected bitmaps.\n");
+        return;
+    }
+    unsigned long long *positive = expected, *negative = expected + numWords + 1;
+    trackMemory(MEMORY_TEMPORARY, 2 * ((long)numWords + 1) * sizeof(unsigned long long));
+
+    #pragma omp parallel for schedule(static)
+    for (int w = 0; w < numWords; w++) {
+        unsigned long long positiveWord = 0, negativeWord = 0;
+        int count = length - w * 64 < 64 ? length - w * 64 : 64;
+        for (int j = 0; j < count; j++) {
+            positiveWord |= (unsigned long long)(bits[w * 64 + j] == 1) << j;
+            negativeWord |= (unsigned long long)(bits[w * 64 + j] == 0) << j;
+        }
+        positive[w] = positiveWord;
+        negative[w] = negativeWord;
+    }
+
+    long totalPositive = 0, totalNegative = 0, fNegative = 0, fPositive = 0;
+    #pragma omp parallel for simd reduction(+:totalPositive, totalNegative, fNegative, fPositive) schedule(static)
+    for (int w = 0; w < numWords; w++) {
+        totalPositive += __builtin_popcountll(positive[w]);
+        totalNegative += __builtin_popcountll(negative[w]);
+        fNegative += __builtin_popcountll(positive[w] & ~results[w]);
+        fPositive += __builtin_popcountll(negative[w] & results[w]);
+    }
+
+    for (int w = 0; w < numWords && fNegative > 0; w++) {
+        for (unsigned long long missed = positive[w] & ~results[w]; missed != 0; missed &= missed - 1) {
+            printf("Word is %s \n", words[w * 64 + __builtin_ctzll(missed)]);
+        }
+    }
+    counts->totalPositive += totalPositive;
+    counts->totalNegative += totalNegative;
+    counts->fNegative += fNegative;
+    counts->fPositive += fPositive;
+
+    free(expected);
+    trackMemory(MEMORY_TEMPORARY, -(long)(2 * ((long)numWords + 1) * sizeof(unsigned long long)));
+}
+
+/**
+ * Counts the outcomes of a set of queries from its packed result bitmap with
+ * countQueryResults() and prints the false negatives and the error percentages.
+ */
+void reportQueryResults(const unsigned long long *results, char **words, const int *bits, int length) {
+    QueryCounts counts = {0};
+    countQueryResults(results, words, bits, length, &counts);
+    printQueryCounts(&counts);
+}
+
+/**
+ * Test words against a Bloom filter and calculate false positive and false negative percentages.
+ *
+ * This function tests words against a Bloom filter represented by the bitArray. It calculates
+ * the false positive and false negative percentages based on the expected query bits.
+ * Each thread looks up 64 queries at a time into one word of a result bitmap, which
+ * reportQueryResults() compares with the expected bits.
+ * When 'topK' is positive, the probe hashes of every query also feed a per-thread count-min
+ * sketch and are saved. The sketches are merged at the end, and every query is offered with
+ * its merged estimate, read through its saved hashes, to per-thread candidate lists, so a key
+ * that is frequent overall but spread across threads cannot be evicted by keys that are only
+ * locally frequent.
+ * @param bitArray        The Bloom filter represented as an array of bits.
+ * @param words           An array of query words to test.
+ * @param bits            An array of expected query bits.
+ * @param length          The number of words and bits to test.
+ * @param m               The size of the Bloom filter bitArray.
+ * @param topK            The number of most frequent query keys to report, or 0 to disable.
+ */
+void testBloomWithQueries(int *bitArray, char **words, int *bits, int length, int m, int topK) {
+    // One result bit per query
+    int numResultWords = (length + 63) / 64;
+    unsigned long long *results = (unsigned long long *)malloc(((size_t)numResultWords + 1) * sizeof(unsigned long long));
+    if (results == NULL) {
+        printf("Memory allocation failed for the query results.\n");
+        return;
+    }
+    trackMemory(MEMORY_TEMPORARY, ((long)numResultWords + 1) * sizeof(unsigned long long));
+
+    // Merged sketch, the probe hashes of every query and the heavy-hitter candidates of every thread
+    CountMinSketch merged = {0};
+    HeavyHitter *candidates = NULL;
+    unsigned int *queryHashes = NULL;
+    long hashBytes = (long)((size_t)length * k * sizeof(unsigned int));
+    int numThreads = omp_get_max_threads();
+    HeavyHitterList *lists = NULL;
+    if (topK > 0) {
+        queryHashes = (unsigned int *)malloc((size_t)hashBytes + sizeof(unsigned int));
+        candidates = (HeavyHitter *)malloc((size_t)numThreads * topK * sizeof(HeavyHitter));
+        lists = (HeavyHitterList *)calloc(numThreads, sizeof(HeavyHitterList));
+        int created = 0;
+        while (lists != NULL && created < numThreads && createHeavyHitterList(&lists[created], topK) == 0) {
+            created++;
+        }
+        if (queryHashes == NULL || candidates == NULL || created < numThreads || createCountMinSketch(k, CMS_WIDTH, &merged) != 0) {
+            printf("Frequency tracking disabled.\n");
+            for (int t = 0; t < created; t++) {
+                freeHeavyHitterList(&lists[t]);
+            }
+            free(queryHashes);
+            free(candidates);
+            free(lists);
+            queryHashes = NULL;
+            candidates = NULL;
+            lists = NULL;
+            topK = 0;
+        } else {
+            trackMemory(MEMORY_TEMPORARY, hashBytes);
+        }
+    }
+
+    #pragma omp parallel
+    {
+        CountMinSketch sketch = {0};
+        int tracking = topK > 0 && createCountMinSketch(k, CMS_WIDTH, &sketch) == 0;
+        unsigned int localHashes[MAX_K];
+        double spanStart = traceNow();
+
+        // Each iteration fills one word of the result bitmap from 64 queries.
+        #pragma omp for schedule(static) nowait
+        for (int w = 0; w < numResultWords; w++) {
+            unsigned long long result = 0;
+            int count = length - w * 64 < 64 ? length - w * 64 : 64;
+            for (int j = 0; j < count; j++) {
+                char *tempWord = words[w * 64 + j];
+                long lookupStart = metricsLookupStart();
+                // Hash the word once; the probe hashes serve the filter, the sketch and the ranking.
+                unsigned int *hashes = queryHashes != NULL ? &queryHashes[(size_t)(w * 64 + j) * k] : localHashes;
+                for (int h = 0; h < k; h++) {
+                    hashes[h] = APHashRawWithSalt(tempWord, h);
+                }
+                // Get the lookup result from the bloom filter.
+                int lookupResult = lookUpHashes(hashes, bitArray, m);
+                metricsLookupEnd(lookupStart, lookupResult);
+                result |= (unsigned long long)lookupResult << j;
+
+                if (tracking) {
+                    updateCountMin(&sketch, hashes);
+                }
+            }
+            results[w] = result;
+        }
+
+        traceSpan("query chunk", spanStart);
+
+        // Sum the per-thread sketches; each one overestimates its own share, so the sum still overestimates
+        if (tracking) {
+            size_t numCounters = (size_t)sketch.depth * sketch.width;
+            #pragma omp critical
+            for (size_t c = 0; c < numCounters; c++) {
+                merged.counters[c] += sketch.counters[c];
+            }
+        }
+        if (tracking) {
+            trackMemory(MEMORY_TEMPORARY, -(long)((long)sketch.depth * sketch.width * sizeof(unsigned int)));
+        }
+        free(sketch.counters);
+    }
+    // Print the test result
+    reportQueryResults(results, words, bits, length);
+    free(results);
+    trackMemory(MEMORY_TEMPORARY, -(long)(((long)numResultWords + 1) * sizeof(unsigned long long)));
+
+    if (topK > 0) {
+        // Select candidates by their merged estimates; every thread sees the same counts
+        #pragma omp parallel
+        {
+            HeavyHitterList *list = &lists[omp_get_thread_num()];
+            #pragma omp for schedule(static)
+            for (int i = 0; i < length; i++) {
+                const unsigned int *hashes = &queryHashes[(size_t)i * k];
+                offerHeavyHitter(list, words[i], hashes, estimateCountMin(&merged, hashes));
+            }
+        }
+        // Gather the candidates of every thread into one contiguous list
+        int total = 0;
+        for (int t = 0; t < numThreads; t++) {
+            memcpy(&candidates[total], lists[t].entries, lists[t].count * sizeof(HeavyHitter));
+            total += lists[t].count;
+            freeHeavyHitterList(&lists[t]);
+        }
+        reportHeavyHitters(&merged, candidates, total, topK);
+        free(queryHashes);
+        trackMemory(MEMORY_TEMPORARY, -hashBytes);
+    }
+    if (merged.counters != NULL) {
+        trackMemory(MEMORY_TEMPORARY, -(long)((long)merged.depth * merged.width * sizeof(unsigned int)));
+    }
+    free(merged.counters);
+    free(candidates);
+    free(lists);
+}
+
+/**
+ * One stage of a scalable Bloom filter, stored as packed bits.
+ */
+typedef struct {
+    unsigned long long *words;  // The bit array, 64 bits per word.
+    unsigned int m;             // Number of bits.
+    int k;                      // Number of hash functions.
+    long capacity;              // Number of words the stage was sized for.
+    long count;                 // Number of words inserted so far.
+} BloomStage;
+
+/**
+ * A Bloom filter that grows by adding stages once the current one is full.
+ *
+ * The first stage gets STAGE0_FP_SHARE of the false positive budget, so a good size
+ * estimate costs almost nothing; every later stage doubles the capacity and halves
+ * its share of the rest, keeping the total within 'fp'.
+ */
+typedef struct {
+    double fp;                          // Target false positive rate of the whole filter.
+    int numStages;                      // Number of stages in use.
+    BloomStage stages[MAX_STAGES];      // The stages, oldest first.
+} ScalableBloomFilter;
+
+/**
+ * Appends a stage sized for 'capacity' words to a scalable Bloom filter.
+ *
+ * @param filter    The scalable filter.
+ * @param capacity  The number of words the new stage should hold.
+ * @return 0 on success, -1 if no stage could be added.
+ */
+int addScalableStage(ScalableBloomFilter *filter, long capacity) {
+    if (filter->numStages == MAX_STAGES) {
+        printf("Scalable filter has reached %d stages.\n", MAX_STAGES);
+        return -1;
+    }
+    int i = filter->numStages;
+    double fp = i == 0 ? filter->fp * STAGE0_FP_SHARE : filter->fp * (1 - STAGE0_FP_SHARE) * ldexp(1.0, -i);
+
+    BloomStage *stage = &filter->stages[i];
+    stage->capacity = capacity > 0 ? capacity : 1;
+    stage->m = ceil(-stage->capacity * log(fp) / (log(2) * log(2)));
+    stage->k = round((double)stage->m / stage->capacity * log(2));
+    if (stage->k < 1) {
+        stage->k = 1;
+    }
+    stage->count = 0;
+    stage->words = (unsigned long long *)calloc((stage->m + 63) / 64, sizeof(unsigned long long));
+    if (stage->words == NULL) {
+        printf("Memory allocation failed for filter stage.\n");
+        return -1;
+    }
+    trackMemory(MEMORY_FILTER, (stage->m + 63) / 64 * sizeof(unsigned long long));
+    filter->numStages++;
+    return 0;
+}
+
+/**
+ * Inserts a batch of words into a scalable Bloom filter in parallel.
+ *
+ * Words go to the newest stage until it reaches its capacity, after which a stage
+ * with twice the capacity is added.
+ *
+ * @param filter    The scalable filter, with at least one stage.
+ * @param words     The words to insert.
+ * @param numWords  The number of words in the batch.
+ * @return 0 on success, -1 if the filter could not grow.
+ */
+int insertScalableBatch(ScalableBloomFilter *filter, char **words, int numWords) {
+    int done = 0;
+    while (done < numWords) {
+        BloomStage *stage = &filter->stages[filter->numStages - 1];
+        if (stage->count == stage->capacity) {
+            if (addScalableStage(filter, stage->capacity * 2) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        long room = stage->capacity - stage->count;
+        int take = numWords - done < room ? numWords - done : (int)room;
+
+        // Several words can set bits in the same 64-bit word, so the OR must be atomic
+        #pragma omp parallel for schedule(static)
+        for (int i = done; i < done + take; i++) {
+            for (int h = 0; h < stage->k; h++) {
+                unsigned int index = APHashRawWithSalt(words[i], h) % stage->m;
+                __atomic_fetch_or(&stage->words[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+            }
+        }
+        stage->count += take;
+        done += take;
+    }
+    return 0;
+}
+
+/**
+ * Checks whether a word is possibly in any stage of a scalable Bloom filter.
+ *
+ * @param word    The word to check.
+ * @param filter  The scalable filter.
+ * @return 1 if the word is possibly in the set, 0 otherwise.
+ */
+int lookUpScalable(char *word, const ScalableBloomFilter *filter) {
+    for (int i = 0; i < filter->numStages; i++) {
+        const BloomStage *stage = &filter->stages[i];
+        int isPossiblyInSet = 1;
+        for (int h = 0; h < stage->k && isPossiblyInSet; h++) {
+            unsigned int index = APHashRawWithSalt(word, h) % stage->m;
+            isPossiblyInSet = (stage->words[index / 64] >> (index % 64)) & 1;
+        }
+        if (isPossiblyInSet) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Frees the stages of a scalable Bloom filter.
+ */
+void freeScalableFilter(ScalableBloomFilter *filter) {
+    for (int i = 0; i < filter->numStages; i++) {
+        free(filter->stages[i].words);
+        trackMemory(MEMORY_FILTER, -(long)((filter->stages[i].m + 63) / 64 * sizeof(unsigned long long)));
+    }
+    filter->numStages = 0;
+}
+
+/**
+ * Builds a scalable Bloom filter from a word file in a single streaming pass.
+ *
+ * The first stage is sized from estimateRecordCount() plus SIZING_HEADROOM, so the file
+ * is never counted up front and the words are never kept in memory; they are read in
+ * batches of STREAM_BATCH and inserted in parallel.
+ *
+ * @param filename  The word file.
+ * @param filter    The scalable filter to build; 'fp' must be set by the caller.
+ * @param estimate  A pointer where the estimated number of words is stored.
+ * @return The number of words inserted, or -1 on failure.
+ */
+long buildScalableFromFile(const char *filename, ScalableBloomFilter *filter, long *estimate) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    *estimate = estimateRecordCount(file, NULL);
+    char (*batch)[MAX_WORD_LENGTH] = malloc(STREAM_BATCH * sizeof(*batch));
+    char **batchWords = (char **)malloc(STREAM_BATCH * sizeof(char *));
+    if (batch == NULL || batchWords == NULL || addScalableStage(filter, *estimate * SIZING_HEADROOM) != 0) {
+        printf("Memory allocation failed for streaming batch.\n");
+        free(batch);
+        free(batchWords);
+        fclose(file);
+        return -1;
+    }
+    for (int i = 0; i < STREAM_BATCH; i++) {
+        batchWords[i] = batch[i];
+    }
+    trackMemory(MEMORY_TEMPORARY, STREAM_BATCH * (MAX_WORD_LENGTH + sizeof(char *)));
+
+    long total = 0;
+    int numInBatch;
+    do {
+        numInBatch = 0;
+        while (numInBatch < STREAM_BATCH && readWord(file, batch[numInBatch])) {
+            numInBatch++;
+        }
+        double spanStart = traceNow();
+        int result = insertScalableBatch(filter, batchWords, numInBatch);
+        traceSpan("insert batch", spanStart);
+        metricsRecordInserts(numInBatch);
+        if (result != 0) {
+            total = -1;
+            break;
+        }
+        total += numInBatch;
+    } while (numInBatch == STREAM_BATCH);
+
+    free(batch);
+    free(batchWords);
+    trackMemory(MEMORY_TEMPORARY, -(long)(STREAM_BATCH * (MAX_WORD_LENGTH + sizeof(char *))));
+    fclose(file);
+    return total;
+}
+
+/**
+ * Tests a query file against a scalable Bloom filter without loading the file.
+ *
+ * Queries are read in batches of STREAM_BATCH and looked up in parallel, 64 at a time into
+ * one word of a result bitmap; countQueryResults() adds up each batch and the percentages
+ * are printed like testBloomWithQueries().
+ *
+ * @param filter    The scalable filter.
+ * @param filename  The query file, with a word and its expected bit on each line.
+ */
+void testScalableWithQueryFile(const ScalableBloomFilter *filter, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening file");
+        return;
+    }
+
+    char (*batch)[MAX_WORD_LENGTH] = malloc(STREAM_BATCH * sizeof(*batch));
+    char **batchWords = (char **)malloc(STREAM_BATCH * sizeof(char *));
+    int *batchBits = (int *)malloc(STREAM_BATCH * sizeof(int));
+    unsigned long long *results = (unsigned long long *)malloc((STREAM_BATCH + 63) / 64 * sizeof(unsigned long long));
+    long batchBytes = (long)(STREAM_BATCH * (MAX_WORD_LENGTH + sizeof(char *) + sizeof(int)) +
+                             (STREAM_BATCH + 63) / 64 * sizeof(unsigned long long));
+    if (batch == NULL || batchWords == NULL || batchBits == NULL || results == NULL) {
+        printf("Memory allocation failed for streaming batch.\n");
+        free(batch);
+        free(batchWords);
+        free(batchBits);
+        free(results);
+        fclose(file);
+        return;
+    }
+    for (int i = 0; i < STREAM_BATCH; i++) {
+        batchWords[i] = batch[i];
+    }
+    trackMemory(MEMORY_TEMPORARY, batchBytes);
+
+    QueryCounts counts = {0};
+    int numInBatch;
+    do {
+        numInBatch = 0;
+        while (numInBatch < STREAM_BATCH && readWord(file, batch[numInBatch]) &&
+               fscanf(file, "%d", &batchBits[numInBatch]) == 1) {
+            numInBatch++;
+        }
+
+        double spanStart = traceNow();
+        int numResultWords = (numInBatch + 63) / 64;
+        #pragma omp parallel for schedule(static)
+        for (int w = 0; w < numResultWords; w++) {
+            unsigned long long result = 0;
+            int count = numInBatch - w * 64 < 64 ? numInBatch - w * 64 : 64;
+            for (int j = 0; j < count; j++) {
+                long lookupStart = metricsLookupStart();
+                int lookupResult = lookUpScalable(batch[w * 64 + j], filter);
+                metricsLookupEnd(lookupStart, lookupResult);
+                result |= (unsigned long long)lookupResult << j;
+            }
+            results[w] = result;
+        }
+        traceSpan("query batch", spanStart);
+        countQueryResults(results, batchWords, batchBits, numInBatch, &counts);
+    } while (numInBatch == STREAM_BATCH);
+
+    printQueryCounts(&counts);
+    free(batch);
+    free(batchWords);
+    free(batchBits);
+    free(results);
+    trackMemory(MEMORY_TEMPORARY, -batchBytes);
+    fclose(file);
+}
+
+/**
+ * Data besides the words that an engine may build from.
+ */
+typedef struct {
+    char **queries;     // Labelled queries; the learned engine trains on the negatives.
+    int *bits;          // Expected query bits, 1 for a word in the set.
+    int numQueries;
+    char **profileKeys; // Query frequency profile of the weighted engine.
+    int *profileCounts; // Times each profile key was queried.
+    int profileSize;    // Profile entries, or 0 without a profile.
+} EngineInput;
+
+/**
+ * A set of bit positions that starts sparse and becomes a dense bitset when it fills up.
+ *
+ * While sparse, the set bits are kept as a sorted array of positions, which costs 4 bytes
+ * per set bit instead of m / 8 bytes for the whole bitset. Once more than
+ * SPARSE_MAX_DENSITY of the bits are set, the positions are converted to packed words.
+ */
+typedef struct {
+    unsigned int m;                 // Number of bits.
+    int dense;                      // 1 once the set uses 'words', 0 while it uses 'positions'.
+    unsigned int count;             // Number of positions stored (sparse form only).
+    unsigned int *positions;        // Sorted, unique set bit positions (sparse form).
+    unsigned long long *words;      // Packed bits, 64 per word (dense form).
+} AdaptiveBitSet;
+
+/**
+ * Compares two bit positions for qsort.
+ */
+int comparePositions(const void *a, const void *b) {
+    unsigned int left = *(const unsigned int *)a;
+    unsigned int right = *(const unsigned int *)b;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Converts a sparse bit set to its dense form.
+ *
+ * @param set  The bit set; nothing happens if it is already dense.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int densifyAdaptive(AdaptiveBitSet *set) {
+    if (set->dense) {
+        return 0;
+    }
+    unsigned long long *words = (unsigned long long *)calloc((set->m + 63) / 64, sizeof(unsigned long long));
+    if (words == NULL) {
+        printf("Memory allocation failed for dense bit set.\n");
+        return -1;
+    }
+    for (unsigned int i = 0; i < set->count; i++) {
+        words[set->positions[i] / 64] |= 1ULL << (set->positions[i] % 64);
+    }
+    free(set->positions);
+    set->positions = NULL;
+    set->count = 0;
+    set->words = words;
+    set->dense = 1;
+    return 0;
+}
+
+/**
+ * Adds a batch of positions to an adaptive bit set.
+ *
+ * In the sparse form the batch is sorted and merged with the existing positions in one
+ * linear pass; the set turns dense once it passes SPARSE_MAX_DENSITY.
+ *
+ * @param set           The bit set.
+ * @param positions     The positions to set; the array is sorted in place.
+ * @param numPositions  The number of positions.
+ * @return 0 on success, -1 if an allocation failed.
+ */
+int addAdaptivePositions(AdaptiveBitSet *set, unsigned int *positions, unsigned int numPositions) {
+    if (!set->dense && set->count + numPositions > set->m * SPARSE_MAX_DENSITY) {
+        if (densifyAdaptive(set) != 0) {
+            return -1;
+        }
+    }
+    if (set->dense) {
+        for (unsigned int i = 0; i < numPositions; i++) {
+            set->words[positions[i] / 64] |= 1ULL << (positions[i] % 64);
+        }
+        return 0;
+    }
+
+    qsort(positions, numPositions, sizeof(unsigned int), comparePositions);
+    unsigned int *merged = (unsigned int *)malloc((set->count + numPositions + 1) * sizeof(unsigned int));
+    if (merged == NULL) {
+        printf("Memory allocation failed for sparse bit set.\n");
+        return -1;
+    }
+
+    // Merge the two sorted lists, dropping duplicates
+    unsigned int i = 0, j = 0, n = 0;
+    while (i < set->count || j < numPositions) {
+        unsigned int next;
+        if (j == numPositions || (i < set->count && set->positions[i] <= positions[j])) {
+            next = set->positions[i++];
+        } else {
+            next = positions[j++];
+        }
+        if (n == 0 || merged[n - 1] != next) {
+            merged[n++] = next;
+        }
+    }
+    free(set->positions);
+    set->positions = merged;
+    set->count = n;
+    return 0;
+}
+
+/**
+ * Tests whether a position is set in an adaptive bit set.
+ *
+ * @param set       The bit set.
+ * @param position  The bit position.
+ * @return 1 if the bit is set, 0 otherwise.
+ */
+int testAdaptive(const AdaptiveBitSet *set, unsigned int position) {
+    if (set->dense) {
+        return (set->words[position / 64] >> (position % 64)) & 1;
+    }
+    // Binary search the sorted positions
+    unsigned int low = 0, high = set->count;
+    while (low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if (set->positions[middle] < position) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < set->count && set->positions[low] == position;
+}
+
+/**
+ * Adds every bit of one adaptive bit set to another of the same size.
+ *
+ * Works on any combination of sparse and dense forms; 'into' becomes dense when 'from'
+ * is dense or when the union passes SPARSE_MAX_DENSITY.
+ *
+ * @param into  The bit set that receives the union.
+ * @param from  The bit set to add.
+ * @return 0 on success, -1 if an allocation failed.
+ */
+int unionAdaptive(AdaptiveBitSet *into, const AdaptiveBitSet *from) {
+    if (!from->dense) {
+        // Copy because addAdaptivePositions sorts its input in place
+        unsigned int *positions = (unsigned int *)malloc((from->count + 1) * sizeof(unsigned int));
+        if (positions == NULL) {
+            printf("Memory allocation failed for sparse bit set.\n");
+            return -1;
+        }
+        memcpy(positions, from->positions, from->count * sizeof(unsigned int));
+        int result = addAdaptivePositions(into, positions, from->count);
+        free(positions);
+        return result;
+    }
+    if (densifyAdaptive(into) != 0) {
+        return -1;
+    }
+    unsigned int numWords = (into->m + 63) / 64;
+    for (unsigned int w = 0; w < numWords; w++) {
+        into->words[w] |= from->words[w];
+    }
+    return 0;
+}
+
+/**
+ * Returns the number of bytes held by an adaptive bit set.
+ */
+size_t adaptiveBytes(const void *filter) {
+    const AdaptiveBitSet *set = (const AdaptiveBitSet *)filter;
+    if (set->dense) {
+        return sizeof(AdaptiveBitSet) + (size_t)(set->m + 63) / 64 * sizeof(unsigned long long);
+    }
+    return sizeof(AdaptiveBitSet) + (size_t)set->count * sizeof(unsigned int);
+}
+
+/**
+ * Frees an adaptive bit set allocated by buildAdaptiveFilter().
+ */
+void freeAdaptive(void *filter) {
+    AdaptiveBitSet *set = (AdaptiveBitSet *)filter;
+    free(set->positions);
+    free(set->words);
+    free(set);
+}
+
+/**
+ * Builds a Bloom filter stored as an adaptive bit set.
+ *
+ * Each thread hashes its share of the words into its own set, using the same probe
+ * positions as insertWords(), and the thread sets are then combined with unionAdaptive().
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @param m         The number of bits in the filter.
+ * @param input     Not used by this engine.
+ * @return The filter, or NULL on failure.
+ */
+void *buildAdaptiveFilter(char **words, int numWords, int m, const EngineInput *input) {
+    AdaptiveBitSet *filter = (AdaptiveBitSet *)calloc(1, sizeof(AdaptiveBitSet));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->m = m;
+    int failed = 0;
+    // Until it is returned, the filter is build-time memory like the per-thread sets
+    trackMemory(MEMORY_TEMPORARY, adaptiveBytes(filter));
+
+    #pragma omp parallel reduction(|:failed)
+    {
+        AdaptiveBitSet local = {0};
+        local.m = m;
+        int thread = omp_get_thread_num();
+        int numThreads = omp_get_num_threads();
+        int first = (long)numWords * thread / numThreads;
+        int last = (long)numWords * (thread + 1) / numThreads;
+
+        unsigned int numPositions = (unsigned int)(last - first) * k;
+        unsigned int *positions = (unsigned int *)malloc((numPositions + 1) * sizeof(unsigned int));
+        long localBytes = 0;
+        if (positions == NULL) {
+            failed = 1;
+        } else {
+            trackMemory(MEMORY_TEMPORARY, (long)((numPositions + 1) * sizeof(unsigned int)));
+            unsigned int n = 0;
+            for (int i = first; i < last; i++) {
+                for (int h = 0; h < k; h++) {
+                    positions[n++] = APHashWithSalt(words[i], h, m);
+                }
+            }
+            failed = addAdaptivePositions(&local, positions, n) != 0;
+            localBytes = (long)(adaptiveBytes(&local) - sizeof(AdaptiveBitSet));
+            trackMemory(MEMORY_TEMPORARY, localBytes);
+            free(positions);
+            trackMemory(MEMORY_TEMPORARY, -(long)((numPositions + 1) * sizeof(unsigned int)));
+        }
+
+        #pragma omp critical
+        if (!failed) {
+            long filterBytes = (long)adaptiveBytes(filter);
+            failed = unionAdaptive(filter, &local) != 0;
+            trackMemory(MEMORY_TEMPORARY, (long)adaptiveBytes(filter) - filterBytes);
+        }
+        free(local.positions);
+        free(local.words);
+        trackMemory(MEMORY_TEMPORARY, -localBytes);
+    }
+
+    trackMemory(MEMORY_TEMPORARY, -(long)adaptiveBytes(filter));
+    if (failed) {
+        freeAdaptive(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+/**
+ * Checks whether a word is possibly in a Bloom filter stored as an adaptive bit set.
+ *
+ * @param word    The word to check.
+ * @param filter  The AdaptiveBitSet built by buildAdaptiveFilter().
+ * @return 1 if the word is possibly in the set, 0 otherwise.
+ */
+int lookUpAdaptive(char *word, const void *filter) {
+    const AdaptiveBitSet *set = (const AdaptiveBitSet *)filter;
+    for (int h = 0; h < k; h++) {
+        if (!testAdaptive(set, APHashWithSalt(word, h, set->m))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Two-tier Bloom filter: a small blocked filter that fits in L2 in front of a back filter.
+ *
+ * The front filter uses a single 64-bit hash per word, with all of its probes inside one
+ * 64-byte block, so most negative lookups cost one cache line that is already resident.
+ * Only words that pass it are checked against the back filter. A false positive has to
+ * pass both, so the back filter is sized for the classic rate divided by the front's,
+ * which keeps the combined rate at the classic target for about the classic memory.
+ */
+typedef struct {
+    unsigned long long *front;  // Front filter blocks, FRONT_BLOCK_WORDS words each.
+    unsigned int numBlocks;     // Number of front filter blocks.
+    int frontK;                 // Number of probes in the front filter.
+    unsigned long long *back;   // Back filter, packed bits.
+    unsigned int m;             // Number of bits in the back filter.
+    int backK;                  // Number of probes in the back filter.
+    double expectedFP;          // Product of the front and back false positive rates.
+} TieredFilter;
+
+/**
+ * Returns the front filter block of a hash. The probes use its low 63 bits, so the block
+ * is taken from a remix rather than from the same bits.
+ */
+const unsigned long long *tieredBlock(const TieredFilter *filter, unsigned long long hash) {
+    unsigned long long remix = (hash ^ (hash >> 31)) * 0xbf58476d1ce4e5b9ULL;
+    return &filter->front[(size_t)(((remix >> 32) * filter->numBlocks) >> 32) * FRONT_BLOCK_WORDS];
+}
+
+/**
+ * Checks whether a word passes the front filter of a tiered filter.
+ *
+ * @param filter  The tiered filter.
+ * @param hash    The 64-bit hash of the word (see FNVHash64).
+ * @return 1 if the word may be in the set, 0 if it is definitely not.
+ */
+int lookUpTieredFront(const TieredFilter *filter, unsigned long long hash) {
+    const unsigned long long *block = tieredBlock(filter, hash);
+    // Each probe takes 9 bits of the hash to address one of the 512 bits of the block
+    for (int h = 0; h < filter->frontK; h++) {
+        unsigned int bit = (hash >> (9 * h)) & 511;
+        if (!((block[bit / 64] >> (bit % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Checks whether a word passes the back filter of a tiered filter.
+ */
+int lookUpTieredBack(char *word, const TieredFilter *filter) {
+    for (int h = 0; h < filter->backK; h++) {
+        unsigned int index = APHashWithSalt(word, h, filter->m);
+        if (!((filter->back[index / 64] >> (index % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Checks whether a word is possibly in a tiered filter, screening it with the front filter first.
+ *
+ * @param word    The word to check.
+ * @param filter  The TieredFilter built by buildTieredFilter().
+ * @return 1 if the word is possibly in the set, 0 otherwise.
+ */
+int lookUpTiered(char *word, const void *filter) {
+    const TieredFilter *tiered = (const TieredFilter *)filter;
+    return lookUpTieredFront(tiered, FNVHash64(word)) && lookUpTieredBack(word, tiered);
+}
+
+/**
+ * Frees a tiered filter allocated by buildTieredFilter().
+ */
+void freeTiered(void *filter) {
+    TieredFilter *tiered = (TieredFilter *)filter;
+    free(tiered->front);
+    free(tiered->back);
+    free(tiered);
+}
+
+/**
+ * Returns the number of bytes held by a tiered filter.
+ */
+size_t tieredBytes(const void *filter) {
+    const TieredFilter *tiered = (const TieredFilter *)filter;
+    return sizeof(TieredFilter) + (size_t)tiered->numBlocks * FRONT_BLOCK_WORDS * sizeof(unsigned long long)
+           + (size_t)(tiered->m + 63) / 64 * sizeof(unsigned long long);
+}
+
+/**
+ * Returns the false positive rate of a blocked filter with numBlocks blocks of 512 bits,
+ * averaging the rate of a block over the Poisson distribution of words per block.
+ *
+ * @param numWords   The number of words inserted.
+ * @param numBlocks  The number of blocks.
+ * @param probes     The number of probes per word.
+ */
+double blockedFalsePositiveRate(int numWords, unsigned int numBlocks, int probes) {
+    double lambda = (double)numWords / numBlocks;
+    double spread = 10 * sqrt(lambda) + 10;
+    double rate = 0;
+    for (long j = lambda > spread ? (long)(lambda - spread) : 0; j <= (long)(lambda + spread); j++) {
+        double weight = exp(j * log(lambda > 0 ? lambda : 1) - lambda - lgamma(j + 1.0));
+        rate += weight * pow(1 - pow(1 - 1.0 / 512, (double)probes * j), probes);
+    }
+    return rate;
+}
+
+/**
+ * Builds a tiered filter. The front filter gets FRONT_BITS_PER_WORD bits per word, at most
+ * L2_BUDGET_BYTES, and the back filter the bits and probes that bring the product of the
+ * two false positive rates down to the rate of the classic m bit filter.
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @param m         The number of bits of the classic filter whose rate is the target.
+ * @param input     Not used by this engine.
+ * @return The filter, or NULL on failure.
+ */
+void *buildTieredFilter(char **words, int numWords, int m, const EngineInput *input) {
+    TieredFilter *filter = (TieredFilter *)calloc(1, sizeof(TieredFilter));
+    if (filter == NULL) {
+        return NULL;
+    }
+    const size_t blockBytes = FRONT_BLOCK_WORDS * sizeof(unsigned long long);
+    size_t frontBytes = (size_t)numWords * FRONT_BITS_PER_WORD / 8;
+    if (frontBytes > L2_BUDGET_BYTES) {
+        frontBytes = L2_BUDGET_BYTES;
+    }
+    filter->numBlocks = (frontBytes + blockBytes - 1) / blockBytes;
+    if (filter->numBlocks == 0) {
+        filter->numBlocks = 1;
+    }
+
+    // Optimal probe count for the front filter's bits per word, limited to what one 64-bit hash provides
+    double bitsPerWord = (double)filter->numBlocks * FRONT_BLOCK_WORDS * 64 / (numWords > 0 ? numWords : 1);
+    filter->frontK = round(bitsPerWord * log(2));
+    if (filter->frontK < 1) {
+        filter->frontK = 1;
+    } else if (filter->frontK > 7) {
+        filter->frontK = 7;
+    }
+
+    // The back filter only has to reject what gets past the front one
+    double targetFP = pow(1 - exp(-(double)k * numWords / m), k);
+    double frontFP = blockedFalsePositiveRate(numWords, filter->numBlocks, filter->frontK);
+    double backFP = targetFP / frontFP < 0.5 ? targetFP / frontFP : 0.5;
+    double backBits = -(double)numWords * log(backFP) / (log(2) * log(2));
+    filter->m = backBits > 64 ? (unsigned int)ceil(backBits) : 64;
+    filter->backK = round((double)filter->m / (numWords > 0 ? numWords : 1) * log(2));
+    if (filter->backK < 1) {
+        filter->backK = 1;
+    } else if (filter->backK > MAX_K) {
+        filter->backK = MAX_K;
+    }
+    // Resize for the rounded probe count so the back rate stays on target
+    backBits = -(double)filter->backK * numWords / log(1 - pow(backFP, 1.0 / filter->backK));
+    filter->m = backBits > 64 ? (unsigned int)ceil(backBits) : 64;
+    filter->expectedFP = frontFP * pow(1 - exp(-(double)filter->backK * numWords / filter->m), filter->backK);
+
+    filter->front = (unsigned long long *)calloc((size_t)filter->numBlocks * FRONT_BLOCK_WORDS, sizeof(unsigned long long));
+    filter->back = (unsigned long long *)calloc((filter->m + 63) / 64, sizeof(unsigned long long));
+    if (filter->front == NULL || filter->back == NULL) {
+        freeTiered(filter);
+        return NULL;
+    }
+    // Build-time memory until the caller takes the filter over
+    trackMemory(MEMORY_TEMPORARY, tieredBytes(filter));
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        unsigned long long hash = FNVHash64(words[i]);
+        unsigned long long *block = (unsigned long long *)tieredBlock(filter, hash);
+        for (int h = 0; h < filter->frontK; h++) {
+            unsigned int bit = (hash >> (9 * h)) & 511;
+            __atomic_fetch_or(&block[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+        }
+        for (int h = 0; h < filter->backK; h++) {
+            unsigned int index = APHashWithSalt(words[i], h, filter->m);
+            __atomic_fetch_or(&filter->back[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+        }
+    }
+    trackMemory(MEMORY_TEMPORARY, -(long)tieredBytes(filter));
+    return filter;
+}
+
+/**
+ * Measures the tiered filter against its back filter alone for several negative query rates.
+ *
+ * For each rate a mix of BENCH_QUERIES queries is drawn from the labelled queries, and
+ * the lookup throughput of both paths is printed.
+ *
+ * @param filter  The TieredFilter.
+ * @param words   The labelled query words.
+ * @param bits    The expected query bits.
+ * @param length  The number of queries.
+ */
+void benchmarkTiered(const void *filter, char **words, int *bits, int length) {
+    const TieredFilter *tiered = (const TieredFilter *)filter;
+    const double negativeRates[] = {0.0, 0.5, 0.9, 0.99};
+
+    // Split the query indices by label
+    int *positives = (int *)malloc(length * sizeof(int));
+    int *negatives = (int *)malloc(length * sizeof(int));
+    char **mix = (char **)malloc(BENCH_QUERIES * sizeof(char *));
+    int numPositives = 0, numNegatives = 0;
+    if (positives == NULL || negatives == NULL || mix == NULL) {
+        printf("Memory allocation failed for benchmark.\n");
+        free(positives);
+        free(negatives);
+        free(mix);
+        return;
+    }
+    for (int i = 0; i < length; i++) {
+        if (bits[i] == 1) {
+            positives[numPositives++] = i;
+        } else {
+            negatives[numNegatives++] = i;
+        }
+    }
+    if (numPositives == 0 || numNegatives == 0) {
+        printf("Benchmark needs both positive and negative queries.\n");
+        free(positives);
+        free(negatives);
+        free(mix);
+        return;
+    }
+
+    printf("Front filter: %u blocks, %d probes; back filter: %u bits, %d probes\n",
+           tiered->numBlocks, tiered->frontK, tiered->m, tiered->backK);
+    printf("Negative rate | back only (Mq/s) | tiered (Mq/s) | speedup\n");
+    for (size_t r = 0; r < sizeof(negativeRates) / sizeof(negativeRates[0]); r++) {
+        // Deterministic mix so every run measures the same queries
+        unsigned long long state = 88172645463325252ULL;
+        for (int i = 0; i < BENCH_QUERIES; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            int negative = (double)(state % 1000000) / 1000000 < negativeRates[r];
+            mix[i] = negative ? words[negatives[(state >> 20) % numNegatives]]
+                              : words[positives[(state >> 20) % numPositives]];
+        }
+
+        struct timespec start, end;
+        double times[2];
+        for (int pass = 0; pass < 2; pass++) {
+            int found = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            #pragma omp parallel for reduction(+:found) schedule(static)
+            for (int i = 0; i < BENCH_QUERIES; i++) {
+                found += pass == 0 ? lookUpTieredBack(mix[i], tiered) : lookUpTiered(mix[i], tiered);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            times[pass] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+            // Keep the lookups from being optimised away
+            benchmarkSink += found;
+        }
+        printf("%13.2f | %16.2f | %13.2f | %6.2fx\n", negativeRates[r],
+               BENCH_QUERIES / times[0] * 1e-6, BENCH_QUERIES / times[1] * 1e-6, times[0] / times[1]);
+    }
+
+    free(positives);
+    free(negatives);
+    free(mix);
+}
+
+/**
+ * Pattern-based Bloom filter: one hash picks a 64-bit word and a precomputed k-bit mask.
+ *
+ * Inserting is a single OR of the mask into the word and a lookup a single AND-compare,
+ * instead of k independent probes. The price is a slightly higher false positive rate,
+ * since all probes of a word land in the same 64 bits and keys can share a mask.
+ */
+typedef struct {
+    unsigned long long *words;                      // The filter, one 64-bit word per block.
+    unsigned int numWords;                          // Number of words.
+    unsigned long long masks[PATTERN_TABLE_SIZE];   // Table of masks with exactly k bits set.
+    int numInserted;                                // Number of words inserted, for the FP analysis.
+} PatternFilter;
+
+/**
+ * Fills a table of masks that each have 'bitsPerMask' distinct bits set.
+ *
+ * The bits are drawn from a fixed xorshift sequence so the same table is produced on
+ * every run, which keeps a filter valid across processes.
+ *
+ * @param masks        The table to fill.
+ * @param numMasks     The number of masks in the table.
+ * @param bitsPerMask  The number of bits to set in each mask (at most 64).
+ */
+void generatePatternTable(unsigned long long *masks, int numMasks, int bitsPerMask) {
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < numMasks; i++) {
+        unsigned long long mask = 0;
+        while (__builtin_popcountll(mask) < bitsPerMask) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            mask |= 1ULL << (state % 64);
+        }
+        masks[i] = mask;
+    }
+}
+
+/**
+ * Checks whether a word is possibly in a pattern-based Bloom filter.
+ *
+ * @param word    The word to check.
+ * @param filter  The PatternFilter built by buildPatternFilter().
+ * @return 1 if the word is possibly in the set, 0 otherwise.
+ */
+int lookUpPattern(char *word, const void *filter) {
+    const PatternFilter *pattern = (const PatternFilter *)filter;
+    unsigned long long hash = FNVHash64(word);
+    unsigned long long mask = pattern->masks[hash % PATTERN_TABLE_SIZE];
+    return (pattern->words[(hash >> 32) % pattern->numWords] & mask) == mask;
+}
+
+/**
+ * Returns the number of bytes held by a pattern-based Bloom filter.
+ */
+size_t patternBytes(const void *filter) {
+    const PatternFilter *pattern = (const PatternFilter *)filter;
+    return sizeof(PatternFilter) + (size_t)pattern->numWords * sizeof(unsigned long long);
+}
+
+/**
+ * Frees a pattern-based Bloom filter allocated by buildPatternFilter().
+ */
+void freePattern(void *filter) {
+    PatternFilter *pattern = (PatternFilter *)filter;
+    free(pattern->words);
+    free(pattern);
+}
+
+/**
+ * Builds a pattern-based Bloom filter of m bits with k-bit masks.
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @param m         The number of bits in the filter, rounded up to whole 64-bit words.
+ * @param input     Not used by this engine.
+ * @return The filter, or NULL on failure.
+ */
+void *buildPatternFilter(char **words, int numWords, int m, const EngineInput *input) {
+    PatternFilter *filter = (PatternFilter *)calloc(1, sizeof(PatternFilter));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->numWords = (m + 63) / 64;
+    filter->numInserted = numWords;
+    generatePatternTable(filter->masks, PATTERN_TABLE_SIZE, k < 64 ? k : 64);
+    filter->words = (unsigned long long *)calloc(filter->numWords, sizeof(unsigned long long));
+    if (filter->words == NULL) {
+        free(filter);
+        return NULL;
+    }
+    // Build-time memory until the caller takes the filter over
+    trackMemory(MEMORY_TEMPORARY, patternBytes(filter));
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        unsigned long long hash = FNVHash64(words[i]);
+        __atomic_fetch_or(&filter->words[(hash >> 32) % filter->numWords],
+                          filter->masks[hash % PATTERN_TABLE_SIZE], __ATOMIC_RELAXED);
+    }
+    trackMemory(MEMORY_TEMPORARY, -(long)patternBytes(filter));
+    return filter;
+}
+
+/**
+ * Computes the expected false positive rate of a pattern-based Bloom filter.
+ *
+ * The number of keys in a word is Poisson with mean n / numWords. A word holding j keys
+ * produces a false positive if the query draws one of their masks, or if each of its k
+ * bits was set by one of the j random masks.
+ *
+ * @param numInserted  The number of keys inserted.
+ * @param numWords     The number of 64-bit words.
+ * @param numMasks     The size of the mask table.
+ * @param bitsPerMask  The number of bits in each mask.
+ * @return The expected false positive rate.
+ */
+double patternFalsePositiveRate(int numInserted, unsigned int numWords, int numMasks, int bitsPerMask) {
+    double lambda = (double)numInserted / numWords;
+    double poisson = exp(-lambda);  // P(j = 0)
+    double rate = 0;
+    for (int j = 1; j < 64 * lambda + 64; j++) {
+        poisson *= lambda / j;
+        double noSharedMask = pow(1 - 1.0 / numMasks, j);
+        double bitsSet = pow(1 - pow(1 - (double)bitsPerMask / 64, j), bitsPerMask);
+        rate += poisson * ((1 - noSharedMask) + noSharedMask * bitsSet);
+    }
+    return rate;
+}
+
+/**
+ * Compares the pattern engine with the salted APHashWithSalt loop.
+ *
+ * Prints the expected false positive rate of both layouts, then rebuilds both from the
+ * positive queries and times insertion and lookup of every query.
+ *
+ * @param filter  The PatternFilter.
+ * @param words   The labelled query words.
+ * @param bits    The expected query bits.
+ * @param length  The number of queries.
+ */
+void benchmarkPattern(const void *filter, char **words, int *bits, int length) {
+    const PatternFilter *pattern = (const PatternFilter *)filter;
+    unsigned int m = pattern->numWords * 64;
+    printf("Expected FP, pattern (%d masks): %lf%%\n", PATTERN_TABLE_SIZE,
+           patternFalsePositiveRate(pattern->numInserted, pattern->numWords, PATTERN_TABLE_SIZE, k) * 100);
+    printf("Expected FP, salted k = %d:      %lf%%\n", k,
+           pow(1 - exp(-(double)k * pattern->numInserted / m), k) * 100);
+
+    unsigned long long *salted = (unsigned long long *)calloc(pattern->numWords, sizeof(unsigned long long));
+    unsigned long long *patterned = (unsigned long long *)calloc(pattern->numWords, sizeof(unsigned long long));
+    if (salted == NULL || patterned == NULL) {
+        printf("Memory allocation failed for benchmark.\n");
+        free(salted);
+        free(patterned);
+        return;
+    }
+
+    struct timespec start, end;
+    double times[4];
+    for (int pass = 0; pass < 4; pass++) {
+        int found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (pass == 0) {
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < length; i++) {
+                if (bits[i] == 1) {
+                    for (int h = 0; h < k; h++) {
+                        unsigned int index = APHashWithSalt(words[i], h, m);
+                        __atomic_fetch_or(&salted[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+                    }
+                }
+            }
+        } else if (pass == 1) {
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < length; i++) {
+                if (bits[i] == 1) {
+                    unsigned long long hash = FNVHash64(words[i]);
+                    __atomic_fetch_or(&patterned[(hash >> 32) % pattern->numWords],
+                                      pattern->masks[hash % PATTERN_TABLE_SIZE], __ATOMIC_RELAXED);
+                }
+            }
+        } else if (pass == 2) {
+            #pragma omp parallel for reduction(+:found) schedule(static)
+            for (int i = 0; i < length; i++) {
+                int isPossiblyInSet = 1;
+                for (int h = 0; h < k && isPossiblyInSet; h++) {
+                    unsigned int index = APHashWithSalt(words[i], h, m);
+                    isPossiblyInSet = (salted[index / 64] >> (index % 64)) & 1;
+                }
+                found += isPossiblyInSet;
+            }
+        } else {
+            #pragma omp parallel for reduction(+:found) schedule(static)
+            for (int i = 0; i < length; i++) {
+                found += lookUpPattern(words[i], pattern);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[pass] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        // Keep the lookups from being optimised away
+        benchmarkSink += found;
+    }
+    printf("Insert time (s): salted %lf, pattern %lf (%.2fx)\n", times[0], times[1], times[0] / times[1]);
+    printf("Lookup time (s): salted %lf, pattern %lf (%.2fx)\n", times[2], times[3], times[2] / times[3]);
+
+    free(salted);
+    free(patterned);
+}
+
+/**
+ * A learned Bloom filter: a logistic regression over hashed character n-grams accepts
+ * most inserted words, and the words it rejects go to a small backup Bloom filter so
+ * there are no false negatives.
+ */
+typedef struct {
+    float weights[LEARNED_FEATURES];
+    float bias;
+    float threshold;                // Logit at or above which the model accepts a word.
+    unsigned long long *backup;     // Packed backup filter of the rejected inserted words, or NULL.
+    unsigned int backupM;
+    int backupK;
+    double modelFP;                 // False positive rate of the model alone on the tuning negatives.
+    double targetFP;                // False positive rate the filter is tuned for.
+    unsigned int classicM;          // Size of the classic filter it replaces, for --bench.
+    char **words;                   // The inserted words (not owned), for --bench.
+    int numWords;
+} LearnedFilter;
+
+/**
+ * Hashes the 1- to LEARNED_NGRAM-grams of a word, padded with '^' and '$', into feature indices.
+ *
+ * @param word      The word; at most MAX_WORD_LENGTH characters are used.
+ * @param features  Receives the indices, room for LEARNED_NGRAM * (MAX_WORD_LENGTH + 2).
+ * @return The number of features.
+ */
+int learnedFeatures(const char *word, unsigned int *features) {
+    char padded[MAX_WORD_LENGTH + 3];
+    int length = 0;
+    padded[length++] = '^';
+    for (int i = 0; word[i] && i < MAX_WORD_LENGTH; i++) {
+        padded[length++] = word[i];
+    }
+    padded[length++] = '$';
+
+    int count = 0;
+    for (int start = 0; start < length; start++) {
+        unsigned int hash = 2166136261u;
+        for (int n = 1; n <= LEARNED_NGRAM && start + n <= length; n++) {
+            hash = (hash ^ (unsigned char)padded[start + n - 1]) * 16777619u;
+            features[count++] = (hash ^ (hash >> 15) ^ n) % LEARNED_FEATURES;
+        }
+    }
+    return count;
+}
+
+/**
+ * Returns the model logit of a word.
+ */
+float learnedScore(const LearnedFilter *filter, const char *word) {
+    unsigned int features[LEARNED_NGRAM * (MAX_WORD_LENGTH + 2)];
+    int count = learnedFeatures(word, features);
+    float score = filter->bias;
+    for (int i = 0; i < count; i++) {
+        score += filter->weights[features[i]];
+    }
+    return score;
+}
+
+/**
+ * Trains the model by mini-batch gradient descent, accumulating each batch's gradient per thread.
+ *
+ * @param filter      The filter whose model is trained.
+ * @param samples     The training words, in the order they are visited.
+ * @param labels      1 for an inserted word, 0 for a negative.
+ * @param numSamples  The number of samples.
+ */
+void trainLearnedModel(LearnedFilter *filter, char **samples, const unsigned char *labels, int numSamples) {
+    int numThreads = omp_get_max_threads();
+    float *gradients = (float *)calloc((size_t)numThreads * (LEARNED_FEATURES + 1), sizeof(float));
+    if (gradients == NULL) {
+        printf("Memory allocation failed for training.\n");
+        return;
+    }
+    long gradientBytes = (long)((size_t)numThreads * (LEARNED_FEATURES + 1) * sizeof(float));
+    trackMemory(MEMORY_TEMPORARY, gradientBytes);
+
+    for (int epoch = 0; epoch < LEARNED_EPOCHS; epoch++) {
+        for (int base = 0; base < numSamples; base += LEARNED_BATCH) {
+            int batchSize = numSamples - base < LEARNED_BATCH ? numSamples - base : LEARNED_BATCH;
+            #pragma omp parallel num_threads(numThreads)
+            {
+                float *gradient = gradients + (size_t)omp_get_thread_num() * (LEARNED_FEATURES + 1);
+                unsigned int features[LEARNED_NGRAM * (MAX_WORD_LENGTH + 2)];
+                #pragma omp for schedule(static)
+                for (int s = base; s < base + batchSize; s++) {
+                    char *word = samples[s];
+                    int count = learnedFeatures(word, features);
+                    float score = filter->bias;
+                    for (int i = 0; i < count; i++) {
+                        score += filter->weights[features[i]];
+                    }
+                    float error = 1 / (1 + expf(-score)) - labels[s];
+                    for (int i = 0; i < count; i++) {
+                        gradient[features[i]] += error;
+                    }
+                    gradient[LEARNED_FEATURES] += error;
+                }
+
+                // Sum the per-thread gradients and take the step, one slice of features per thread
+                #pragma omp for schedule(static)
+                for (int f = 0; f <= LEARNED_FEATURES; f++) {
+                    float sum = 0;
+                    for (int t = 0; t < numThreads; t++) {
+                        sum += gradients[(size_t)t * (LEARNED_FEATURES + 1) + f];
+                        gradients[(size_t)t * (LEARNED_FEATURES + 1) + f] = 0;
+                    }
+                    float *parameter = f < LEARNED_FEATURES ? &filter->weights[f] : &filter->bias;
+                    *parameter -= LEARNED_RATE * sum / batchSize;
+                }
+            }
+        }
+    }
+    free(gradients);
+    trackMemory(MEMORY_TEMPORARY, -gradientBytes);
+}
+
+/**
+ * Compares floats for qsort.
+ */
+int compareFloats(const void *a, const void *b) {
+    float left = *(const float *)a;
+    float right = *(const float *)b;
+    return (left > right) - (left < right);
+}
+
+size_t learnedBytes(const void *filter) {
+    const LearnedFilter *learned = (const LearnedFilter *)filter;
+    size_t backupBytes = learned->backup != NULL ? (learned->backupM + 63) / 64 * sizeof(unsigned long long) : 0;
+    // A filter that fell back to the plain backup never consults the model
+    size_t modelBytes = learned->threshold < INFINITY ? sizeof(learned->weights) + sizeof(learned->bias) : 0;
+    return modelBytes + sizeof(learned->threshold) + backupBytes;
+}
+
+void freeLearned(void *filter) {
+    if (filter != NULL) {
+        free(((LearnedFilter *)filter)->backup);
+        free(filter);
+    }
+}
+
+/**
+ * Builds a learned Bloom filter with the false positive rate of a classic filter of m bits.
+ *
+ * The model learns to tell the inserted words (positives) from the negative queries at
+ * indices 4s. The acceptance threshold is then chosen among LEARNED_THRESHOLDS quantiles of
+ * the inserted words' scores to minimise model plus backup memory, with the model's false
+ * positive rate measured on the negative queries at 4s + 2 so its fit to its own training
+ * negatives does not leak into the estimate: a threshold that lets the model accept a share f
+ * of the tuning negatives leaves the backup filter a false positive budget of
+ * (FP - f) / (1 - f) for the words the model rejects. The odd-indexed queries stay held out
+ * for --bench.
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @param m         The classic filter size whose false positive rate is matched.
+ * @param input     The labelled queries.
+ * @return The filter, or NULL if there is no training data or memory.
+ */
+void *buildLearnedFilter(char **words, int numWords, int m, const EngineInput *input) {
+    int numTraining = 0, numTuning = 0;
+    for (int i = 0; i < input->numQueries; i += 2) {
+        if (input->bits[i] != 1) {
+            numTraining += i % 4 == 0;
+            numTuning += i % 4 == 2;
+        }
+    }
+    if (numTraining == 0 || numTuning == 0) {
+        printf("The learned engine needs negative queries to train on.\n");
+        return NULL;
+    }
+    int numSamples = numWords + numTraining;
+    LearnedFilter *filter = (LearnedFilter *)calloc(1, sizeof(LearnedFilter));
+    float *positiveScores = (float *)malloc(((size_t)numWords + 1) * sizeof(float));
+    float *negativeScores = (float *)malloc(((size_t)numTuning + 1) * sizeof(float));
+    char **rejected = (char **)malloc(((size_t)numWords + 1) * sizeof(char *));
+    char **samples = (char **)malloc(((size_t)numSamples + 1) * sizeof(char *));
+    unsigned char *labels = (unsigned char *)malloc((size_t)numSamples + 1);
+    if (filter == NULL || positiveScores == NULL || negativeScores == NULL || rejected == NULL || samples == NULL || labels == NULL) {
+        free(filter);
+        free(positiveScores);
+        free(negativeScores);
+        free(rejected);
+        free(samples);
+        free(labels);
+        return NULL;
+    }
+    // Everything allocated here is build-time memory until the caller takes the filter over
+    long sampleBytes = (long)(((size_t)numSamples + 1) * (sizeof(char *) + 1));
+    long buildBytes = (long)(sizeof(LearnedFilter) + ((size_t)numWords + 1) * (2 * sizeof(float) + sizeof(char *)) +
+                             ((size_t)numTuning + 1) * sizeof(float));
+    trackMemory(MEMORY_TEMPORARY, buildBytes + sampleBytes);
+    filter->targetFP = pow(1 - exp(-(double)k * numWords / m), k);
+    filter->classicM = m;
+    filter->words = words;
+    filter->numWords = numWords;
+
+    // Shuffle the inserted words and the training negatives so every mini-batch mixes both
+    for (int i = 0; i < numWords; i++) {
+        samples[i] = words[i];
+        labels[i] = 1;
+    }
+    for (int i = 0, s = numWords; i < input->numQueries; i += 4) {
+        if (input->bits[i] != 1) {
+            samples[s] = input->queries[i];
+            labels[s++] = 0;
+        }
+    }
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    for (int i = numSamples - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int j = state % (i + 1);
+        char *sample = samples[i];
+        samples[i] = samples[j];
+        samples[j] = sample;
+        unsigned char label = labels[i];
+        labels[i] = labels[j];
+        labels[j] = label;
+    }
+    trainLearnedModel(filter, samples, labels, numSamples);
+    free(samples);
+    free(labels);
+    trackMemory(MEMORY_TEMPORARY, -sampleBytes);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        positiveScores[i] = learnedScore(filter, words[i]);
+    }
+    int numNegatives = 0;
+    for (int i = 2; i < input->numQueries; i += 4) {
+        if (input->bits[i] != 1) {
+            negativeScores[numNegatives++] = learnedScore(filter, input->queries[i]);
+        }
+    }
+    qsort(negativeScores, numNegatives, sizeof(float), compareFloats);
+    float *sortedPositives = (float *)malloc(((size_t)numWords + 1) * sizeof(float));
+    if (sortedPositives == NULL) {
+        freeLearned(filter);
+        filter = NULL;
+        goto done;
+    }
+    memcpy(sortedPositives, positiveScores, (size_t)numWords * sizeof(float));
+    qsort(sortedPositives, numWords, sizeof(float), compareFloats);
+
+    // Start from the plain filter (threshold above every score) and try each quantile
+    double bestBits = numWords * -log(filter->targetFP) / (log(2) * log(2));
+    filter->threshold = INFINITY;
+    filter->modelFP = 0;
+    for (int q = 0; q < LEARNED_THRESHOLDS && numWords > 0; q++) {
+        int numRejected = (int)((long)numWords * q / LEARNED_THRESHOLDS);
+        float threshold = sortedPositives[numRejected];
+        // Share of negatives scoring at or above the threshold
+        int low = 0, high = numNegatives;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (negativeScores[mid] < threshold) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        double modelFP = numNegatives > 0 ? (double)(numNegatives - low) / numNegatives : 0;
+        if (modelFP >= filter->targetFP) {
+            continue;
+        }
+        double backupFP = (filter->targetFP - modelFP) / (1 - modelFP);
+        double bits = numRejected * -log(backupFP) / (log(2) * log(2)) + sizeof(filter->weights) * 8;
+        if (bits < bestBits) {
+            bestBits = bits;
+            filter->threshold = threshold;
+            filter->modelFP = modelFP;
+        }
+    }
+
+    int numRejected = 0;
+    for (int i = 0; i < numWords; i++) {
+        if (positiveScores[i] < filter->threshold) {
+            rejected[numRejected++] = words[i];
+        }
+    }
+    if (numRejected > 0) {
+        double backupFP = (filter->targetFP - filter->modelFP) / (1 - filter->modelFP);
+        filter->backupM = ceil(numRejected * -log(backupFP) / (log(2) * log(2)));
+        filter->backupM = filter->backupM > 64 ? filter->backupM : 64;
+        filter->backupK = round((double)filter->backupM / numRejected * log(2));
+        filter->backupK = filter->backupK < 1 ? 1 : filter->backupK > MAX_K ? MAX_K : filter->backupK;
+        filter->backup = (unsigned long long *)calloc((filter->backupM + 63) / 64, sizeof(unsigned long long));
+        if (filter->backup == NULL) {
+            freeLearned(filter);
+            filter = NULL;
+            goto done;
+        }
+        trackMemory(MEMORY_TEMPORARY, (long)((filter->backupM + 63) / 64 * sizeof(unsigned long long)));
+        buildBytes += (long)((filter->backupM + 63) / 64 * sizeof(unsigned long long));
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < numRejected; i++) {
+            for (int h = 0; h < filter->backupK; h++) {
+                unsigned int index = APHashRawWithSalt(rejected[i], h) % filter->backupM;
+                __atomic_fetch_or(&filter->backup[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    printf("Learned filter: model accepts %d of %d words at FP %lf%%, backup %u bits for %d words (target FP %lf%%)\n",
+           numWords - numRejected, numWords, filter->modelFP * 100, filter->backupM, numRejected, filter->targetFP * 100);
+
+done:
+    free(sortedPositives);
+    free(positiveScores);
+    free(negativeScores);
+    free(rejected);
+    trackMemory(MEMORY_TEMPORARY, -buildBytes);
+    return filter;
+}
+
+int lookUpLearned(char *word, const void *filter) {
+    const LearnedFilter *learned = (const LearnedFilter *)filter;
+    // An infinite threshold means the model lost to a plain filter; skip scoring
+    if (learned->threshold < INFINITY && learnedScore(learned, word) >= learned->threshold) {
+        return 1;
+    }
+    if (learned->backup == NULL) {
+        return 0;
+    }
+    for (int h = 0; h < learned->backupK; h++) {
+        unsigned int index = APHashRawWithSalt(word, h) % learned->backupM;
+        if (!((learned->backup[index / 64] >> (index % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Compares a learned filter with a packed classic filter of the same false positive rate:
+ * memory, false positive rate on the held-out (odd-indexed) queries and lookup throughput.
+ */
+void benchmarkLearned(const void *filter, char **words, int *bits, int length) {
+    const LearnedFilter *learned = (const LearnedFilter *)filter;
+    unsigned int m = learned->classicM;
+    unsigned long long *classic = (unsigned long long *)calloc((m + 63) / 64, sizeof(unsigned long long));
+    if (classic == NULL) {
+        printf("Memory allocation failed for benchmark.\n");
+        return;
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < learned->numWords; i++) {
+        for (int h = 0; h < k; h++) {
+            unsigned int index = APHashRawWithSalt(learned->words[i], h) % m;
+            __atomic_fetch_or(&classic[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+        }
+    }
+
+    printf("Filter  | memory (bytes) | held-out FP | lookups (Mq/s)\n");
+    for (int pass = 0; pass < 2; pass++) {
+        int positives = 0, negatives = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        #pragma omp parallel for reduction(+:positives, negatives) schedule(static)
+        for (int i = 0; i < length; i++) {
+            int found;
+            if (pass == 0) {
+                found = 1;
+                for (int h = 0; h < k && found; h++) {
+                    unsigned int index = APHashRawWithSalt(words[i], h) % m;
+                    found = (classic[index / 64] >> (index % 64)) & 1;
+                }
+            } else {
+                found = lookUpLearned(words[i], learned);
+            }
+            if (i % 2 == 1 && bits[i] != 1) {
+                negatives++;
+                positives += found;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        benchmarkSink += positives;
+        printf("%-7s | %14zu | %10lf%% | %14.2f\n", pass == 0 ? "classic" : "learned",
+               pass == 0 ? (m + 63) / 64 * sizeof(unsigned long long) : learnedBytes(learned),
+               negatives > 0 ? (double)positives / negatives * 100 : 0, length / time * 1e-6);
+    }
+    free(classic);
+}
+
+/**
+ * A frequency-weighted Bloom filter: every key is probed with the number of hashes of its
+ * query frequency class, so hot negatives can be given more probes than cold keys.
+ *
+ * Class c holds keys queried at least 2^c times according to the profile; keys that are
+ * not in the profile are in class 0. Inserts and lookups find the class of a key the same
+ * way, so the filter has no false negatives whatever the profile says.
+ */
+typedef struct {
+    unsigned long long *words;      // Packed filter bits.
+    unsigned int m;
+    unsigned long long *hotKeys;    // Open-addressed FNVHash64 fingerprints of keys in classes above 0.
+    unsigned char *hotClasses;      // Class of each hot key.
+    size_t tableSize;               // Slots in the hot key table, a power of two, or 0.
+    int classK[WEIGHTED_CLASSES];   // Probes per class.
+    double fill;                    // Expected fraction of bits set.
+    double maxFP;                   // Highest false positive rate of a class with negative traffic.
+} WeightedFilter;
+
+/**
+ * Returns the slot of a fingerprint in the hot key table: the slot holding it, or the
+ * empty slot where it would be inserted.
+ */
+size_t weightedSlot(const WeightedFilter *filter, unsigned long long fingerprint) {
+    size_t slot = fingerprint & (filter->tableSize - 1);
+    while (filter->hotKeys[slot] != 0 && filter->hotKeys[slot] != fingerprint) {
+        slot = (slot + 1) & (filter->tableSize - 1);
+    }
+    return slot;
+}
+
+/**
+ * Returns the frequency class of a word.
+ */
+int weightedClass(const WeightedFilter *filter, const char *word) {
+    if (filter->tableSize == 0) {
+        return 0;
+    }
+    unsigned long long fingerprint = FNVHash64(word) | 1;   // 0 marks an empty slot
+    size_t slot = weightedSlot(filter, fingerprint);
+    return filter->hotKeys[slot] == fingerprint ? filter->hotClasses[slot] : 0;
+}
+
+/**
+ * Compares 64-bit hashes for qsort.
+ */
+int compareHashes(const void *a, const void *b) {
+    unsigned long long left = *(const unsigned long long *)a;
+    unsigned long long right = *(const unsigned long long *)b;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Returns the traffic-weighted false positive rate of per-class probe counts: the
+ * negative query mass of each class times fill^k_c, over the total negative mass.
+ *
+ * @param numWords     Inserted words per class.
+ * @param negatives    Negative query mass per class.
+ * @param classK       Probes per class.
+ * @param m            The number of bits.
+ * @param fill         Receives the expected fraction of bits set.
+ */
+double weightedCost(const long *numWords, const double *negatives, const int *classK, unsigned int m, double *fill) {
+    double probes = 0, totalNegatives = 0, cost = 0;
+    for (int c = 0; c < WEIGHTED_CLASSES; c++) {
+        probes += (double)numWords[c] * classK[c];
+        totalNegatives += negatives[c];
+    }
+    *fill = 1 - exp(-probes / m);
+    for (int c = 0; c < WEIGHTED_CLASSES; c++) {
+        cost += negatives[c] * pow(*fill, classK[c]);
+    }
+    return totalNegatives > 0 ? cost / totalNegatives : 0;
+}
+
+size_t weightedBytes(const void *filter) {
+    const WeightedFilter *weighted = (const WeightedFilter *)filter;
+    return (weighted->m + 63) / 64 * sizeof(unsigned long long) +
+           weighted->tableSize * (sizeof(unsigned long long) + sizeof(unsigned char));
+}
+
+void freeWeighted(void *filter) {
+    if (filter != NULL) {
+        WeightedFilter *weighted = (WeightedFilter *)filter;
+        free(weighted->words);
+        free(weighted->hotKeys);
+        free(weighted->hotClasses);
+        free(weighted);
+    }
+}
+
+/**
+ * Builds a frequency-weighted filter of m bits from the words and the query profile.
+ *
+ * Profile counts of repeated keys are summed. Negative traffic per class is the profile
+ * mass of keys that are not inserted, and the probe counts minimise the traffic-weighted
+ * false positive rate by coordinate descent from the uniform k, without raising the rate
+ * of class 0. Without a profile every key is in class 0 and the filter is a classic one
+ * with the optimal k. A profile in which no key reaches class 1, such as a query file
+ * that names each key once, is rejected.
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @param m         The number of bits.
+ * @param input     The query frequency profile; the labelled queries are not used.
+ * @return The filter, or NULL if the profile has a single class or memory ran out.
+ */
+void *buildWeightedFilter(char **words, int numWords, int m, const EngineInput *input) {
+    WeightedFilter *filter = (WeightedFilter *)calloc(1, sizeof(WeightedFilter));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->m = m;
+    filter->words = (unsigned long long *)calloc((m + 63) / 64, sizeof(unsigned long long));
+    unsigned long long *inserted = (unsigned long long *)malloc(((size_t)numWords + 1) * sizeof(unsigned long long));
+    long *counts = NULL;
+    if (input->profileSize > 0) {
+        filter->tableSize = 16;
+        while (filter->tableSize < 2 * (size_t)input->profileSize) {
+            filter->tableSize *= 2;
+        }
+        filter->hotKeys = (unsigned long long *)calloc(filter->tableSize, sizeof(unsigned long long));
+        filter->hotClasses = (unsigned char *)calloc(filter->tableSize, sizeof(unsigned char));
+        counts = (long *)calloc(filter->tableSize, sizeof(long));
+    }
+    if (filter->words == NULL || inserted == NULL || (input->profileSize > 0 && (filter->hotKeys == NULL || filter->hotClasses == NULL || counts == NULL))) {
+        freeWeighted(filter);
+        free(inserted);
+        free(counts);
+        return NULL;
+    }
+    // Everything allocated here is build-time memory until the caller takes the filter over
+    long buildBytes = (long)(weightedBytes(filter) + ((size_t)numWords + 1) * sizeof(unsigned long long) +
+                             filter->tableSize * sizeof(long));
+    trackMemory(MEMORY_TEMPORARY, buildBytes);
+
+    // Sum the profile per key and derive each key's class
+    for (int i = 0; i < input->profileSize; i++) {
+        unsigned long long fingerprint = FNVHash64(input->profileKeys[i]) | 1;
+        size_t slot = weightedSlot(filter, fingerprint);
+        filter->hotKeys[slot] = fingerprint;
+        counts[slot] += input->profileCounts[i] > 0 ? input->profileCounts[i] : 0;
+    }
+    for (size_t slot = 0; slot < filter->tableSize; slot++) {
+        int sizeClass = 0;
+        while (sizeClass < WEIGHTED_CLASSES - 1 && counts[slot] >> (sizeClass + 1) != 0) {
+            sizeClass++;
+        }
+        filter->hotClasses[slot] = sizeClass;
+    }
+
+    // Negative traffic per class: profile mass of keys that are not inserted
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        inserted[i] = FNVHash64(words[i]) | 1;
+    }
+    qsort(inserted, numWords, sizeof(unsigned long long), compareHashes);
+    double negatives[WEIGHTED_CLASSES] = {0};
+    size_t numHot = 0;
+    for (size_t slot = 0; slot < filter->tableSize; slot++) {
+        if (filter->hotKeys[slot] != 0) {
+            if (bsearch(&filter->hotKeys[slot], inserted, numWords, sizeof(unsigned long long), compareHashes) == NULL) {
+                negatives[filter->hotClasses[slot]] += counts[slot];
+            }
+            numHot += filter->hotClasses[slot] > 0;
+        }
+    }
+    if (input->profileSize == 0) {
+        negatives[0] = 1;
+    } else if (numHot == 0) {
+        // Every profiled key is in class 0, so the profile cannot weight anything
+        printf("The frequency profile has no key queried 2 or more times; pass counts or a query log with repeated keys.\n");
+        freeWeighted(filter);
+        free(inserted);
+        free(counts);
+        trackMemory(MEMORY_TEMPORARY, -buildBytes);
+        return NULL;
+    }
+
+    // Only hot keys need to stay in the table; class 0 is the default
+    unsigned long long *profiled = filter->hotKeys;
+    unsigned char *profiledClasses = filter->hotClasses;
+    size_t profiledSize = filter->tableSize;
+    filter->hotKeys = NULL;
+    filter->hotClasses = NULL;
+    filter->tableSize = 0;
+    if (numHot > 0) {
+        filter->tableSize = 16;
+        while (filter->tableSize < 2 * numHot) {
+            filter->tableSize *= 2;
+        }
+        filter->hotKeys = (unsigned long long *)calloc(filter->tableSize, sizeof(unsigned long long));
+        filter->hotClasses = (unsigned char *)calloc(filter->tableSize, sizeof(unsigned char));
+        if (filter->hotKeys == NULL || filter->hotClasses == NULL) {
+            free(profiled);
+            free(profiledClasses);
+            freeWeighted(filter);
+            free(inserted);
+            free(counts);
+            trackMemory(MEMORY_TEMPORARY, -buildBytes);
+            return NULL;
+        }
+        long hotBytes = (long)(filter->tableSize * (sizeof(unsigned long long) + sizeof(unsigned char)));
+        trackMemory(MEMORY_TEMPORARY, hotBytes);
+        buildBytes += hotBytes;
+        for (size_t slot = 0; slot < profiledSize; slot++) {
+            if (profiled[slot] != 0 && profiledClasses[slot] > 0) {
+                size_t hotSlot = weightedSlot(filter, profiled[slot]);
+                filter->hotKeys[hotSlot] = profiled[slot];
+                filter->hotClasses[hotSlot] = profiledClasses[slot];
+            }
+        }
+    }
+    free(profiled);
+    free(profiledClasses);
+    long profiledBytes = (long)(profiledSize * (sizeof(unsigned long long) + sizeof(unsigned char)));
+    trackMemory(MEMORY_TEMPORARY, -profiledBytes);
+    buildBytes -= profiledBytes;
+
+    long numPerClass[WEIGHTED_CLASSES] = {0};
+    #pragma omp parallel for reduction(+:numPerClass[:WEIGHTED_CLASSES]) schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        numPerClass[weightedClass(filter, words[i])]++;
+    }
+
+    // Coordinate descent on the probes of each class, starting from the uniform k. Class 0
+    // also stands for traffic the profile has not seen, so its rate may not get worse.
+    for (int c = 0; c < WEIGHTED_CLASSES; c++) {
+        filter->classK[c] = k;
+    }
+    double uniformCost = weightedCost(numPerClass, negatives, filter->classK, m, &filter->fill);
+    double coldLimit = pow(filter->fill, k) * (1 + 1e-9);
+    double cost = uniformCost;
+    for (int improved = 1; improved;) {
+        improved = 0;
+        for (int c = 0; c < WEIGHTED_CLASSES; c++) {
+            for (int step = -1; step <= 1; step += 2) {
+                int previous = filter->classK[c];
+                if (previous + step < 1 || previous + step > MAX_K) {
+                    continue;
+                }
+                filter->classK[c] = previous + step;
+                double fill, candidate = weightedCost(numPerClass, negatives, filter->classK, m, &fill);
+                if (candidate < cost * (1 - 1e-9) && pow(fill, filter->classK[0]) <= coldLimit) {
+                    cost = candidate;
+                    improved = 1;
+                } else {
+                    filter->classK[c] = previous;
+                }
+            }
+        }
+    }
+    weightedCost(numPerClass, negatives, filter->classK, m, &filter->fill);
+    for (int c = 0; c < WEIGHTED_CLASSES; c++) {
+        if (c == 0 || negatives[c] > 0) {
+            double classFP = pow(filter->fill, filter->classK[c]);
+            filter->maxFP = classFP > filter->maxFP ? classFP : filter->maxFP;
+        }
+        if (numPerClass[c] > 0 || negatives[c] > 0) {
+            if (c == 0) {
+                printf("Class %2d (< 2 queries): %ld words, negative traffic %.0lf, k = %d\n",
+                       c, numPerClass[c], negatives[c], filter->classK[c]);
+            } else {
+                printf("Class %2d (>= %ld queries): %ld words, negative traffic %.0lf, k = %d\n",
+                       c, 1L << c, numPerClass[c], negatives[c], filter->classK[c]);
+            }
+        }
+    }
+    printf("Traffic-weighted FP: %lf%% with uniform k = %d, %lf%% weighted\n", uniformCost * 100, k, cost * 100);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        int probes = filter->classK[weightedClass(filter, words[i])];
+        for (int h = 0; h < probes; h++) {
+            unsigned int index = APHashRawWithSalt(words[i], h) % filter->m;
+            __atomic_fetch_or(&filter->words[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+        }
+    }
+    free(inserted);
+    free(counts);
+    trackMemory(MEMORY_TEMPORARY, -buildBytes);
+    return filter;
+}
+
+int lookUpWeighted(char *word, const void *filter) {
+    const WeightedFilter *weighted = (const WeightedFilter *)filter;
+    int probes = weighted->classK[weightedClass(weighted, word)];
+    for (int h = 0; h < probes; h++) {
+        unsigned int index = APHashRawWithSalt(word, h) % weighted->m;
+        if (!((weighted->words[index / 64] >> (index % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns the highest false positive rate of any class with negative traffic, which
+ * bounds the rate of every negative query.
+ */
+double expectedFPWeighted(const void *filter) {
+    return ((const WeightedFilter *)filter)->maxFP;
+}
+
+/**
+ * A filter implementation that can be selected with --engine in place of the classic bit array.
+ */
+typedef struct {
+    const char *name;                                           // Name used on the command line.
+    void *(*build)(char **words, int numWords, int m, const EngineInput *input); // Builds the filter for m bits.
+    int (*lookUp)(char *word, const void *filter);              // Returns 1 if the word is possibly in the set.
+    size_t (*memoryBytes)(const void *filter);                  // Bytes held by the filter.
+    void (*destroy)(void *filter);                              // Frees the filter.
+    void (*benchmark)(const void *filter, char **words, int *bits, int length); // Engine specific benchmark run by --bench, or NULL.
+    int (*testBit)(const void *filter, unsigned int index);     // Bit 'index' of the classic layout, or NULL if the layout differs.
+    double (*expectedFP)(const void *filter);                   // Theoretical FP rate, or NULL for the classic formula.
+} FilterEngine;
+
+/**
+ * Returns bit 'index' of an adaptive bit set, which uses the classic layout.
+ */
+int testBitAdaptive(const void *filter, unsigned int index) {
+    return testAdaptive((const AdaptiveBitSet *)filter, index);
+}
+
+/**
+ * Returns the combined false positive rate of the two tiers of a tiered filter.
+ */
+double expectedFPTiered(const void *filter) {
+    return ((const TieredFilter *)filter)->expectedFP;
+}
+
+/**
+ * Returns the theoretical false positive rate of a pattern-based Bloom filter.
+ */
+double expectedFPPattern(const void *filter) {
+    const PatternFilter *pattern = (const PatternFilter *)filter;
+    return patternFalsePositiveRate(pattern->numInserted, pattern->numWords, PATTERN_TABLE_SIZE, k);
+}
+
+const FilterEngine engines[] = {
+    {"sparse", buildAdaptiveFilter, lookUpAdaptive, adaptiveBytes, freeAdaptive, NULL, testBitAdaptive, NULL},
+    {"tiered", buildTieredFilter, lookUpTiered, tieredBytes, freeTiered, benchmarkTiered, NULL, expectedFPTiered},
+    {"pattern", buildPatternFilter, lookUpPattern, patternBytes, freePattern, benchmarkPattern, NULL, expectedFPPattern},
+    {"learned", buildLearnedFilter, lookUpLearned, learnedBytes, freeLearned, benchmarkLearned, NULL, NULL},
+    {"weighted", buildWeightedFilter, lookUpWeighted, weightedBytes, freeWeighted, NULL, NULL, expectedFPWeighted},
+};
+
+/**
+ * Finds an engine by name.
+ *
+ * @param name  The engine name.
+ * @return The engine, or NULL if there is no engine with that name.
+ */
+const FilterEngine *findEngine(const char *name) {
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i].name, name) == 0) {
+            return &engines[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Tests words against a filter built by an engine and prints the error percentages.
+ *
+ * Same result bitmap and accounting as testBloomWithQueries(), for any FilterEngine.
+ *
+ * @param engine  The engine that built the filter.
+ * @param filter  The filter.
+ * @param words   An array of query words to test.
+ * @param bits    An array of expected query bits.
+ * @param length  The number of words and bits to test.
+ */
+void testEngineWithQueries(const FilterEngine *engine, const void *filter, char **words, int *bits, int length) {
+    int numResultWords = (length + 63) / 64;
+    unsigned long long *results = (unsigned long long *)malloc(((size_t)numResultWords + 1) * sizeof(unsigned long long));
+    if (results == NULL) {
+        printf("Memory allocation failed for the query results.\n");
+        return;
+    }
+    trackMemory(MEMORY_TEMPORARY, ((long)numResultWords + 1) * sizeof(unsigned long long));
+
+    #pragma omp parallel
+    {
+        double spanStart = traceNow();
+        #pragma omp for schedule(static) nowait
+        for (int w = 0; w < numResultWords; w++) {
+            unsigned long long result = 0;
+            int count = length - w * 64 < 64 ? length - w * 64 : 64;
+            for (int j = 0; j < count; j++) {
+                long lookupStart = metricsLookupStart();
+                int lookupResult = engine->lookUp(words[w * 64 + j], filter);
+                metricsLookupEnd(lookupStart, lookupResult);
+                result |= (unsigned long long)lookupResult << j;
+            }
+            results[w] = result;
+        }
+        traceSpan("query chunk", spanStart);
+    }
+    reportQueryResults(results, words, bits, length);
+    free(results);
+    trackMemory(MEMORY_TEMPORARY, -(long)(((long)numResultWords + 1) * sizeof(unsigned long long)));
+}
+
+/**
+ * Writes a packed Bloom filter to a file in the serialized filter format.
+ *
+ * @param filename     The output file.
+ * @param words        The packed filter bits.
+ * @param m            The number of bits.
+ * @param numHashes    The number of hash functions.
+ * @param numInserted  The number of words inserted.
+ * @param hashFamily   FILTER_HASH_APHASH or FILTER_HASH_DOUBLE.
+ * @return 0 on success, -1 on failure.
+ */
+int writeFilterFile(const char *filename, const unsigned long long *words, unsigned int m, int numHashes, long numInserted,
+                    unsigned int hashFamily) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror("Error opening file");
+        return -1;
+    }
+    FilterFileHeader header = {0};
+    memcpy(header.magic, FILTER_MAGIC, sizeof(header.magic));
+    header.k = numHashes;
+    header.hash = hashFamily;
+    header.m = m;
+    header.numInserted = numInserted;
+
+    size_t numWords = (m + 63) / 64;
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 fwrite(words, sizeof(unsigned long long), numWords, file) != numWords;
+    if (fclose(file) != 0 || failed) {
+        perror("Error writing filter file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Header of a fingerprint sidecar file.
+ *
+ * The header is followed by 'count' 64-bit FNVHash64 fingerprints, one per key in file
+ * order, and, for a query set, 'count' bytes holding the expected bit of each query.
+ * Probe positions for any m and k follow from a fingerprint by doubleHashIndex().
+ */
+typedef struct {
+    char magic[8];                  // FINGERPRINT_MAGIC.
+    unsigned long long count;       // Number of keys.
+    unsigned int labelled;          // 1 if the expected query bits follow the fingerprints.
+    unsigned int reserved;
+} FingerprintFileHeader;
+
+/**
+ * A fingerprint sidecar mapped read-only into memory.
+ */
+typedef struct {
+    void *mapping;
+    size_t size;
+    const unsigned long long *fingerprints;
+    const unsigned char *labels;    // Expected query bits, or NULL for a plain key set.
+    long count;
+} Fingerprints;
+
+/**
+ * Fingerprints keys in parallel and writes them as a sidecar file.
+ *
+ * @param filename  The output file.
+ * @param keys      The keys.
+ * @param numKeys   The number of keys.
+ * @param bits      The expected query bits, or NULL for a plain key set.
+ * @return 0 on success, -1 on failure.
+ */
+int writeFingerprintFile(const char *filename, char **keys, int numKeys, const int *bits) {
+    unsigned long long *fingerprints = (unsigned long long *)malloc(((size_t)numKeys + 1) * sizeof(unsigned long long));
+    unsigned char *labels = bits != NULL ? (unsigned char *)malloc((size_t)numKeys + 1) : NULL;
+    if (fingerprints == NULL || (bits != NULL && labels == NULL)) {
+        printf("Memory allocation failed for fingerprints.\n");
+        free(fingerprints);
+        free(labels);
+        return -1;
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numKeys; i++) {
+        fingerprints[i] = FNVHash64(keys[i]);
+        if (labels != NULL) {
+            labels[i] = bits[i] == 1;
+        }
+    }
+
+    int failed = 1;
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror("Error opening file");
+    } else {
+        FingerprintFileHeader header = {0};
+        memcpy(header.magic, FINGERPRINT_MAGIC, sizeof(header.magic));
+        header.count = numKeys;
+        header.labelled = labels != NULL;
+        failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 fwrite(fingerprints, sizeof(unsigned long long), numKeys, file) != (size_t)numKeys ||
+                 (labels != NULL && fwrite(labels, 1, numKeys, file) != (size_t)numKeys);
+        if (fclose(file) != 0 || failed) {
+            perror("Error writing fingerprint file");
+            failed = 1;
+        }
+    }
+    free(fingerprints);
+    free(labels);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Maps a fingerprint sidecar read-only and validates its header.
+ *
+ * @param filename  The sidecar file.
+ * @param set       Receives the mapping.
+ * @return 0 on success, -1 on failure.
+ */
+int mapFingerprintFile(const char *filename, Fingerprints *set) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FingerprintFileHeader)) {
+        printf("%s is not a fingerprint file.\n", filename);
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Error mapping file");
+        return -1;
+    }
+    const FingerprintFileHeader *header = (const FingerprintFileHeader *)mapping;
+    size_t expected = sizeof(FingerprintFileHeader) + header->count * (sizeof(unsigned long long) + (header->labelled != 0));
+    if (memcmp(header->magic, FINGERPRINT_MAGIC, sizeof(header->magic)) != 0 || header->count > INT_MAX ||
+        (size_t)st.st_size < expected) {
+        printf("%s is not a fingerprint file.\n", filename);
+        munmap(mapping, st.st_size);
+        return -1;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    set->mapping = mapping;
+    set->size = st.st_size;
+    set->fingerprints = (const unsigned long long *)(header + 1);
+    set->labels = header->labelled ? (const unsigned char *)(set->fingerprints + header->count) : NULL;
+    set->count = header->count;
+    return 0;
+}
+
+/**
+ * Builds a filter from a fingerprint sidecar without touching the keys, writes it with
+ * the FILTER_HASH_DOUBLE family and, if a labelled query sidecar is given, measures its
+ * error rates the same way.
+ *
+ * @param keysFilename     Sidecar of the keys to insert.
+ * @param queriesFilename  Labelled sidecar of the queries, or NULL.
+ * @param outputFilename   The serialized filter to write, or NULL.
+ * @param fp               The false positive rate to size the filter for.
+ * @param numHashes        The number of hash functions, or 0 for the optimum.
+ * @param pow2             1 to round the filter up to a power-of-two size.
+ * @return 0 on success, -1 on failure.
+ */
+int rebuildFromFingerprints(const char *keysFilename, const char *queriesFilename, const char *outputFilename, double fp, int numHashes,
+                            int pow2) {
+    Fingerprints keys, queries = {0};
+    if (mapFingerprintFile(keysFilename, &keys) != 0) {
+        return -1;
+    }
+    if (queriesFilename != NULL && mapFingerprintFile(queriesFilename, &queries) != 0) {
+        munmap(keys.mapping, keys.size);
+        return -1;
+    }
+    if (queriesFilename != NULL && queries.labels == NULL) {
+        printf("%s holds no expected query bits.\n", queriesFilename);
+        munmap(keys.mapping, keys.size);
+        munmap(queries.mapping, queries.size);
+        return -1;
+    }
+
+    int numToSize = keys.count > 0 ? keys.count : 1;
+    unsigned int m = calculateArraySizeForFP(numToSize, fp);
+    if (pow2) {
+        m = roundUpToPowerOfTwo(m);
+    }
+    if (numHashes <= 0) {
+        numHashes = (m / numToSize) * log(2);
+        numHashes = numHashes > 0 ? numHashes : 1;
+    }
+    int result = -1;
+    unsigned long long *bits = (unsigned long long *)calloc((m + 63) / 64, sizeof(unsigned long long));
+    if (bits == NULL) {
+        printf("Memory allocation failed for the filter.\n");
+    } else {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < keys.count; i++) {
+            for (int h = 0; h < numHashes; h++) {
+                unsigned int index = doubleHashIndex(keys.fingerprints[i], h, m);
+                __atomic_fetch_or(&bits[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Rebuilt %ld keys: m = %u, k = %d, %lf s\n", keys.count, m, numHashes,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+        result = outputFilename != NULL ? writeFilterFile(outputFilename, bits, m, numHashes, keys.count, FILTER_HASH_DOUBLE) : 0;
+
+        if (result == 0 && queriesFilename != NULL) {
+            long fNegative = 0, fPositive = 0, totalPositive = 0;
+            #pragma omp parallel for reduction(+:fNegative, fPositive, totalPositive) schedule(static)
+            for (long i = 0; i < queries.count; i++) {
+                int found = 1;
+                for (int h = 0; h < numHashes && found; h++) {
+                    unsigned int index = doubleHashIndex(queries.fingerprints[i], h, m);
+                    found = (bits[index / 64] >> (index % 64)) & 1;
+                }
+                totalPositive += queries.labels[i];
+                fNegative += queries.labels[i] && !found;
+                fPositive += !queries.labels[i] && found;
+            }
+            long totalNegative = queries.count - totalPositive;
+            printf("False Negative Percentage: %lf%%\n", totalPositive > 0 ? (double)fNegative / totalPositive * 100 : 0);
+            printf("False Positive Percentage: %lf%% (expected %lf%%)\n",
+                   totalNegative > 0 ? (double)fPositive / totalNegative * 100 : 0,
+                   pow(1 - exp(-(double)numHashes * keys.count / m), numHashes) * 100);
+        }
+    }
+
+    free(bits);
+    munmap(keys.mapping, keys.size);
+    if (queriesFilename != NULL) {
+        munmap(queries.mapping, queries.size);
+    }
+    return result;
+}
+
+/**
+ * Counts the bits set in the packed filter that folding its two halves would produce.
+ *
+ * @param words     The packed filter.
+ * @param numWords  The number of 64-bit words, even.
+ * @return The number of set bits of the folded filter.
+ */
+long countFoldedBits(const unsigned long long *words, size_t numWords) {
+    size_t half = numWords / 2;
+    long setBits = 0;
+    #pragma omp parallel for simd reduction(+:setBits) schedule(static)
+    for (size_t i = 0; i < half; i++) {
+        setBits += __builtin_popcountll(words[i] | words[i + half]);
+    }
+    return setBits;
+}
+
+/**
+ * Halves a power-of-two packed filter in place by OR-ing its upper half into its lower half.
+ *
+ * A probe at hash % m lands at (hash % m) % (m / 2) = hash % (m / 2) after folding, so the
+ * folded filter answers exactly as one built with m / 2 bits from the same keys.
+ *
+ * @param words     The packed filter.
+ * @param numWords  The number of 64-bit words, even.
+ */
+void foldPacked(unsigned long long *words, size_t numWords) {
+    size_t half = numWords / 2;
+    #pragma omp parallel for simd schedule(static)
+    for (size_t i = 0; i < half; i++) {
+        words[i] |= words[i + half];
+    }
+}
+
+/**
+ * Folds a serialized power-of-two filter and writes the smaller filter.
+ *
+ * Folds 'times' times, or, when 'maxFp' is given, as long as the estimated false positive
+ * rate fill^k of the result stays within it. Prints the size, fill and estimate of each step.
+ *
+ * @param inputFilename   The serialized filter, with a power-of-two m.
+ * @param outputFilename  The folded filter to write.
+ * @param times           The number of halvings, used when 'maxFp' is 0 (0 means once).
+ * @param maxFp           The largest acceptable estimated false positive rate, or 0.
+ * @return 0 on success, -1 on failure.
+ */
+int foldFilterFile(const char *inputFilename, const char *outputFilename, int times, double maxFp) {
+    MappedFilter input;
+    if (mapFilterFile(inputFilename, &input) != 0) {
+        printf("%s is not a serialized filter.\n", inputFilename);
+        return -1;
+    }
+    unsigned long long m = input.header->m;
+    unsigned int numHashes = input.header->k;
+    if (m < 128 || (m & (m - 1)) != 0) {
+        printf("%s has m = %llu; only power-of-two filters (built with --pow2) can be folded.\n", inputFilename, m);
+        unmapFilterFile(&input);
+        return -1;
+    }
+    size_t numWords = m / 64;
+    unsigned long long *words = (unsigned long long *)malloc(numWords * sizeof(unsigned long long));
+    if (words == NULL) {
+        printf("Memory allocation failed for the filter.\n");
+        unmapFilterFile(&input);
+        return -1;
+    }
+    memcpy(words, input.words, numWords * sizeof(unsigned long long));
+    unsigned long long numInserted = input.header->numInserted;
+    unsigned int hashFamily = input.header->hash;
+    unmapFilterFile(&input);
+
+    double fill = (double)countSetWords(words, numWords) / m;
+    printf("m = %llu: fill %lf, estimated FP %lf%%\n", m, fill, pow(fill, numHashes) * 100);
+    int folds = 0;
+    while (numWords >= 2 && (maxFp > 0 || folds < (times > 0 ? times : 1))) {
+        double foldedFill = (double)countFoldedBits(words, numWords) / (m / 2);
+        if (maxFp > 0 && pow(foldedFill, numHashes) > maxFp) {
+            break;
+        }
+        foldPacked(words, numWords);
+        numWords /= 2;
+        m /= 2;
+        folds++;
+        printf("m = %llu: fill %lf, estimated FP %lf%%\n", m, foldedFill, pow(foldedFill, numHashes) * 100);
+    }
+    if (folds == 0) {
+        printf("No fold keeps the estimated FP within %lf%%.\n", maxFp * 100);
+    }
+
+    int result = writeFilterFile(outputFilename, words, m, numHashes, numInserted, hashFamily);
+    if (result == 0) {
+        printf("Folded %d times into %s: %zu bytes\n", folds, outputFilename, numWords * sizeof(unsigned long long));
+    }
+    free(words);
+    return result;
+}
+
+/**
+ * Computes the XXH64 hash of a byte string with seed 0, as used by Parquet bloom filters.
+ *
+ * @param data    The bytes to hash.
+ * @param length  The number of bytes.
+ * @return The 64-bit hash.
+ */
+unsigned long long XXHash64(const unsigned char *data, size_t length) {
+    const unsigned long long prime1 = 11400714785074694791ULL;
+    const unsigned long long prime2 = 14029467366897019727ULL;
+    const unsigned long long prime3 = 1609587929392839161ULL;
+    const unsigned long long prime4 = 9650029242287828579ULL;
+    const unsigned long long prime5 = 2870177450012600261ULL;
+    const unsigned char *end = data + length;
+    unsigned long long hash;
+
+    if (length >= 32) {
+        unsigned long long lanes[4] = {prime1 + prime2, prime2, 0, -prime1};
+        while (data + 32 <= end) {
+            for (int lane = 0; lane < 4; lane++) {
+                unsigned long long input;
+                memcpy(&input, data + 8 * lane, 8);
+                lanes[lane] += input * prime2;
+                lanes[lane] = ((lanes[lane] << 31) | (lanes[lane] >> 33)) * prime1;
+            }
+            data += 32;
+        }
+        hash = ((lanes[0] << 1) | (lanes[0] >> 63)) + ((lanes[1] << 7) | (lanes[1] >> 57)) +
+               ((lanes[2] << 12) | (lanes[2] >> 52)) + ((lanes[3] << 18) | (lanes[3] >> 46));
+        for (int lane = 0; lane < 4; lane++) {
+            unsigned long long round = lanes[lane] * prime2;
+            round = ((round << 31) | (round >> 33)) * prime1;
+            hash = (hash ^ round) * prime1 + prime4;
+        }
+    } else {
+        hash = prime5;
+    }
+    hash += length;
+
+    while (data + 8 <= end) {
+        unsigned long long input;
+        memcpy(&input, data, 8);
+        input *= prime2;
+        input = ((input << 31) | (input >> 33)) * prime1;
+        hash ^= input;
+        hash = ((hash << 27) | (hash >> 37)) * prime1 + prime4;
+        data += 8;
+    }
+    if (data + 4 <= end) {
+        unsigned int input;
+        memcpy(&input, data, 4);
+        hash ^= (unsigned long long)input * prime1;
+        hash = ((hash << 23) | (hash >> 41)) * prime2 + prime3;
+        data += 4;
+    }
+    while (data < end) {
+        hash ^= (*data) * prime5;
+        hash = ((hash << 11) | (hash >> 53)) * prime1;
+        data++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Eight 32-bit lanes; one split-block filter block, handled as a single vector.
+ */
+typedef unsigned int BlockVector __attribute__((vector_size(32)));
+
+/**
+ * Returns the eight one-bit masks a Parquet split-block filter sets for a hash.
+ *
+ * @param hash  The XXH64 hash of the value.
+ * @param mask  Receives the mask for each 32-bit word of the block.
+ */
+void splitBlockMask(unsigned long long hash, BlockVector *mask) {
+    const BlockVector salts = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                               0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+    unsigned int key = (unsigned int)hash;
+    BlockVector shifts = (salts * key) >> 27;
+    const BlockVector ones = {1, 1, 1, 1, 1, 1, 1, 1};
+    *mask = ones << shifts;
+}
+
+/**
+ * Returns the block of a split-block filter that a hash maps to.
+ */
+size_t splitBlockIndex(unsigned long long hash, size_t numBlocks) {
+    return ((hash >> 32) * numBlocks) >> 32;
+}
+
+/**
+ * Calculates the size in bytes of a split-block filter, following Parquet's sizing.
+ *
+ * @param n   The number of distinct values.
+ * @param fp  The desired false positive rate.
+ * @return A power of two between SBBF_MIN_BYTES and SBBF_MAX_BYTES.
+ */
+size_t splitBlockBytes(long n, double fp) {
+    double bits = -8.0 * n / log(1 - pow(fp, 1.0 / 8));
+    size_t bytes = SBBF_MIN_BYTES;
+    while (bytes < bits / 8 && bytes < SBBF_MAX_BYTES) {
+        bytes *= 2;
+    }
+    return bytes;
+}
+
+/**
+ * Builds a Parquet-compatible split-block Bloom filter from a word file and writes its bitset.
+ *
+ * The file holds only the bitset, as stored in a Parquet column chunk after the Thrift
+ * BloomFilterHeader (XXHASH, BLOCK, UNCOMPRESSED): 32-byte blocks of eight little-endian
+ * 32-bit words. Words are hashed as raw bytes, which is how Parquet hashes BYTE_ARRAY values.
+ *
+ * @param wordsFilename   The word file.
+ * @param outputFilename  The output bitset file.
+ * @return 0 on success, -1 on failure.
+ */
+int exportSplitBlockFilter(const char *wordsFilename, const char *outputFilename) {
+    int numWords = 0;
+    char **words = readWordsFromFile(wordsFilename, &numWords, NULL);
+    if (words == NULL) {
+        return -1;
+    }
+    size_t numBytes = splitBlockBytes(numWords, MAX_FP);
+    size_t numBlocks = numBytes / sizeof(BlockVector);
+    BlockVector *blocks = (BlockVector *)aligned_alloc(sizeof(BlockVector), numBytes);
+    if (blocks == NULL) {
+        printf("Memory allocation failed for split-block filter.\n");
+        freeWordList(words, numWords);
+        return -1;
+    }
+    memset(blocks, 0, numBytes);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        unsigned long long hash = XXHash64((const unsigned char *)words[i], strlen(words[i]));
+        BlockVector mask;
+        splitBlockMask(hash, &mask);
+        unsigned int *block = (unsigned int *)&blocks[splitBlockIndex(hash, numBlocks)];
+        for (int w = 0; w < 8; w++) {
+            __atomic_fetch_or(&block[w], mask[w], __ATOMIC_RELAXED);
+        }
+    }
+
+    int result = 0;
+    FILE *file = fopen(outputFilename, "wb");
+    if (file == NULL || fwrite(blocks, 1, numBytes, file) != numBytes) {
+        perror("Error writing split-block filter");
+        result = -1;
+    }
+    if (file != NULL && fclose(file) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        printf("Wrote split-block filter %s: %d words, %zu bytes, %zu blocks\n", outputFilename, numWords, numBytes, numBlocks);
+    }
+    free(blocks);
+    freeWordList(words, numWords);
+    return result;
+}
+
+/**
+ * Looks up a batch of words in a split-block filter, writing one result bit per word.
+ *
+ * Each iteration fills one word of the result bitmap from 64 words. Within it, hashes are
+ * computed SBBF_PREFETCH_DISTANCE words ahead of the checks so the block of each word is
+ * prefetched before it is needed; each check is one 256-bit AND-compare.
+ *
+ * @param blocks     The filter blocks, which may be a read-only mapping of a file.
+ * @param numBlocks  The number of blocks.
+ * @param words      The words to look up.
+ * @param numWords   The number of words.
+ * @param results    Receives bit i % 64 of word i / 64 set for words that may be present;
+ *                   (numWords + 63) / 64 words.
+ */
+void lookUpSplitBlockBatch(const BlockVector *blocks, size_t numBlocks, char **words, int numWords, unsigned long long *results) {
+    int numResultWords = (numWords + 63) / 64;
+    #pragma omp parallel
+    {
+        unsigned long long hashes[SBBF_PREFETCH_DISTANCE];
+        #pragma omp for schedule(static)
+        for (int r = 0; r < numResultWords; r++) {
+            unsigned long long result = 0;
+            int numInWord = numWords - r * 64 < 64 ? numWords - r * 64 : 64;
+            for (int chunk = 0; chunk < numInWord; chunk += SBBF_PREFETCH_DISTANCE) {
+                int count = numInWord - chunk < SBBF_PREFETCH_DISTANCE ? numInWord - chunk : SBBF_PREFETCH_DISTANCE;
+                for (int i = 0; i < count; i++) {
+                    char *word = words[r * 64 + chunk + i];
+                    hashes[i] = XXHash64((const unsigned char *)word, strlen(word));
+                    __builtin_prefetch(&blocks[splitBlockIndex(hashes[i], numBlocks)]);
+                }
+                for (int i = 0; i < count; i++) {
+                    BlockVector mask;
+                    splitBlockMask(hashes[i], &mask);
+                    BlockVector missing = (blocks[splitBlockIndex(hashes[i], numBlocks)] & mask) != mask;
+                    unsigned long long any = 0;
+                    for (int w = 0; w < 8; w++) {
+                        any |= missing[w];
+                    }
+                    result |= (unsigned long long)(any == 0) << (chunk + i);
+                }
+            }
+            results[r] = result;
+        }
+    }
+}
+
+/**
+ * Maps a split-block filter file and tests the query file against it in place.
+ *
+ * @param filterFilename  The bitset file written by exportSplitBlockFilter() or a Parquet writer.
+ * @param queryFilename   The query file, with a word and its expected bit on each line.
+ * @return 0 on success, -1 on failure.
+ */
+int querySplitBlockFilter(const char *filterFilename, const char *queryFilename) {
+    int descriptor = open(filterFilename, O_RDONLY);
+    struct stat info;
+    if (descriptor < 0 || fstat(descriptor, &info) != 0) {
+        perror("Error opening file");
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        return -1;
+    }
+    size_t numBytes = info.st_size;
+    if (numBytes < SBBF_MIN_BYTES || numBytes % sizeof(BlockVector) != 0) {
+        printf("%s is not a split-block filter bitset.\n", filterFilename);
+        close(descriptor);
+        return -1;
+    }
+    const BlockVector *blocks = (const BlockVector *)mmap(NULL, numBytes, PROT_READ, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (blocks == MAP_FAILED) {
+        perror("Error mapping filter");
+        return -1;
+    }
+
+    char **queries = NULL;
+    int *bits = NULL;
+    int querySize = 0;
+    readQuery(queryFilename, &queries, &bits, &querySize);
+    unsigned long long *results = (unsigned long long *)malloc(((size_t)querySize + 63) / 64 * sizeof(unsigned long long) + sizeof(unsigned long long));
+    if (queries == NULL || results == NULL) {
+        munmap((void *)blocks, numBytes);
+        free(results);
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lookUpSplitBlockBatch(blocks, numBytes / sizeof(BlockVector), queries, querySize, results);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time_taken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    reportQueryResults(results, queries, bits, querySize);
+    printf("Testing time (s): %lf \n", time_taken);
+
+    munmap((void *)blocks, numBytes);
+    free(results);
+    freeWordsAndQueries(NULL, 0, queries, bits, querySize);
+    return 0;
+}
+
+/**
+ * Inserts words into a packed Bloom filter with an explicit number of hash functions.
+ *
+ * Sets the same bit positions as insertWords() does for 'numHashes' hashes, but 64 bits
+ * per word, so concurrent updates to a word use an atomic OR.
+ *
+ * @param words      The words to insert.
+ * @param numWords   The number of words.
+ * @param bits       The packed filter, (m + 63) / 64 zeroed words.
+ * @param m          The number of bits.
+ * @param numHashes  The number of hash functions.
+ */
+void insertWordsPacked(char **words, int numWords, unsigned long long *bits, unsigned int m, int numHashes) {
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        for (int h = 0; h < numHashes; h++) {
+            unsigned int index = APHashRawWithSalt(words[i], h) % m;
+            __atomic_fetch_or(&bits[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Sorts bit positions by the 64-bit word they fall in, with an LSD radix sort on the word
+ * offset from 'firstWord'. Only as many RADIX_BITS digits as the word range needs are sorted.
+ *
+ * @param positions  The positions, all within words [firstWord, firstWord + numWords).
+ * @param scratch    A buffer of the same length.
+ * @param count      The number of positions.
+ * @param firstWord  The first word of the range.
+ * @param numWords   The number of words in the range.
+ * @return Whichever of 'positions' and 'scratch' holds the sorted positions.
+ */
+unsigned int *sortPositionsByWord(unsigned int *positions, unsigned int *scratch, size_t count, size_t firstWord, size_t numWords) {
+    int shift = 0;
+    for (size_t rest = numWords > 0 ? numWords - 1 : 0; rest > 0; rest >>= RADIX_BITS, shift += RADIX_BITS) {
+        size_t counts[1 << RADIX_BITS] = {0};
+        for (size_t i = 0; i < count; i++) {
+            counts[((positions[i] / 64 - firstWord) >> shift) & ((1 << RADIX_BITS) - 1)]++;
+        }
+        size_t offset = 0;
+        for (int digit = 0; digit < (1 << RADIX_BITS); digit++) {
+            size_t digitCount = counts[digit];
+            counts[digit] = offset;
+            offset += digitCount;
+        }
+        for (size_t i = 0; i < count; i++) {
+            scratch[counts[((positions[i] / 64 - firstWord) >> shift) & ((1 << RADIX_BITS) - 1)]++] = positions[i];
+        }
+        unsigned int *swap = positions;
+        positions = scratch;
+        scratch = swap;
+    }
+    return positions;
+}
+
+/**
+ * Inserts words into a packed filter with one store per touched 64-bit word.
+ *
+ * Sets the same bits as insertWordsPacked(). Words are hashed in batches of
+ * SORTED_INSERT_BATCH; each thread owns a contiguous range of filter words, the probe
+ * positions of a batch are partitioned by owner, and each owner sorts its positions by
+ * word and ORs the combined mask of every touched word once. No two threads write the
+ * same word, so no atomics are needed.
+ *
+ * @param words      The words to insert.
+ * @param numWords   The number of words.
+ * @param bits       The packed filter, (m + 63) / 64 words.
+ * @param m          The number of bits.
+ * @param numHashes  The number of hash functions.
+ * @return 0 on success, -1 if the buffers could not be allocated.
+ */
+int insertWordsSorted(char **words, int numWords, unsigned long long *bits, unsigned int m, int numHashes) {
+    size_t numPacked = (m + 63) / 64;
+    int numThreads = omp_get_max_threads();
+    int batch = numWords < SORTED_INSERT_BATCH ? numWords : SORTED_INSERT_BATCH;
+    size_t maxProbes = (size_t)batch * numHashes;
+    unsigned int *probes = (unsigned int *)malloc((maxProbes + 1) * sizeof(unsigned int));
+    unsigned int *partitioned = (unsigned int *)malloc((maxProbes + 1) * sizeof(unsigned int));
+    size_t *counts = (size_t *)malloc((size_t)numThreads * numThreads * sizeof(size_t));
+    size_t *ownerStart = (size_t *)malloc((numThreads + 1) * sizeof(size_t));
+    if (probes == NULL || partitioned == NULL || counts == NULL || ownerStart == NULL) {
+        printf("Memory allocation failed for sorted insertion.\n");
+        free(probes);
+        free(partitioned);
+        free(counts);
+        free(ownerStart);
+        return -1;
+    }
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        double spanStart = traceNow();
+        int thread = omp_get_thread_num();
+        int threads = omp_get_num_threads();
+        size_t *cursor = counts + (size_t)thread * threads;
+        // Word w belongs to thread w * threads / numPacked, so the range starts at the ceiling
+        size_t firstWord = (numPacked * thread + threads - 1) / threads;
+        size_t endWord = (numPacked * (thread + 1) + threads - 1) / threads;
+
+        for (int base = 0; base < numWords; base += batch) {
+            int batchWords = numWords - base < batch ? numWords - base : batch;
+            memset(cursor, 0, threads * sizeof(size_t));
+
+            // Hash the batch and count the probes falling in each owner's range
+            #pragma omp for schedule(static)
+            for (int i = 0; i < batchWords; i++) {
+                for (int h = 0; h < numHashes; h++) {
+                    unsigned int index = APHashRawWithSalt(words[base + i], h) % m;
+                    probes[(size_t)i * numHashes + h] = index;
+                    cursor[(size_t)(index / 64) * threads / numPacked]++;
+                }
+            }
+
+            // Lay the owners out one after another, each split by source thread
+            #pragma omp single
+            {
+                size_t offset = 0;
+                for (int owner = 0; owner < threads; owner++) {
+                    ownerStart[owner] = offset;
+                    for (int source = 0; source < threads; source++) {
+                        size_t count = counts[(size_t)source * threads + owner];
+                        counts[(size_t)source * threads + owner] = offset;
+                        offset += count;
+                    }
+                }
+                ownerStart[threads] = offset;
+            }
+
+            // The same static schedule gives each thread the probes it counted
+            #pragma omp for schedule(static)
+            for (int i = 0; i < batchWords; i++) {
+                for (int h = 0; h < numHashes; h++) {
+                    unsigned int index = probes[(size_t)i * numHashes + h];
+                    partitioned[cursor[(size_t)(index / 64) * threads / numPacked]++] = index;
+                }
+            }
+
+            // Combine the probes of each owned word and store them once
+            size_t start = ownerStart[thread];
+            size_t count = ownerStart[thread + 1] - start;
+            unsigned int *sorted = sortPositionsByWord(partitioned + start, probes + start, count, firstWord, endWord - firstWord);
+            for (size_t i = 0; i < count;) {
+                size_t word = sorted[i] / 64;
+                unsigned long long mask = 0;
+                for (; i < count && sorted[i] / 64 == word; i++) {
+                    mask |= 1ULL << (sorted[i] % 64);
+                }
+                bits[word] |= mask;
+            }
+            #pragma omp barrier
+        }
+        traceSpan("insert chunk", spanStart);
+    }
+
+    free(probes);
+    free(partitioned);
+    free(counts);
+    free(ownerStart);
+    return 0;
+}
+
+/**
+ * Inserts words into a packed filter with the FILTER_HASH_DOUBLE family: one FNVHash64
+ * per word, probes derived by doubleHashIndex(), and an atomic OR per probe.
+ *
+ * @param words      The words to insert.
+ * @param numWords   The number of words.
+ * @param bits       The packed filter, (m + 63) / 64 zeroed words.
+ * @param m          The number of bits.
+ * @param numHashes  The number of hash functions.
+ */
+void insertWordsDoubleHashed(char **words, int numWords, unsigned long long *bits, unsigned int m, int numHashes) {
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        unsigned long long fingerprint = FNVHash64(words[i]);
+        for (int h = 0; h < numHashes; h++) {
+            unsigned int index = doubleHashIndex(fingerprint, h, m);
+            __atomic_fetch_or(&bits[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * A pool that carves many small filters out of huge-page slabs.
+ *
+ * Blocks come in POOL_CLASSES power-of-two size classes from CACHE_LINE_BYTES up to
+ * POOL_MAX_BLOCK, and every slab serves a single class, so blocks are cache-line aligned
+ * and carry no header. Freed blocks go on a per-class free list linked through their
+ * first word; creating and destroying a filter are both O(1).
+ */
+typedef struct {
+    omp_lock_t lock;
+    void *freeBlocks[POOL_CLASSES]; // Freed blocks of each class, linked through their first word.
+    char *bumpNext[POOL_CLASSES];   // Next never-used block in the class's current slab.
+    char *bumpEnd[POOL_CLASSES];    // End of the class's current slab.
+    char **slabs;                   // Every slab mapped so far.
+    int numSlabs;
+    int slabCapacity;
+    int numAssigned;                // Slabs [0, numAssigned) are in use; the rest were reset and are zero.
+    long largeBytes;                // Bytes of filters too large for a class, allocated directly.
+} FilterPool;
+
+/**
+ * Initialises an empty pool; no memory is mapped until the first filter is created.
+ *
+ * @param pool  The pool.
+ */
+void initFilterPool(FilterPool *pool) {
+    memset(pool, 0, sizeof(FilterPool));
+    omp_init_lock(&pool->lock);
+}
+
+/**
+ * Returns the size class of a block of 'bytes' bytes.
+ */
+int poolClass(size_t bytes) {
+    int sizeClass = 0;
+    while (((size_t)CACHE_LINE_BYTES << sizeClass) < bytes) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+/**
+ * Maps a slab of POOL_SLAB_BYTES aligned to its size, backed by a huge page when the
+ * system has any reserved, and otherwise marked for transparent huge pages.
+ *
+ * @return The slab, or NULL if it could not be mapped.
+ */
+char *mapPoolSlab(void) {
+    void *slab = mmap(NULL, POOL_SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED) {
+        return (char *)slab;
+    }
+    // Over-map and trim so the slab is huge-page aligned
+    char *region = (char *)mmap(NULL, 2 * POOL_SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == (char *)MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t)region + POOL_SLAB_BYTES - 1) & ~(uintptr_t)(POOL_SLAB_BYTES - 1));
+    if (aligned > region) {
+        munmap(region, aligned - region);
+    }
+    munmap(aligned + POOL_SLAB_BYTES, region + POOL_SLAB_BYTES - aligned);
+    madvise(aligned, POOL_SLAB_BYTES, MADV_HUGEPAGE);
+    return aligned;
+}
+
+/**
+ * Hands out a zeroed slab: a reset one if there is one, otherwise a newly mapped one.
+ * Must be called with the pool lock held.
+ *
+ * @param pool  The pool.
+ * @return The slab, or NULL if no slab could be mapped.
+ */
+char *acquirePoolSlab(FilterPool *pool) {
+    if (pool->numAssigned < pool->numSlabs) {
+        return pool->slabs[pool->numAssigned++];
+    }
+    if (pool->numSlabs == pool->slabCapacity) {
+        int capacity = pool->slabCapacity * 2 + 16;
+        char **grown = (char **)realloc(pool->slabs, capacity * sizeof(char *));
+        if (grown == NULL) {
+            return NULL;
+        }
+        pool->slabs = grown;
+        pool->slabCapacity = capacity;
+    }
+    char *slab = mapPoolSlab();
+    if (slab != NULL) {
+        pool->slabs[pool->numSlabs++] = slab;
+        pool->numAssigned++;
+    }
+    return slab;
+}
+
+/**
+ * Creates a zeroed, cache-line aligned filter of 'bytes' bytes.
+ *
+ * @param pool   The pool.
+ * @param bytes  The size of the filter.
+ * @return The filter memory, or NULL if it could not be allocated.
+ */
+void *createPoolFilter(FilterPool *pool, size_t bytes) {
+    if (bytes > POOL_MAX_BLOCK) {
+        size_t rounded = (bytes + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+        void *filter = aligned_alloc(CACHE_LINE_BYTES, rounded);
+        if (filter != NULL) {
+            memset(filter, 0, rounded);
+            #pragma omp atomic
+            pool->largeBytes += rounded;
+        }
+        return filter;
+    }
+
+    int sizeClass = poolClass(bytes);
+    size_t blockBytes = (size_t)CACHE_LINE_BYTES << sizeClass;
+    void *block = NULL;
+    int reused = 0;
+    omp_set_lock(&pool->lock);
+    if (pool->freeBlocks[sizeClass] != NULL) {
+        block = pool->freeBlocks[sizeClass];
+        pool->freeBlocks[sizeClass] = *(void **)block;
+        reused = 1;
+    } else {
+        if (pool->bumpNext[sizeClass] == pool->bumpEnd[sizeClass]) {
+            char *slab = acquirePoolSlab(pool);
+            if (slab != NULL) {
+                pool->bumpNext[sizeClass] = slab;
+                pool->bumpEnd[sizeClass] = slab + POOL_SLAB_BYTES;
+            }
+        }
+        if (pool->bumpNext[sizeClass] != pool->bumpEnd[sizeClass]) {
+            block = pool->bumpNext[sizeClass];
+            pool->bumpNext[sizeClass] += blockBytes;
+        }
+    }
+    omp_unset_lock(&pool->lock);
+
+    // Fresh slab memory is already zero; recycled blocks are not
+    if (reused) {
+        memset(block, 0, bytes);
+    }
+    return block;
+}
+
+/**
+ * Returns a filter to its pool.
+ *
+ * @param pool    The pool.
+ * @param filter  The filter memory from createPoolFilter(), or NULL.
+ * @param bytes   The size it was created with.
+ */
+void destroyPoolFilter(FilterPool *pool, void *filter, size_t bytes) {
+    if (filter == NULL) {
+        return;
+    }
+    if (bytes > POOL_MAX_BLOCK) {
+        free(filter);
+        #pragma omp atomic
+        pool->largeBytes -= (bytes + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+        return;
+    }
+    int sizeClass = poolClass(bytes);
+    omp_set_lock(&pool->lock);
+    *(void **)filter = pool->freeBlocks[sizeClass];
+    pool->freeBlocks[sizeClass] = filter;
+    omp_unset_lock(&pool->lock);
+}
+
+/**
+ * Drops every filter in the pool at once. The slabs stay mapped, but their pages are
+ * returned to the kernel with MADV_DONTNEED and read back as zero on next use.
+ * Filters larger than a size class are not affected and must be destroyed individually.
+ *
+ * @param pool  The pool.
+ */
+void resetFilterPool(FilterPool *pool) {
+    omp_set_lock(&pool->lock);
+    for (int i = 0; i < pool->numAssigned; i++) {
+        madvise(pool->slabs[i], POOL_SLAB_BYTES, MADV_DONTNEED);
+    }
+    pool->numAssigned = 0;
+    memset(pool->freeBlocks, 0, sizeof(pool->freeBlocks));
+    memset(pool->bumpNext, 0, sizeof(pool->bumpNext));
+    memset(pool->bumpEnd, 0, sizeof(pool->bumpEnd));
+    omp_unset_lock(&pool->lock);
+}
+
+/**
+ * Unmaps every slab of a pool.
+ *
+ * @param pool  The pool.
+ */
+void freeFilterPool(FilterPool *pool) {
+    for (int i = 0; i < pool->numSlabs; i++) {
+        munmap(pool->slabs[i], POOL_SLAB_BYTES);
+    }
+    free(pool->slabs);
+    omp_destroy_lock(&pool->lock);
+}
+
+/**
+ * One line of a batch manifest: build 'output' from 'input' for false positive rate 'fp'.
+ */
+typedef struct {
+    char input[PATH_MAX];
+    char output[PATH_MAX];
+    double fp;
+    long size;      // Size of the input file in bytes, used for scheduling.
+    int pow2;       // Round m up to a power of two and use the FILTER_HASH_DOUBLE family.
+    FilterPool *pool; // Pool the filter bits are carved from.
+} BatchEntry;
+
+/**
+ * Orders batch entries by descending input size.
+ */
+int compareBatchEntries(const void *a, const void *b) {
+    long left = ((const BatchEntry *)a)->size;
+    long right = ((const BatchEntry *)b)->size;
+    return (left < right) - (left > right);
+}
+
+/**
+ * Builds the filter of one batch entry and writes it to its output file.
+ *
+ * Parsing and insertion use whatever threads the enclosing OpenMP level provides: all of
+ * them for a large file built on its own, one for a small file built next to others.
+ *
+ * @param entry  The manifest entry.
+ * @return 0 on success, -1 on failure.
+ */
+int buildBatchEntry(const BatchEntry *entry) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int numWords = 0;
+    char **words = readWordsFromFile(entry->input, &numWords, NULL);
+    if (words == NULL) {
+        return -1;
+    }
+    int numToSize = numWords > 0 ? numWords : 1;
+    unsigned int m = calculateArraySizeForFP(numToSize, entry->fp);
+    if (entry->pow2) {
+        m = roundUpToPowerOfTwo(m);
+    }
+    int numHashes = (m / numToSize) * log(2);
+    if (numHashes < 1) {
+        numHashes = 1;
+    }
+
+    int result = -1;
+    size_t filterBytes = (m + 63) / 64 * sizeof(unsigned long long);
+    unsigned long long *bits = (unsigned long long *)createPoolFilter(entry->pool, filterBytes);
+    if (bits == NULL) {
+        printf("Memory allocation failed for %s.\n", entry->input);
+    } else {
+        // Power-of-two filters are reduced by a mask, which APHash's low bits are too weak for.
+        // Otherwise filters that spill out of cache are cheaper to fill in sorted word order.
+        if (entry->pow2) {
+            insertWordsDoubleHashed(words, numWords, bits, m, numHashes);
+        } else if ((m + 63) / 64 * sizeof(unsigned long long) < SORTED_INSERT_MIN_BYTES ||
+                   insertWordsSorted(words, numWords, bits, m, numHashes) != 0) {
+            insertWordsPacked(words, numWords, bits, m, numHashes);
+        }
+        result = writeFilterFile(entry->output, bits, m, numHashes, numWords, entry->pow2 ? FILTER_HASH_DOUBLE : FILTER_HASH_APHASH);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time_taken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    if (result == 0) {
+        printf("%s -> %s: %d words, m = %u, k = %d, %lf s\n", entry->input, entry->output, numWords, m, numHashes, time_taken);
+    }
+
+    destroyPoolFilter(entry->pool, bits, filterBytes);
+    freeWordList(words, numWords);
+    return result;
+}
+
+/**
+ * Builds every filter listed in a manifest and writes them as serialized filter files.
+ *
+ * Each manifest line holds an input word file, an output filter file and a false
+ * positive rate; blank lines and lines starting with '#' are ignored. Inputs larger
+ * than an even share of the total are built one at a time with all threads, then the
+ * remaining small inputs are built concurrently, one thread each, largest first.
+ *
+ * @param manifestFilename  The manifest file.
+ * @param pow2              1 to round every filter up to a power-of-two size.
+ * @return The number of filters that failed to build, or -1 if the manifest is invalid.
+ */
+int runBatch(const char *manifestFilename, int pow2) {
+    FILE *manifest = fopen(manifestFilename, "r");
+    if (manifest == NULL) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    FilterPool pool;
+    int numEntries = 0, capacity = 16;
+    BatchEntry *entries = (BatchEntry *)malloc(capacity * sizeof(BatchEntry));
+    char line[2 * PATH_MAX + 64];
+    long totalSize = 0;
+    while (entries != NULL && fgets(line, sizeof(line), manifest) != NULL) {
+        char *first = line + strspn(line, " \t\r\n");
+        if (*first == '\0' || *first == '#') {
+            continue;
+        }
+        if (numEntries == capacity) {
+            capacity *= 2;
+            BatchEntry *grown = (BatchEntry *)realloc(entries, capacity * sizeof(BatchEntry));
+            if (grown == NULL) {
+                free(entries);
+                entries = NULL;
+                break;
+            }
+            entries = grown;
+        }
+        BatchEntry *entry = &entries[numEntries];
+        if (sscanf(first, "%4095s %4095s %lf", entry->input, entry->output, &entry->fp) != 3 ||
+            entry->fp <= 0 || entry->fp >= 1) {
+            printf("Invalid manifest line: %s", first);
+            free(entries);
+            fclose(manifest);
+            return -1;
+        }
+        entry->pow2 = pow2;
+        entry->pool = &pool;
+        struct stat info;
+        entry->size = stat(entry->input, &info) == 0 ? info.st_size : 0;
+        totalSize += entry->size;
+        numEntries++;
+    }
+    fclose(manifest);
+    if (entries == NULL) {
+        printf("Memory allocation failed for manifest.\n");
+        return -1;
+    }
+
+    qsort(entries, numEntries, sizeof(BatchEntry), compareBatchEntries);
+    long largeSize = totalSize / omp_get_max_threads();
+    int numLarge = 0;
+    while (numLarge < numEntries && entries[numLarge].size > largeSize) {
+        numLarge++;
+    }
+
+    initFilterPool(&pool);
+    int failures = 0;
+    // Large inputs: one at a time, parallel inside the file
+    for (int i = 0; i < numLarge; i++) {
+        failures += buildBatchEntry(&entries[i]) != 0;
+    }
+    // Every large filter is destroyed by now; hand their pages back before the small ones
+    resetFilterPool(&pool);
+    // Small inputs: concurrently, each on one thread since nested regions are inactive
+    omp_set_max_active_levels(1);
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:failures)
+    for (int i = numLarge; i < numEntries; i++) {
+        failures += buildBatchEntry(&entries[i]) != 0;
+    }
+
+    printf("Built %d of %d filters (%d large, %d small)\n", numEntries - failures, numEntries, numLarge, numEntries - numLarge);
+    printf("Filter pool: %d slabs of %d bytes\n", pool.numSlabs, POOL_SLAB_BYTES);
+    freeFilterPool(&pool);
+    free(entries);
+    return failures;
+}
+
+/**
+ * Counts the false negatives and false positives of a filter over the labelled queries.
+ *
+ * @param lookUpFunction  The lookup of the filter.
+ * @param filter          The filter.
+ * @param queries         The query words.
+ * @param bits            The expected query bits.
+ * @param querySize       The number of queries.
+ * @param fNegative       A pointer where the number of false negatives is stored.
+ * @param fPositive       A pointer where the number of false positives is stored.
+ * @param totalNegative   A pointer where the number of negative queries is stored.
+ */
+void countFilterErrors(int (*lookUpFunction)(char *word, const void *filter), const void *filter,
+                       char **queries, int *bits, int querySize, int *fNegative, int *fPositive, int *totalNegative) {
+    int negatives = 0, falseNegatives = 0, falsePositives = 0;
+    #pragma omp parallel for reduction(+:negatives, falseNegatives, falsePositives) schedule(static)
+    for (int i = 0; i < querySize; i++) {
+        int lookupResult = lookUpFunction(queries[i], filter);
+        if (bits[i] == 1) {
+            falseNegatives += !lookupResult;
+        } else {
+            negatives++;
+            falsePositives += lookupResult;
+        }
+    }
+    *fNegative = falseNegatives;
+    *fPositive = falsePositives;
+    *totalNegative = negatives;
+}
+
+/**
+ * A classic int bit array with its size, so it can be checked through countFilterErrors().
+ */
+typedef struct {
+    int *bitArray;
+    int m;
+} ClassicFilter;
+
+/**
+ * Lookup adapter for a ClassicFilter.
+ */
+int lookUpClassic(char *word, const void *filter) {
+    const ClassicFilter *classic = (const ClassicFilter *)filter;
+    return lookUp(word, classic->bitArray, classic->m);
+}
+
+/**
+ * Prints and scores the error checks of one filter: no false negatives, and a false
+ * positive rate no higher than the theoretical rate plus VERIFY_FP_TOLERANCE relative
+ * and four standard errors of the measurement.
+ *
+ * @return The number of failed checks.
+ */
+int checkFilterErrors(const char *name, int threads, int fNegative, int fPositive, int totalNegative, double expected) {
+    double measured = totalNegative > 0 ? (double)fPositive / totalNegative : 0;
+    double standardError = totalNegative > 0 ? sqrt(expected * (1 - expected) / totalNegative) : 0;
+    int fpOk = measured <= expected * (1 + VERIFY_FP_TOLERANCE) + 4 * standardError;
+    printf("%s %-8s threads %2d: false negatives %d\n", fNegative == 0 ? "PASS" : "FAIL", name, threads, fNegative);
+    printf("%s %-8s threads %2d: FP %lf%% (expected %lf%%)\n", fpOk ? "PASS" : "FAIL", name, threads,
+           measured * 100, expected * 100);
+    return (fNegative != 0) + !fpOk;
+}
+
+/**
+ * Checks that resetFilterPool() drops every pooled filter: filters created after a reset
+ * must come back zeroed from the slabs already mapped, and refill to the same bits.
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @param m         The number of bits, capped to the largest pooled block.
+ * @return The number of failed checks.
+ */
+int verifyFilterPool(char **words, int numWords, unsigned int m) {
+    size_t bytes = (m + 63) / 64 * sizeof(unsigned long long);
+    if (bytes > POOL_MAX_BLOCK) {
+        bytes = POOL_MAX_BLOCK;
+        m = bytes * 8;
+    }
+    FilterPool pool;
+    initFilterPool(&pool);
+    unsigned long long *filters[POOL_VERIFY_FILTERS];
+    unsigned char *expected = (unsigned char *)malloc(bytes);
+    int failures = 0, created = expected != NULL;
+    for (int f = 0; f < POOL_VERIFY_FILTERS; f++) {
+        filters[f] = (unsigned long long *)createPoolFilter(&pool, bytes);
+        created &= filters[f] != NULL;
+    }
+    if (created) {
+        for (int f = 0; f < POOL_VERIFY_FILTERS; f++) {
+            insertWordsPacked(words, numWords, filters[f], m, k);
+        }
+        memcpy(expected, filters[0], bytes);
+
+        // Drop the filters without destroying them, then create the same number again
+        resetFilterPool(&pool);
+        int numSlabs = pool.numSlabs;
+        long nonZero = 0, mismatches = 0;
+        for (int f = 0; f < POOL_VERIFY_FILTERS; f++) {
+            filters[f] = (unsigned long long *)createPoolFilter(&pool, bytes);
+            created &= filters[f] != NULL;
+        }
+        if (created) {
+            for (int f = 0; f < POOL_VERIFY_FILTERS; f++) {
+                for (size_t b = 0; b < bytes; b++) {
+                    nonZero += ((unsigned char *)filters[f])[b] != 0;
+                }
+                insertWordsPacked(words, numWords, filters[f], m, k);
+                for (size_t b = 0; b < bytes; b++) {
+                    mismatches += ((unsigned char *)filters[f])[b] != expected[b];
+                }
+            }
+        }
+        printf("%s %-8s: %ld bytes not zero after reset\n", nonZero == 0 ? "PASS" : "FAIL", "pool", nonZero);
+        printf("%s %-8s: %ld bytes differ after refill\n", mismatches == 0 ? "PASS" : "FAIL", "pool", mismatches);
+        printf("%s %-8s: %d slabs mapped after reset (%d before)\n", pool.numSlabs == numSlabs ? "PASS" : "FAIL", "pool", pool.numSlabs, numSlabs);
+        failures += (nonZero != 0) + (mismatches != 0) + (pool.numSlabs != numSlabs);
+    }
+    if (!created) {
+        printf("FAIL %-8s: filter creation failed\n", "pool");
+        failures++;
+    }
+    for (int f = 0; f < POOL_VERIFY_FILTERS; f++) {
+        destroyPoolFilter(&pool, filters[f], bytes);
+    }
+    freeFilterPool(&pool);
+    free(expected);
+    return failures;
+}
+
+/**
+ * Prints and scores the bit comparison of one filter against the serial reference.
+ *
+ * @return 1 if any bit differs, 0 otherwise.
+ */
+int checkBitMismatches(const char *name, int threads, int mismatches) {
+    printf("%s %-8s threads %2d: %d bits differ from serial\n", mismatches == 0 ? "PASS" : "FAIL", name, threads, mismatches);
+    return mismatches != 0;
+}
+
+/**
+ * Checks every insertion path and engine against the serial reference.
+ *
+ * For each thread count in VERIFY_THREADS, the classic int array, the packed layout
+ * written by batch mode and every engine with the classic layout must set exactly the
+ * bits set by insertWordsSerial(), the insert loop of serial.c. Every filter must also answer the labelled
+ * queries with no false negatives and a false positive rate within tolerance of theory.
+ * Finally, resetting the filter pool is checked with verifyFilterPool().
+ *
+ * @param words      The words to insert.
+ * @param numWords   The number of words.
+ * @param input      The labelled queries and the query profile.
+ * @param m          The number of bits.
+ * @return The number of failed checks.
+ */
+int verifyEngines(char **words, int numWords, const EngineInput *input, int m) {
+    char **queries = input->queries;
+    int *bits = input->bits;
+    int querySize = input->numQueries;
+    const int threadCounts[] = VERIFY_THREADS;
+    int failures = 0;
+    int fNegative, fPositive, totalNegative;
+    double classicFP = pow(1 - exp(-(double)k * numWords / m), k);
+
+    int *reference = (int *)calloc(m, sizeof(int));
+    int *bitArray = (int *)malloc(m * sizeof(int));
+    unsigned long long *packed = (unsigned long long *)malloc((m + 63) / 64 * sizeof(unsigned long long));
+    if (reference == NULL || bitArray == NULL || packed == NULL) {
+        printf("Memory allocation failed for verification.\n");
+        free(reference);
+        free(bitArray);
+        free(packed);
+        return 1;
+    }
+    insertWordsSerial(words, numWords, reference, m, k);
+    int savedThreads = omp_get_max_threads();
+
+    for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+        int threads = threadCounts[t];
+        omp_set_num_threads(threads);
+
+        // Classic int array
+        memset(bitArray, 0, m * sizeof(int));
+        insertWords(words, numWords, bitArray, m);
+        int mismatches = 0;
+        #pragma omp parallel for reduction(+:mismatches)
+        for (int i = 0; i < m; i++) {
+            mismatches += (bitArray[i] != 0) != reference[i];
+        }
+        failures += checkBitMismatches("classic", threads, mismatches);
+        ClassicFilter classic = {bitArray, m};
+        countFilterErrors(lookUpClassic, &classic, queries, bits, querySize, &fNegative, &fPositive, &totalNegative);
+        failures += checkFilterErrors("classic", threads, fNegative, fPositive, totalNegative, classicFP);
+
+        // Packed layout of serialized filters
+        memset(packed, 0, (m + 63) / 64 * sizeof(unsigned long long));
+        insertWordsPacked(words, numWords, packed, m, k);
+        mismatches = 0;
+        #pragma omp parallel for reduction(+:mismatches)
+        for (int i = 0; i < m; i++) {
+            mismatches += (int)((packed[i / 64] >> (i % 64)) & 1) != reference[i];
+        }
+        failures += checkBitMismatches("packed", threads, mismatches);
+
+        // Sorted, owner-partitioned insertion into the packed layout
+        memset(packed, 0, (m + 63) / 64 * sizeof(unsigned long long));
+        mismatches = insertWordsSorted(words, numWords, packed, m, k) != 0 ? m : 0;
+        #pragma omp parallel for reduction(+:mismatches)
+        for (int i = 0; i < m; i++) {
+            mismatches += (int)((packed[i / 64] >> (i % 64)) & 1) != reference[i];
+        }
+        failures += checkBitMismatches("sorted", threads, mismatches);
+
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+            const FilterEngine *engine = &engines[e];
+            void *filter = engine->build(words, numWords, m, input);
+            if (filter == NULL) {
+                printf("FAIL %-8s threads %2d: build failed\n", engine->name, threads);
+                failures++;
+                continue;
+            }
+            if (engine->testBit != NULL) {
+                mismatches = 0;
+                #pragma omp parallel for reduction(+:mismatches)
+                for (int i = 0; i < m; i++) {
+                    mismatches += engine->testBit(filter, i) != reference[i];
+                }
+                failures += checkBitMismatches(engine->name, threads, mismatches);
+            }
+            double expected = engine->expectedFP != NULL ? engine->expectedFP(filter) : classicFP;
+            countFilterErrors(engine->lookUp, filter, queries, bits, querySize, &fNegative, &fPositive, &totalNegative);
+            failures += checkFilterErrors(engine->name, threads, fNegative, fPositive, totalNegative, expected);
+            engine->destroy(filter);
+        }
+    }
+
+    omp_set_num_threads(savedThreads);
+    failures += verifyFilterPool(words, numWords, m);
+    free(reference);
+    free(bitArray);
+    free(packed);
+    printf("Verification %s: %d failed checks\n", failures == 0 ? "passed" : "FAILED", failures);
+    return failures;
+}
+
+/**
+ * Orders word pointers by their strings.
+ */
+int compareWords(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Sorts words in place: every thread sorts one chunk, then pairs of sorted runs are
+ * merged in parallel until a single run is left.
+ *
+ * @param words     The words.
+ * @param numWords  The number of words.
+ * @return 0 on success, -1 if the merge buffer could not be allocated.
+ */
+int sortWordsParallel(char **words, int numWords) {
+    int numRuns = omp_get_max_threads();
+    char **buffer = (char **)malloc(((size_t)numWords + 1) * sizeof(char *));
+    if (buffer == NULL) {
+        return -1;
+    }
+    #pragma omp parallel for schedule(static, 1)
+    for (int run = 0; run < numRuns; run++) {
+        long start = (long)numWords * run / numRuns, end = (long)numWords * (run + 1) / numRuns;
+        qsort(words + start, end - start, sizeof(char *), compareWords);
+    }
+
+    char **from = words, **to = buffer;
+    for (int width = 1; width < numRuns; width *= 2) {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int run = 0; run < numRuns; run += 2 * width) {
+            long start = (long)numWords * run / numRuns;
+            long middle = (long)numWords * (run + width < numRuns ? run + width : numRuns) / numRuns;
+            long end = (long)numWords * (run + 2 * width < numRuns ? run + 2 * width : numRuns) / numRuns;
+            long left = start, right = middle, out = start;
+            while (left < middle && right < end) {
+                to[out++] = strcmp(from[left], from[right]) <= 0 ? from[left++] : from[right++];
+            }
+            while (left < middle) {
+                to[out++] = from[left++];
+            }
+            while (right < end) {
+                to[out++] = from[right++];
+            }
+        }
+        char **swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != words) {
+        memcpy(words, from, (size_t)numWords * sizeof(char *));
+    }
+    free(buffer);
+    return 0;
+}
+
+/**
+ * A prefix Bloom filter: every distinct prefix of the configured lengths is inserted, so
+ * "does any word start with P" can be answered for prefixes at least that long.
+ */
+typedef struct {
+    unsigned long long *bits;
+    unsigned int m;
+    int numHashes;
+    int lengths[MAX_PREFIX_LENGTHS];    // Prefix lengths, ascending.
+    int numLengths;
+} PrefixFilter;
+
+/**
+ * Returns probe 'h' of the first 'length' characters of a word; the salt keeps the
+ * prefixes of different lengths apart.
+ */
+unsigned int prefixIndex(const char *word, int length, int h, unsigned int m) {
+    return APHashRawWithSaltN(word, length, length * MAX_K + h) % m;
+}
+
+/**
+ * Builds a prefix filter from sorted words. Only the first word of each run of words
+ * sharing a prefix inserts it, so the filter is sized for the distinct prefixes.
+ *
+ * @param sorted      The words, sorted.
+ * @param numWords    The number of words.
+ * @param lengths     The prefix lengths, ascending.
+ * @param numLengths  The number of prefix lengths.
+ * @param filter      The filter to fill in.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int buildPrefixFilter(char **sorted, int numWords, const int *lengths, int numLengths, PrefixFilter *filter) {
+    memset(filter, 0, sizeof(PrefixFilter));
+    memcpy(filter->lengths, lengths, numLengths * sizeof(int));
+    filter->numLengths = numLengths;
+
+    // A word starts a new prefix of length L unless the previous word shares its first L characters
+    long distinct = 0;
+    #pragma omp parallel for reduction(+:distinct) schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        for (int l = 0; l < numLengths; l++) {
+            distinct += (int)strlen(sorted[i]) >= lengths[l] && (i == 0 || strncmp(sorted[i], sorted[i - 1], lengths[l]) != 0);
+        }
+    }
+    filter->m = calculateArraySizeForFP(distinct > 0 ? distinct : 1, PREFIX_FP);
+    filter->m = filter->m > 64 ? filter->m : 64;
+    filter->numHashes = round(-log(PREFIX_FP) / log(2));
+    filter->bits = (unsigned long long *)calloc((filter->m + 63) / 64, sizeof(unsigned long long));
+    if (filter->bits == NULL) {
+        return -1;
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        for (int l = 0; l < numLengths; l++) {
+            if ((int)strlen(sorted[i]) < lengths[l] || (i > 0 && strncmp(sorted[i], sorted[i - 1], lengths[l]) == 0)) {
+                continue;
+            }
+            for (int h = 0; h < filter->numHashes; h++) {
+                unsigned int index = prefixIndex(sorted[i], lengths[l], h, filter->m);
+                __atomic_fetch_or(&filter->bits[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Tests whether any inserted word may start with a prefix, using the longest configured
+ * length that the prefix covers. Prefixes shorter than every configured length cannot be
+ * ruled out.
+ *
+ * @return 1 if a word may start with the prefix, 0 if none does.
+ */
+int prefixMayExist(const PrefixFilter *filter, const char *prefix) {
+    int length = strlen(prefix);
+    int l = filter->numLengths - 1;
+    while (l >= 0 && filter->lengths[l] > length) {
+        l--;
+    }
+    if (l < 0) {
+        return 1;
+    }
+    for (int h = 0; h < filter->numHashes; h++) {
+        unsigned int index = prefixIndex(prefix, filter->lengths[l], h, filter->m);
+        if (!((filter->bits[index / 64] >> (index % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * A Rosetta-style range filter over words mapped to 64-bit keys (their first eight bytes,
+ * big-endian, so key order is string order). Level l holds a Bloom filter of every
+ * distinct l-bit key prefix, sized for the number of distinct prefixes at that level.
+ */
+typedef struct {
+    unsigned long long *levels[RANGE_KEY_BITS + 1];
+    unsigned int levelM[RANGE_KEY_BITS + 1];
+    int numHashes;
+    int empty;
+} RangeFilter;
+
+/**
+ * Maps a word to its order-preserving 64-bit range key.
+ */
+unsigned long long rangeKey(const char *word) {
+    unsigned long long key = 0;
+    int i = 0;
+    for (; i < 8 && word[i]; i++) {
+        key = key << 8 | (unsigned char)word[i];
+    }
+    return i < 8 ? key << (8 * (8 - i)) : key;
+}
+
+/**
+ * Returns probe 'h' of an l-bit key prefix at its level.
+ */
+unsigned int rangeIndex(const RangeFilter *filter, int level, unsigned long long prefix, int h) {
+    unsigned long long hash = prefix * 0x9e3779b97f4a7c15ULL + level;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return doubleHashIndex(hash, h, filter->levelM[level]);
+}
+
+/**
+ * Tests an l-bit key prefix against its level.
+ */
+int testRangeLevel(const RangeFilter *filter, int level, unsigned long long prefix) {
+    for (int h = 0; h < filter->numHashes; h++) {
+        unsigned int index = rangeIndex(filter, level, prefix, h);
+        if (!((filter->levels[level][index / 64] >> (index % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void freeRangeFilter(RangeFilter *filter) {
+    for (int level = 1; level <= RANGE_KEY_BITS; level++) {
+        free(filter->levels[level]);
+    }
+}
+
+/**
+ * Builds a range filter from sorted words. Adjacent keys share the prefixes above their
+ * highest differing bit, so each key inserts only the prefixes below it.
+ *
+ * @param sorted    The words, sorted.
+ * @param numWords  The number of words.
+ * @param filter    The filter to fill in.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int buildRangeFilter(char **sorted, int numWords, RangeFilter *filter) {
+    memset(filter, 0, sizeof(RangeFilter));
+    filter->empty = numWords == 0;
+    filter->numHashes = round(-log(RANGE_LEVEL_FP) / log(2));
+    unsigned long long *keys = (unsigned long long *)malloc(((size_t)numWords + 1) * sizeof(unsigned long long));
+    if (keys == NULL) {
+        return -1;
+    }
+    // shared[i] = number of leading bits key i shares with key i - 1
+    long sharedCounts[RANGE_KEY_BITS + 1] = {0};
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        keys[i] = rangeKey(sorted[i]);
+    }
+    #pragma omp parallel for reduction(+:sharedCounts[:RANGE_KEY_BITS + 1]) schedule(static)
+    for (int i = 1; i < numWords; i++) {
+        unsigned long long difference = keys[i] ^ keys[i - 1];
+        sharedCounts[difference == 0 ? RANGE_KEY_BITS : __builtin_clzll(difference)]++;
+    }
+    // Distinct prefixes at level l: the first key plus every key sharing fewer than l bits
+    long distinct = numWords > 0;
+    for (int level = 1; level <= RANGE_KEY_BITS; level++) {
+        distinct += sharedCounts[level - 1];
+        filter->levelM[level] = calculateArraySizeForFP(distinct > 0 ? distinct : 1, RANGE_LEVEL_FP);
+        filter->levelM[level] = filter->levelM[level] > 64 ? filter->levelM[level] : 64;
+        filter->levels[level] = (unsigned long long *)calloc((filter->levelM[level] + 63) / 64, sizeof(unsigned long long));
+        if (filter->levels[level] == NULL) {
+            freeRangeFilter(filter);
+            free(keys);
+            return -1;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        unsigned long long difference = i > 0 ? keys[i] ^ keys[i - 1] : ~0ULL;
+        int shared = difference == 0 ? RANGE_KEY_BITS : __builtin_clzll(difference);
+        for (int level = shared + 1; level <= RANGE_KEY_BITS; level++) {
+            unsigned long long prefix = level == RANGE_KEY_BITS ? keys[i] : keys[i] >> (RANGE_KEY_BITS - level);
+            for (int h = 0; h < filter->numHashes; h++) {
+                unsigned int index = rangeIndex(filter, level, prefix, h);
+                __atomic_fetch_or(&filter->levels[level][index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    free(keys);
+    return 0;
+}
+
+/**
+ * Tests the dyadic interval of an l-bit prefix, doubting every positive answer by
+ * descending into both halves down to full keys.
+ */
+int probeRangePrefix(const RangeFilter *filter, int level, unsigned long long prefix) {
+    if (level > 0 && !testRangeLevel(filter, level, prefix)) {
+        return 0;
+    }
+    if (level == RANGE_KEY_BITS) {
+        return 1;
+    }
+    return probeRangePrefix(filter, level + 1, prefix << 1) || probeRangePrefix(filter, level + 1, prefix << 1 | 1);
+}
+
+/**
+ * Tests whether any inserted word may fall in [low, high] by splitting the key range into
+ * maximal aligned dyadic intervals and probing each.
+ *
+ * @return 1 if a word may be in the range, 0 if none is.
+ */
+int rangeMayContain(const RangeFilter *filter, const char *low, const char *high) {
+    unsigned long long lo = rangeKey(low), hi = rangeKey(high);
+    if (filter->empty || lo > hi) {
+        return 0;
+    }
+    while (1) {
+        // Largest aligned block starting at lo that stays within hi
+        int size = lo == 0 ? RANGE_KEY_BITS : __builtin_ctzll(lo);
+        while (size > 0 && (size == RANGE_KEY_BITS ? hi != ~0ULL : hi - lo < (1ULL << size) - 1)) {
+            size--;
+        }
+        if (probeRangePrefix(filter, RANGE_KEY_BITS - size, size == RANGE_KEY_BITS ? 0 : lo >> size)) {
+            return 1;
+        }
+        if (size == RANGE_KEY_BITS) {
+            return 0;
+        }
+        unsigned long long last = lo + ((1ULL << size) - 1);
+        if (last >= hi) {
+            return 0;
+        }
+        lo = last + 1;
+    }
+}
+
+/**
+ * Returns the index of the first sorted word not less than 'word'.
+ */
+int lowerBoundWord(char **sorted, int numWords, const char *word) {
+    int low = 0, high = numWords;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strcmp(sorted[mid], word) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Builds a prefix filter and a range filter from the words and benchmarks their batch
+ * queries against binary search over the sorted words, which also provides the exact
+ * answers. Prefix queries are the query words cut to the configured lengths in turn;
+ * range queries run from a query word to the same word with its last character raised,
+ * or its eighth if longer. The range filter only resolves the first eight bytes, so its
+ * false positives are also reported for the ranges that are empty at that resolution.
+ *
+ * @param words       The words (sorted in place).
+ * @param numWords    The number of words.
+ * @param queries     The query words.
+ * @param querySize   The number of queries.
+ * @param lengths     The prefix lengths, ascending.
+ * @param numLengths  The number of prefix lengths.
+ * @return 0 on success, -1 on failure.
+ */
+int benchmarkPrefixAndRange(char **words, int numWords, char **queries, int querySize, const int *lengths, int numLengths) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (sortWordsParallel(words, numWords) != 0) {
+        printf("Memory allocation failed for sorting.\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Sorting time (s): %lf \n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+
+    PrefixFilter prefixFilter;
+    RangeFilter rangeFilter;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = buildPrefixFilter(words, numWords, lengths, numLengths, &prefixFilter) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double prefixBuild = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    failed = failed || buildRangeFilter(words, numWords, &rangeFilter) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double rangeBuild = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    // Query bounds: prefixes of the configured lengths, and [word, word with its last (at most eighth) character raised]
+    char (*bounds)[3][MAX_WORD_LENGTH + 1] = malloc(((size_t)querySize + 1) * sizeof(*bounds));
+    unsigned char *exact = (unsigned char *)malloc((size_t)querySize + 1);
+    unsigned char *resolved = (unsigned char *)malloc((size_t)querySize + 1);
+    unsigned long long *keys = (unsigned long long *)malloc(((size_t)numWords + 1) * sizeof(unsigned long long));
+    if (failed || bounds == NULL || exact == NULL || resolved == NULL || keys == NULL) {
+        printf("Memory allocation failed for the prefix and range filters.\n");
+        free(prefixFilter.bits);
+        freeRangeFilter(&rangeFilter);
+        free(bounds);
+        free(exact);
+        free(resolved);
+        free(keys);
+        return -1;
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        keys[i] = rangeKey(words[i]);
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < querySize; i++) {
+        int length = strlen(queries[i]);
+        int cut = lengths[i % numLengths] < length ? lengths[i % numLengths] : length;
+        memcpy(bounds[i][0], queries[i], cut);
+        bounds[i][0][cut] = '\0';
+        memcpy(bounds[i][1], queries[i], length + 1);
+        memcpy(bounds[i][2], queries[i], length + 1);
+        int raised = (length < 8 ? length : 8) - 1;
+        if (raised >= 0 && (unsigned char)bounds[i][2][raised] < 255) {
+            bounds[i][2][raised]++;
+        }
+
+        // Whether some word's key lies within the range's keys, the best the range filter can resolve
+        unsigned long long low = rangeKey(bounds[i][1]), high = rangeKey(bounds[i][2]);
+        int first = 0, last = numWords;
+        while (first < last) {
+            int mid = first + (last - first) / 2;
+            if (keys[mid] < low) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        resolved[i] = first < numWords && keys[first] <= high;
+    }
+
+    size_t rangeBytes = 0;
+    for (int level = 1; level <= RANGE_KEY_BITS; level++) {
+        rangeBytes += (rangeFilter.levelM[level] + 63) / 64 * sizeof(unsigned long long);
+    }
+    printf("Prefix filter: lengths");
+    for (int l = 0; l < numLengths; l++) {
+        printf(" %d", lengths[l]);
+    }
+    printf(", %zu bytes, built in %lf s\n", (prefixFilter.m + 63) / 64 * sizeof(unsigned long long), prefixBuild);
+    printf("Range filter: %d levels, %zu bytes, built in %lf s\n", RANGE_KEY_BITS, rangeBytes, rangeBuild);
+    printf("Query  | sorted search (Mq/s) | filter (Mq/s) | non-empty | filter FP\n");
+
+    long falseNegatives[2] = {0, 0}, keyEmpty = 0, keyFalsePositives = 0;
+    for (int kind = 0; kind < 2; kind++) {
+        double times[2];
+        long falsePositives = 0, empty = 0, missed = 0, resolvedEmpty = 0, resolvedFalsePositives = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (pass == 0) {
+                // Exact answers from the sorted words
+                #pragma omp parallel for schedule(static)
+                for (int i = 0; i < querySize; i++) {
+                    int first = lowerBoundWord(words, numWords, bounds[i][kind]);
+                    exact[i] = first < numWords && (kind == 0 ? strncmp(words[first], bounds[i][0], strlen(bounds[i][0])) == 0
+                                                              : strcmp(words[first], bounds[i][2]) <= 0);
+                }
+
+            } else {
+                #pragma omp parallel for reduction(+:falsePositives, empty, missed, resolvedEmpty, resolvedFalsePositives) schedule(static)
+                for (int i = 0; i < querySize; i++) {
+                    int found = kind == 0 ? prefixMayExist(&prefixFilter, bounds[i][0])
+                                          : rangeMayContain(&rangeFilter, bounds[i][1], bounds[i][2]);
+                    missed += exact[i] && !found;
+                    empty += !exact[i];
+                    falsePositives += !exact[i] && found;
+                    resolvedEmpty += kind == 1 && !resolved[i];
+                    resolvedFalsePositives += kind == 1 && !resolved[i] && found;
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            times[pass] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        }
+        printf("%-6s | %20.2f | %13.2f | %8.2f%% | %8.4f%%\n", kind == 0 ? "prefix" : "range",
+               querySize / times[0] * 1e-6, querySize / times[1] * 1e-6, (double)(querySize - empty) / querySize * 100,
+               empty > 0 ? (double)falsePositives / empty * 100 : 0);
+        falseNegatives[kind] = missed;
+        if (kind == 1) {
+            keyEmpty = resolvedEmpty;
+            keyFalsePositives = resolvedFalsePositives;
+        }
+    }
+    printf("Range FP on the %.2f%% of ranges that are empty at 8-byte key resolution: %.4f%%\n",
+           querySize > 0 ? (double)keyEmpty / querySize * 100 : 0, keyEmpty > 0 ? (double)keyFalsePositives / keyEmpty * 100 : 0);
+    if (falseNegatives[0] > 0 || falseNegatives[1] > 0) {
+        printf("False negatives: %ld prefix, %ld range\n", falseNegatives[0], falseNegatives[1]);
+    }
+
+    free(prefixFilter.bits);
+    freeRangeFilter(&rangeFilter);
+    free(bounds);
+    free(exact);
+    free(resolved);
+    free(keys);
+    return falseNegatives[0] > 0 || falseNegatives[1] > 0 ? -1 : 0;
+}
+
+/**
+ * A filter for typo-tolerant lookups. Words are hashed with a polynomial hash,
+ * sum(word[i] * TYPO_BASE^(n-1-i)) mod 2^64, so the hash of any single-edit variant can
+ * be combined in O(1) from the prefix and suffix sums of the original word. Every word
+ * sets TYPO_PROBES bits inside one 512-bit block, so each candidate costs one cache line.
+ */
+typedef struct {
+    unsigned long long *blocks;     // FRONT_BLOCK_WORDS words per block.
+    unsigned int numBlocks;         // Number of blocks.
+    unsigned char alphabet[256];    // Bytes that occur in the words, for substitutions and insertions.
+    int alphabetSize;               // Number of bytes in the alphabet.
+    unsigned long long powers[MAX_WORD_LENGTH + 2]; // TYPO_BASE^i.
+} TypoFilter;
+
+/**
+ * An edit-distance-1 variant of a word: 'd' deletes the byte at position, 's' replaces it
+ * with character, and 'i' inserts character before it.
+ */
+typedef struct {
+    char operation;
+    unsigned char position;
+    unsigned char character;
+} TypoVariant;
+
+/**
+ * Finishes a polynomial word hash into the 64-bit fingerprint that addresses the filter;
+ * the length is mixed in so strings of different lengths do not share sums.
+ */
+unsigned long long typoFingerprint(unsigned long long sum, int length) {
+    unsigned long long hash = sum ^ (unsigned long long)length * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Returns the block of a fingerprint. The probes use its low 63 bits, so the block is
+ * taken from a remix rather than from the same bits.
+ */
+const unsigned long long *typoBlock(const TypoFilter *filter, unsigned long long fingerprint) {
+    unsigned long long remix = (fingerprint ^ (fingerprint >> 31)) * 0xbf58476d1ce4e5b9ULL;
+    return &filter->blocks[(size_t)(((remix >> 32) * filter->numBlocks) >> 32) * FRONT_BLOCK_WORDS];
+}
+
+/**
+ * Tests a fingerprint against its block.
+ */
+int testTypoBlock(const unsigned long long *block, unsigned long long fingerprint) {
+    for (int h = 0; h < TYPO_PROBES; h++) {
+        unsigned int bit = (fingerprint >> (9 * h)) & 511;
+        if (!((block[bit / 64] >> (bit % 64)) & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns the polynomial hash of the first 'length' bytes of a word.
+ */
+unsigned long long typoSum(const char *word, int length) {
+    unsigned long long sum = 0;
+    for (int i = 0; i < length; i++) {
+        sum = sum * TYPO_BASE + (unsigned char)word[i];
+    }
+    return sum;
+}
+
+void freeTypoFilter(TypoFilter *filter) {
+    free(filter->blocks);
+    free(filter);
+}
+
+/**
+ * Builds a typo filter with TYPO_BITS_PER_WORD bits per word.
+ *
+ * @param words     The words to insert.
+ * @param numWords  The number of words.
+ * @return The filter, or NULL on failure.
+ */
+TypoFilter *buildTypoFilter(char **words, int numWords) {
+    TypoFilter *filter = (TypoFilter *)calloc(1, sizeof(TypoFilter));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->numBlocks = ((long)numWords * TYPO_BITS_PER_WORD + 511) / 512;
+    filter->numBlocks = filter->numBlocks > 0 ? filter->numBlocks : 1;
+    filter->blocks = (unsigned long long *)calloc((size_t)filter->numBlocks * FRONT_BLOCK_WORDS, sizeof(unsigned long long));
+    if (filter->blocks == NULL) {
+        free(filter);
+        return NULL;
+    }
+    filter->powers[0] = 1;
+    for (int i = 1; i < MAX_WORD_LENGTH + 2; i++) {
+        filter->powers[i] = filter->powers[i - 1] * TYPO_BASE;
+    }
+
+    unsigned long long seen[4] = {0};
+    #pragma omp parallel for reduction(|:seen[:4]) schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        int length = strlen(words[i]);
+        for (int c = 0; c < length; c++) {
+            unsigned char byte = words[i][c];
+            seen[byte / 64] |= 1ULL << (byte % 64);
+        }
+        unsigned long long fingerprint = typoFingerprint(typoSum(words[i], length), length);
+        unsigned long long *block = (unsigned long long *)typoBlock(filter, fingerprint);
+        for (int h = 0; h < TYPO_PROBES; h++) {
+            unsigned int bit = (fingerprint >> (9 * h)) & 511;
+            __atomic_fetch_or(&block[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+        }
+    }
+    for (int byte = 1; byte < 256; byte++) {
+        if ((seen[byte / 64] >> (byte % 64)) & 1) {
+            filter->alphabet[filter->alphabetSize++] = byte;
+        }
+    }
+    return filter;
+}
+
+/**
+ * Returns the number of candidate slots of a word: every deletion, every substitution
+ * with an alphabet byte and every insertion of one.
+ */
+int typoCandidates(const TypoFilter *filter, int length) {
+    return length + length * filter->alphabetSize + (length + 1) * filter->alphabetSize;
+}
+
+/**
+ * Decodes candidate slot 'index' of a word into a variant. Edits that would repeat an
+ * earlier candidate (deleting or inserting next to an equal byte) or leave the word
+ * unchanged are skipped.
+ *
+ * @return 1 if the slot is a distinct variant, 0 if it should be skipped.
+ */
+int typoVariant(const TypoFilter *filter, const char *word, int length, int index, TypoVariant *variant) {
+    int size = filter->alphabetSize;
+    if (index < length) {
+        *variant = (TypoVariant){'d', index, 0};
+        return index == 0 || word[index] != word[index - 1];
+    }
+    index -= length;
+    if (index < length * size) {
+        *variant = (TypoVariant){'s', index / size, filter->alphabet[index % size]};
+        return (unsigned char)word[variant->position] != variant->character;
+    }
+    index -= length * size;
+    *variant = (TypoVariant){'i', index / size, filter->alphabet[index % size]};
+    return variant->position == 0 || (unsigned char)word[variant->position - 1] != variant->character;
+}
+
+/**
+ * Candidates of lookUpTypos() whose blocks are being prefetched.
+ */
+typedef struct {
+    const TypoFilter *filter;
+    TypoVariant *variants;          // Output variants.
+    int maxVariants;                // Capacity of 'variants'.
+    int found;                      // Variants that may exist so far.
+    int pending;                    // Candidates in the batch.
+    TypoVariant batch[TYPO_BATCH];
+    unsigned long long fingerprints[TYPO_BATCH];
+} TypoBatch;
+
+/**
+ * Checks every pending candidate of a batch and records those that may exist.
+ */
+void flushTypos(TypoBatch *batch) {
+    for (int b = 0; b < batch->pending; b++) {
+        if (testTypoBlock(typoBlock(batch->filter, batch->fingerprints[b]), batch->fingerprints[b])) {
+            if (batch->found < batch->maxVariants) {
+                batch->variants[batch->found] = batch->batch[b];
+            }
+            batch->found++;
+        }
+    }
+    batch->pending = 0;
+}
+
+/**
+ * Adds a candidate to a batch and prefetches its block, checking the batch once it is full.
+ */
+void pushTypo(TypoBatch *batch, TypoVariant variant, unsigned long long fingerprint) {
+    __builtin_prefetch(typoBlock(batch->filter, fingerprint));
+    batch->batch[batch->pending] = variant;
+    batch->fingerprints[batch->pending] = fingerprint;
+    if (++batch->pending == TYPO_BATCH) {
+        flushTypos(batch);
+    }
+}
+
+/**
+ * Finds the edit-distance-1 variants of a word that may be in a typo filter.
+ *
+ * The prefix and suffix sums of the word are computed once, so the fingerprint of each
+ * variant is a few multiply-adds. Fingerprints are computed TYPO_BATCH candidates ahead
+ * of the checks and their blocks prefetched, so the cache misses of a batch overlap.
+ * Variants are reported in the order of typoVariant()'s slots.
+ *
+ * @param filter       The typo filter.
+ * @param word         The word, at most MAX_WORD_LENGTH bytes.
+ * @param variants     Receives the variants that may exist.
+ * @param maxVariants  The capacity of 'variants'.
+ * @return The number of variants that may exist, which may exceed maxVariants.
+ */
+int lookUpTypos(const TypoFilter *filter, const char *word, TypoVariant *variants, int maxVariants) {
+    int length = strlen(word);
+    // prefix[i] hashes word[0, i); suffix[i] is word[i, n) weighted as the tail of the whole word
+    unsigned long long prefix[MAX_WORD_LENGTH + 1], suffix[MAX_WORD_LENGTH + 2];
+    prefix[0] = 0;
+    for (int i = 0; i < length; i++) {
+        prefix[i + 1] = prefix[i] * TYPO_BASE + (unsigned char)word[i];
+    }
+    suffix[length] = 0;
+    for (int i = length - 1; i >= 0; i--) {
+        suffix[i] = suffix[i + 1] + (unsigned char)word[i] * filter->powers[length - 1 - i];
+    }
+
+    TypoBatch batch = {.filter = filter, .variants = variants, .maxVariants = maxVariants};
+    const unsigned long long *powers = filter->powers;
+    for (int i = 0; i < length; i++) {
+        if (i == 0 || word[i] != word[i - 1]) {
+            pushTypo(&batch, (TypoVariant){'d', i, 0}, typoFingerprint(prefix[i] * powers[length - 1 - i] + suffix[i + 1], length - 1));
+        }
+    }
+    for (int i = 0; i < length; i++) {
+        unsigned long long base = prefix[i] * powers[length - i] + suffix[i + 1];
+        for (int a = 0; a < filter->alphabetSize; a++) {
+            unsigned char c = filter->alphabet[a];
+            if (c != (unsigned char)word[i]) {
+                pushTypo(&batch, (TypoVariant){'s', i, c}, typoFingerprint(base + c * powers[length - 1 - i], length));
+            }
+        }
+    }
+    for (int i = 0; i <= length; i++) {
+        unsigned long long base = prefix[i] * powers[length + 1 - i] + suffix[i];
+        for (int a = 0; a < filter->alphabetSize; a++) {
+            unsigned char c = filter->alphabet[a];
+            if (i == 0 || c != (unsigned char)word[i - 1]) {
+                pushTypo(&batch, (TypoVariant){'i', i, c}, typoFingerprint(base + c * powers[length - i], length + 1));
+            }
+        }
+    }
+    flushTypos(&batch);
+    return batch.found;
+}
+
+/**
+ * Reference for lookUpTypos(): spells out every variant and hashes it from scratch.
+ */
+int lookUpTyposNaive(const TypoFilter *filter, const char *word, TypoVariant *variants, int maxVariants) {
+    int length = strlen(word);
+    char candidate[MAX_WORD_LENGTH + 2];
+    int found = 0;
+    int numCandidates = typoCandidates(filter, length);
+    for (int index = 0; index < numCandidates; index++) {
+        TypoVariant variant;
+        if (!typoVariant(filter, word, length, index, &variant)) {
+            continue;
+        }
+        int i = variant.position, candidateLength = length;
+        memcpy(candidate, word, length);
+        if (variant.operation == 'd') {
+            memmove(candidate + i, word + i + 1, length - i - 1);
+            candidateLength--;
+        } else if (variant.operation == 's') {
+            candidate[i] = variant.character;
+        } else {
+            memmove(candidate + i + 1, word + i, length - i);
+            candidate[i] = variant.character;
+            candidateLength++;
+        }
+        unsigned long long fingerprint = typoFingerprint(typoSum(candidate, candidateLength), candidateLength);
+        if (testTypoBlock(typoBlock(filter, fingerprint), fingerprint)) {
+            if (found < maxVariants) {
+                variants[found] = variant;
+            }
+            found++;
+        }
+    }
+    return found;
+}
+
+/**
+ * Builds a typo filter from the words and times the batched typo lookup of the first
+ * TYPO_BENCH_QUERIES query words against the naive loop, checking that both report the
+ * same variants.
+ *
+ * @param words      The words to insert.
+ * @param numWords   The number of words.
+ * @param queries    The query words.
+ * @param querySize  The number of queries.
+ * @return 0 on success, -1 on failure or if the two lookups disagree.
+ */
+int benchmarkTypos(char **words, int numWords, char **queries, int querySize) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TypoFilter *filter = buildTypoFilter(words, numWords);
+    if (filter == NULL) {
+        printf("Memory allocation failed for the typo filter.\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Typo filter: %zu bytes, alphabet of %d bytes, built in %lf s\n",
+           (size_t)filter->numBlocks * FRONT_BLOCK_WORDS * sizeof(unsigned long long), filter->alphabetSize,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+
+    querySize = querySize < TYPO_BENCH_QUERIES ? querySize : TYPO_BENCH_QUERIES;
+    double times[2];
+    long candidates = 0, found[2] = {0, 0}, mismatches = 0;
+    for (int naive = 1; naive >= 0; naive--) {
+        long total = 0, totalCandidates = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        #pragma omp parallel for reduction(+:total, totalCandidates) schedule(static)
+        for (int i = 0; i < querySize; i++) {
+            TypoVariant variants[1];
+            total += naive ? lookUpTyposNaive(filter, queries[i], variants, 0) : lookUpTypos(filter, queries[i], variants, 0);
+            totalCandidates += typoCandidates(filter, strlen(queries[i]));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[naive] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        found[naive] = total;
+        candidates = totalCandidates;
+    }
+
+    // Both lookups must report the same variants in the same order
+    #pragma omp parallel for reduction(+:mismatches) schedule(static)
+    for (int i = 0; i < querySize; i++) {
+        TypoVariant batched[64], naive[64];
+        int numBatched = lookUpTypos(filter, queries[i], batched, 64);
+        int numNaive = lookUpTyposNaive(filter, queries[i], naive, 64);
+        int stored = numBatched < 64 ? numBatched : 64;
+        mismatches += numBatched != numNaive || memcmp(batched, naive, stored * sizeof(TypoVariant)) != 0;
+    }
+
+    printf("Candidates: %ld, %.2f per query, %.2f possible variants per query\n", candidates,
+           (double)candidates / querySize, (double)found[0] / querySize);
+    printf("Naive loop: %.2f M candidates/s\n", candidates / times[1] * 1e-6);
+    printf("Batched incremental: %.2f M candidates/s (%.2fx)\n", candidates / times[0] * 1e-6, times[1] / times[0]);
+    // Show the first query with any possible variants, as operation, position and byte
+    for (int i = 0; i < querySize; i++) {
+        TypoVariant variants[16];
+        int numVariants = lookUpTypos(filter, queries[i], variants, 16);
+        if (numVariants > 0) {
+            printf("Variants of %s:", queries[i]);
+            for (int v = 0; v < numVariants && v < 16; v++) {
+                printf(" %c%d%c", variants[v].operation, variants[v].position, variants[v].character ? variants[v].character : ' ');
+            }
+            printf("\n");
+            break;
+        }
+    }
+    freeTypoFilter(filter);
+    if (found[0] != found[1] || mismatches > 0) {
+        printf("Typo lookups disagree: %ld batched, %ld naive, %ld mismatched words\n", found[0], found[1], mismatches);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A static retrieval table (an XOR-based Bloomier filter) mapping words to small values
+ * without storing the words. The table has three segments of valueBits-bit slots; a word
+ * hashes to one slot in each, and its value is the XOR of the three. Any word gets some
+ * value, so a packed Bloom filter of the keys screens out words that are not in the set.
+ */
+typedef struct {
+    unsigned long long *slots;      // Packed slots, valueBits bits each.
+    unsigned int segmentLength;     // Slots per segment.
+    int valueBits;                  // Bits per value.
+    unsigned long long seed;        // Hash seed of the successful construction.
+    int numKeys;                    // Number of distinct keys.
+    unsigned long long *filter;     // Membership pre-check, packed bits.
+    unsigned int m;                 // Bits in the pre-check filter.
+    int numHashes;                  // Hash functions of the pre-check filter.
+} RetrievalTable;
+
+/**
+ * A key of a retrieval table under construction.
+ */
+typedef struct {
+    unsigned long long hash;
+    unsigned int value;
+    int index;                      // Line of the word, so repeated words keep the first value.
+} RetrievalKey;
+
+/**
+ * Returns the seeded 64-bit hash of a word.
+ */
+unsigned long long retrievalHash(const char *word, unsigned long long seed) {
+    unsigned long long hash = FNVHash64(word) ^ seed;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Returns the slot of a hash in segment 'segment', from a different 32 bits of the hash
+ * for each segment.
+ */
+unsigned int retrievalSlot(unsigned long long hash, int segment, unsigned int segmentLength) {
+    unsigned long long rotated = segment == 0 ? hash : (hash << (21 * segment)) | (hash >> (64 - 21 * segment));
+    return segment * segmentLength + (unsigned int)(((rotated & 0xffffffffULL) * segmentLength) >> 32);
+}
+
+/**
+ * Reads the value in a packed slot.
+ */
+unsigned int readRetrievalSlot(const RetrievalTable *table, unsigned int slot) {
+    unsigned long long offset = (unsigned long long)slot * table->valueBits;
+    unsigned long long bits = __atomic_load_n(&table->slots[offset / 64], __ATOMIC_RELAXED) >> (offset % 64);
+    if (offset % 64 + table->valueBits > 64) {
+        bits |= __atomic_load_n(&table->slots[offset / 64 + 1], __ATOMIC_RELAXED) << (64 - offset % 64);
+    }
+    return bits & ((1ULL << table->valueBits) - 1);
+}
+
+/**
+ * Looks up the value of a word.
+ *
+ * @param table  The retrieval table.
+ * @param word   The word.
+ * @param value  Receives the value if the word passes the pre-check.
+ * @return 1 if the word may be a key, 0 if the pre-check rules it out.
+ */
+int retrieveValue(const RetrievalTable *table, char *word, unsigned int *value) {
+    for (int h = 0; h < table->numHashes; h++) {
+        unsigned int index = APHashRawWithSalt(word, h) % table->m;
+        if (!((table->filter[index / 64] >> (index % 64)) & 1)) {
+            return 0;
+        }
+    }
+    unsigned long long hash = retrievalHash(word, table->seed);
+    *value = readRetrievalSlot(table, retrievalSlot(hash, 0, table->segmentLength))
+           ^ readRetrievalSlot(table, retrievalSlot(hash, 1, table->segmentLength))
+           ^ readRetrievalSlot(table, retrievalSlot(hash, 2, table->segmentLength));
+    return 1;
+}
+
+/**
+ * Orders retrieval keys by hash, then by line.
+ */
+int compareRetrievalKeys(const void *a, const void *b) {
+    const RetrievalKey *x = (const RetrievalKey *)a, *y = (const RetrievalKey *)b;
+    if (x->hash != y->hash) {
+        return (x->hash > y->hash) - (x->hash < y->hash);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Peels the keys of a retrieval table and assigns its slots for one seed.
+ *
+ * Each slot counts the keys that hash to it and XORs their indices. A slot with one key
+ * determines that key's value last, so the key is pushed and removed from its other two
+ * slots. Slots are scanned one segment at a time on all threads: a key has exactly one
+ * slot per segment, so no key is peeled twice in a pass and a pass only changes the
+ * other segments. The keys of a pass write distinct slots of one segment, so the passes
+ * are assigned in reverse order with each pass in parallel.
+ *
+ * @param table  The table, with segmentLength, valueBits and seed set and slots zeroed.
+ * @param keys   The keys, with hashes for table->seed.
+ * @param n      The number of keys.
+ * @return 0 on success, 1 if the keys could not all be peeled, -1 if memory ran out.
+ */
+int assignRetrievalSlots(RetrievalTable *table, const RetrievalKey *keys, int n) {
+    unsigned int numSlots = 3 * table->segmentLength;
+    unsigned int *counts = (unsigned int *)calloc(numSlots, sizeof(unsigned int));
+    unsigned int *keyXor = (unsigned int *)calloc(numSlots, sizeof(unsigned int));
+    unsigned int *stackKeys = (unsigned int *)malloc(((size_t)n + 1) * sizeof(unsigned int));
+    unsigned int *stackSlots = (unsigned int *)malloc(((size_t)n + 1) * sizeof(unsigned int));
+    int passCapacity = 64, numPasses = 0;
+    int *passEnds = (int *)malloc(passCapacity * sizeof(int));
+    if (counts == NULL || keyXor == NULL || stackKeys == NULL || stackSlots == NULL || passEnds == NULL) {
+        free(counts);
+        free(keyXor);
+        free(stackKeys);
+        free(stackSlots);
+        free(passEnds);
+        return -1;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        for (int segment = 0; segment < 3; segment++) {
+            unsigned int slot = retrievalSlot(keys[i].hash, segment, table->segmentLength);
+            __atomic_fetch_add(&counts[slot], 1, __ATOMIC_RELAXED);
+            __atomic_fetch_xor(&keyXor[slot], i, __ATOMIC_RELAXED);
+        }
+    }
+
+    int top = 0, result = 0, progress = 1;
+    while (progress && result == 0) {
+        progress = 0;
+        for (int segment = 0; segment < 3; segment++) {
+            int passStart = top;
+            unsigned int first = segment * table->segmentLength;
+            #pragma omp parallel for schedule(static)
+            for (unsigned int slot = first; slot < first + table->segmentLength; slot++) {
+                if (counts[slot] != 1) {
+                    continue;
+                }
+                unsigned int key = keyXor[slot];
+                counts[slot] = 0;
+                int position = __atomic_fetch_add(&top, 1, __ATOMIC_RELAXED);
+                stackKeys[position] = key;
+                stackSlots[position] = slot;
+                for (int other = 0; other < 3; other++) {
+                    if (other != segment) {
+                        unsigned int otherSlot = retrievalSlot(keys[key].hash, other, table->segmentLength);
+                        __atomic_fetch_sub(&counts[otherSlot], 1, __ATOMIC_RELAXED);
+                        __atomic_fetch_xor(&keyXor[otherSlot], key, __ATOMIC_RELAXED);
+                    }
+                }
+            }
+            if (top == passStart) {
+                continue;
+            }
+            progress = 1;
+            if (numPasses == passCapacity) {
+                passCapacity *= 2;
+                int *grown = (int *)realloc(passEnds, passCapacity * sizeof(int));
+                if (grown == NULL) {
+                    result = -1;
+                    break;
+                }
+                passEnds = grown;
+            }
+            passEnds[numPasses++] = top;
+        }
+    }
+    if (result == 0 && top < n) {
+        result = 1;
+    }
+
+    // A key's value goes in the slot it was peeled from, which no key assigned after it reads
+    for (int pass = numPasses - 1; pass >= 0 && result == 0; pass--) {
+        int passStart = pass > 0 ? passEnds[pass - 1] : 0;
+        #pragma omp parallel for schedule(static)
+        for (int s = passStart; s < passEnds[pass]; s++) {
+            const RetrievalKey *key = &keys[stackKeys[s]];
+            unsigned int value = key->value;
+            for (int segment = 0; segment < 3; segment++) {
+                unsigned int slot = retrievalSlot(key->hash, segment, table->segmentLength);
+                if (slot != stackSlots[s]) {
+                    value ^= readRetrievalSlot(table, slot);
+                }
+            }
+            unsigned long long offset = (unsigned long long)stackSlots[s] * table->valueBits;
+            __atomic_fetch_xor(&table->slots[offset / 64], (unsigned long long)value << (offset % 64), __ATOMIC_RELAXED);
+            if (offset % 64 + table->valueBits > 64) {
+                __atomic_fetch_xor(&table->slots[offset / 64 + 1], (unsigned long long)value >> (64 - offset % 64), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    free(counts);
+    free(keyXor);
+    free(stackKeys);
+    free(stackSlots);
+    free(passEnds);
+    return result;
+}
+void freeRetrievalTable(RetrievalTable *table) {
+    free(table->slots);
+    free(table->filter);
+}
+
+/**
+ * Builds a retrieval table and its membership pre-check from words and their values.
+ *
+ * Repeated words keep their first value. Construction is retried with a new seed if
+ * peeling gets stuck, which happens with small probability at RETRIEVAL_OVERHEAD slots
+ * per key.
+ *
+ * @param words     The words.
+ * @param values    The value of each word, all non-negative.
+ * @param numWords  The number of words.
+ * @param table     The table to fill in.
+ * @return The number of attempts on success, or -1 on failure.
+ */
+int buildRetrievalTable(char **words, const int *values, int numWords, RetrievalTable *table) {
+    memset(table, 0, sizeof(RetrievalTable));
+    unsigned int maxValue = 0;
+    #pragma omp parallel for reduction(max:maxValue) schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        maxValue = (unsigned int)values[i] > maxValue ? (unsigned int)values[i] : maxValue;
+    }
+    table->valueBits = 1;
+    while (table->valueBits < 32 && (maxValue >> table->valueBits) != 0) {
+        table->valueBits++;
+    }
+
+    // Membership pre-check at MAX_FP
+    table->m = calculateOptimalArraySize(numWords > 0 ? numWords : 1);
+    table->numHashes = round((double)table->m / (numWords > 0 ? numWords : 1) * log(2));
+    table->numHashes = table->numHashes > 0 ? table->numHashes : 1;
+    table->filter = (unsigned long long *)calloc((table->m + 63) / 64, sizeof(unsigned long long));
+    RetrievalKey *keys = (RetrievalKey *)malloc(((size_t)numWords + 1) * sizeof(RetrievalKey));
+    if (table->filter == NULL || keys == NULL) {
+        free(keys);
+        freeRetrievalTable(table);
+        return -1;
+    }
+    insertWordsPacked(words, numWords, table->filter, table->m, table->numHashes);
+
+    for (int attempt = 1; attempt <= RETRIEVAL_MAX_ATTEMPTS; attempt++) {
+        table->seed = 0x9e3779b97f4a7c15ULL * attempt;
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < numWords; i++) {
+            keys[i].hash = retrievalHash(words[i], table->seed);
+            keys[i].value = values[i];
+            keys[i].index = i;
+        }
+        // Repeated words would never peel, so only the first of each is kept
+        qsort(keys, numWords, sizeof(RetrievalKey), compareRetrievalKeys);
+        int n = 0;
+        for (int i = 0; i < numWords; i++) {
+            if (n == 0 || keys[i].hash != keys[n - 1].hash) {
+                keys[n++] = keys[i];
+            }
+        }
+        table->numKeys = n;
+        table->segmentLength = (unsigned int)(n * RETRIEVAL_OVERHEAD / 3) + RETRIEVAL_EXTRA_SLOTS;
+        size_t numSlotWords = ((size_t)3 * table->segmentLength * table->valueBits + 63) / 64 + 1;
+        free(table->slots);
+        table->slots = (unsigned long long *)calloc(numSlotWords, sizeof(unsigned long long));
+        int result = table->slots != NULL ? assignRetrievalSlots(table, keys, n) : -1;
+        if (result <= 0) {
+            free(keys);
+            if (result < 0) {
+                freeRetrievalTable(table);
+                return -1;
+            }
+            return attempt;
+        }
+    }
+    free(keys);
+    freeRetrievalTable(table);
+    return -1;
+}
+
+/**
+ * Builds a retrieval table from a file of "word value" lines, checks that every key
+ * retrieves its value, and times value lookups of the query file, reporting the bits
+ * per key of the table and of the pre-check.
+ *
+ * @param valuesFilename  The words with their values.
+ * @param queryFilename   The query file, with a word and its expected bit on each line.
+ * @return 0 on success, -1 on failure.
+ */
+int runRetrieval(const char *valuesFilename, const char *queryFilename) {
+    char **words = NULL, **queries = NULL;
+    int *values = NULL, *bits = NULL;
+    int numWords = 0, querySize = 0;
+    readQuery(valuesFilename, &words, &values, &numWords);
+    readQuery(queryFilename, &queries, &bits, &querySize);
+    if (words == NULL || queries == NULL) {
+        freeWordsAndQueries(NULL, 0, words, values, numWords);
+        freeWordsAndQueries(NULL, 0, queries, bits, querySize);
+        return -1;
+    }
+    for (int i = 0; i < numWords; i++) {
+        if (values[i] < 0) {
+            printf("Negative value for %s\n", words[i]);
+            freeWordsAndQueries(NULL, 0, words, values, numWords);
+            freeWordsAndQueries(NULL, 0, queries, bits, querySize);
+            return -1;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    RetrievalTable table;
+    int attempts = buildRetrievalTable(words, values, numWords, &table);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (attempts < 0) {
+        printf("Building the retrieval table failed.\n");
+        freeWordsAndQueries(NULL, 0, words, values, numWords);
+        freeWordsAndQueries(NULL, 0, queries, bits, querySize);
+        return -1;
+    }
+    double tableBits = 3.0 * table.segmentLength * table.valueBits;
+    printf("Retrieval table: %d keys, %d value bits, %u slots, built in %lf s (%d attempt%s)\n", table.numKeys, table.valueBits,
+           3 * table.segmentLength, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9, attempts, attempts == 1 ? "" : "s");
+    printf("Bits per key: %.2f for values, %.2f for the pre-check, %.2f in total\n", tableBits / table.numKeys,
+           (double)table.m / table.numKeys, (tableBits + table.m) / table.numKeys);
+
+    // Every key must get back its value; a repeated word keeps its first value, so each repeat may differ
+    long wrong = 0;
+    #pragma omp parallel for reduction(+:wrong) schedule(static)
+    for (int i = 0; i < numWords; i++) {
+        unsigned int value;
+        wrong += !retrieveValue(&table, words[i], &value) || value != (unsigned int)values[i];
+    }
+    int repeats = numWords - table.numKeys;
+    printf("Key values: %ld of %d differ (%d repeated words)\n", wrong, numWords, repeats);
+
+    long passed = 0, negatives = 0, falsePositives = 0;
+    unsigned long long checksum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    #pragma omp parallel for reduction(+:passed, negatives, falsePositives, checksum) schedule(static)
+    for (int i = 0; i < querySize; i++) {
+        unsigned int value;
+        int found = retrieveValue(&table, queries[i], &value);
+        passed += found;
+        checksum += found ? value : 0;
+        negatives += bits[i] == 0;
+        falsePositives += bits[i] == 0 && found;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("Queries: %d, %ld passed the pre-check, pre-check FP %.4f%%, %.2f M lookups/s (value sum %llu)\n", querySize, passed,
+           negatives > 0 ? (double)falsePositives / negatives * 100 : 0, querySize / seconds * 1e-6, checksum);
+
+    freeRetrievalTable(&table);
+    freeWordsAndQueries(NULL, 0, words, values, numWords);
+    freeWordsAndQueries(NULL, 0, queries, bits, querySize);
+    return wrong <= repeats ? 0 : -1;
+}
+
+/**
+ * A cell of an invertible Bloom lookup table. Keys are stored as NUL-padded bytes, so a
+ * cell left with a single key holds that key's exact bytes.
+ */
+typedef struct {
+    long count;                                 // Keys added minus keys removed.
+    unsigned long long hashSum;                 // XOR of the keys' FNVHash64, to recognise pure cells.
+    unsigned long long keySum[IBLT_KEY_WORDS];  // XOR of the padded keys.
+} IbltCell;
+
+/**
+ * Returns the cell of a key hash in segment 'segment' of a table of 3 * segmentLength cells.
+ */
+unsigned int ibltCell(unsigned long long hash, int segment, unsigned int segmentLength) {
+    unsigned long long mixed = (hash ^ 0x9e3779b97f4a7c15ULL) * 0xbf58476d1ce4e5b9ULL;
+    return retrievalSlot(mixed ^ (mixed >> 31), segment, segmentLength);
+}
+
+/**
+ * Adds (sign 1) or removes (sign -1) a padded key in its three cells.
+ */
+void ibltUpdate(IbltCell *cells, unsigned int segmentLength, const unsigned long long *key, unsigned long long hash, int sign) {
+    for (int segment = 0; segment < 3; segment++) {
+        IbltCell *cell = &cells[ibltCell(hash, segment, segmentLength)];
+        cell->count += sign;
+        cell->hashSum ^= hash;
+        for (int w = 0; w < IBLT_KEY_WORDS; w++) {
+            cell->keySum[w] ^= key[w];
+        }
+    }
+}
+
+/**
+ * Builds an invertible Bloom lookup table of a word list. Every thread fills a private
+ * table, and the tables are summed cell by cell on all threads.
+ *
+ * @param words          The words.
+ * @param numWords       The number of words.
+ * @param segmentLength  Cells per segment.
+ * @return The 3 * segmentLength cells, or NULL if memory ran out or a word is too long to store.
+ */
+IbltCell *buildIblt(char **words, int numWords, unsigned int segmentLength) {
+    unsigned int numCells = 3 * segmentLength;
+    int numThreads = omp_get_max_threads();
+    IbltCell *tables = (IbltCell *)calloc((size_t)numThreads * numCells, sizeof(IbltCell));
+    if (tables == NULL) {
+        return NULL;
+    }
+    long tooLong = 0;
+    #pragma omp parallel reduction(+:tooLong)
+    {
+        IbltCell *table = &tables[(size_t)omp_get_thread_num() * numCells];
+        #pragma omp for schedule(static)
+        for (int i = 0; i < numWords; i++) {
+            size_t length = strlen(words[i]);
+            if (length >= IBLT_KEY_WORDS * sizeof(unsigned long long)) {
+                tooLong++;
+                continue;
+            }
+            unsigned long long key[IBLT_KEY_WORDS] = {0};
+            memcpy(key, words[i], length);
+            ibltUpdate(table, segmentLength, key, FNVHash64(words[i]), 1);
+        }
+    }
+    if (tooLong > 0) {
+        printf("%ld words are longer than %zu bytes.\n", tooLong, IBLT_KEY_WORDS * sizeof(unsigned long long) - 1);
+        free(tables);
+        return NULL;
+    }
+    #pragma omp parallel for schedule(static)
+    for (unsigned int c = 0; c < numCells; c++) {
+        for (int t = 1; t < numThreads; t++) {
+            const IbltCell *cell = &tables[(size_t)t * numCells + c];
+            tables[c].count += cell->count;
+            tables[c].hashSum ^= cell->hashSum;
+            for (int w = 0; w < IBLT_KEY_WORDS; w++) {
+                tables[c].keySum[w] ^= cell->keySum[w];
+            }
+        }
+    }
+    // Keep only the first table
+    IbltCell *cells = (IbltCell *)realloc(tables, numCells * sizeof(IbltCell));
+    return cells != NULL ? cells : tables;
+}
+
+/**
+ * Appends a copy of a decoded key to a growable list.
+ *
+ * @return 0 on success, -1 if memory ran out.
+ */
+int appendDecodedKey(char ***list, int *length, int *capacity, const char *key) {
+    if (*length == *capacity) {
+        int grownCapacity = *capacity > 0 ? 2 * *capacity : 64;
+        char **grown = (char **)realloc(*list, grownCapacity * sizeof(char *));
+        if (grown == NULL) {
+            return -1;
+        }
+        *list = grown;
+        *capacity = grownCapacity;
+    }
+    (*list)[*length] = strdup(key);
+    return (*list)[(*length)++] == NULL ? -1 : 0;
+}
+
+/**
+ * Peels the difference of two tables (first minus second) in place. A cell with count
+ * 1 or -1 whose hash sum matches the hash of its key holds exactly one key of the
+ * difference; removing that key from its cells may make others pure. The work is
+ * proportional to the number of cells, which is sized for the difference.
+ *
+ * @param cells          The difference table; it is emptied on success.
+ * @param segmentLength  Cells per segment.
+ * @param onlyFirst      Receives the keys only in the first set.
+ * @param numFirst       Receives their number.
+ * @param onlySecond     Receives the keys only in the second set.
+ * @param numSecond      Receives their number.
+ * @return 0 if the whole difference was listed, 1 if peeling got stuck, -1 if memory ran out.
+ */
+int peelIblt(IbltCell *cells, unsigned int segmentLength, char ***onlyFirst, int *numFirst, char ***onlySecond, int *numSecond) {
+    unsigned int numCells = 3 * segmentLength;
+    size_t stackCapacity = numCells, top = 0;
+    unsigned int *stack = (unsigned int *)malloc(stackCapacity * sizeof(unsigned int));
+    if (stack == NULL) {
+        return -1;
+    }
+    int capacities[2] = {0, 0};
+    for (unsigned int c = 0; c < numCells; c++) {
+        stack[top++] = c;
+    }
+    // Cells are pushed again whenever removing a key may have left them pure
+    while (top > 0) {
+        unsigned int c = stack[--top];
+        IbltCell *cell = &cells[c];
+        if (cell->count != 1 && cell->count != -1) {
+            continue;
+        }
+        const char *key = (const char *)cell->keySum;
+        if (key[IBLT_KEY_WORDS * sizeof(unsigned long long) - 1] != '\0' || FNVHash64(key) != cell->hashSum) {
+            continue;
+        }
+        unsigned long long padded[IBLT_KEY_WORDS];
+        memcpy(padded, cell->keySum, sizeof(padded));
+        int sign = cell->count;
+        if (appendDecodedKey(sign > 0 ? onlyFirst : onlySecond, sign > 0 ? numFirst : numSecond,
+                             &capacities[sign > 0 ? 0 : 1], (const char *)padded) != 0) {
+            free(stack);
+            return -1;
+        }
+        unsigned long long hash = cell->hashSum;
+        ibltUpdate(cells, segmentLength, padded, hash, -sign);
+        for (int segment = 0; segment < 3; segment++) {
+            unsigned int other = ibltCell(hash, segment, segmentLength);
+            if (other == c || (cells[other].count != 1 && cells[other].count != -1)) {
+                continue;
+            }
+            if (top == stackCapacity) {
+                unsigned int *grown = (unsigned int *)realloc(stack, 2 * stackCapacity * sizeof(unsigned int));
+                if (grown == NULL) {
+                    free(stack);
+                    return -1;
+                }
+                stack = grown;
+                stackCapacity *= 2;
+            }
+            stack[top++] = other;
+        }
+    }
+    free(stack);
+
+    int empty = 1;
+    for (unsigned int c = 0; c < numCells && empty; c++) {
+        empty = cells[c].count == 0 && cells[c].hashSum == 0;
+    }
+    return empty ? 0 : 1;
+}
+
+/**
+ * Sorts a word list read by readWordsFromFile() and frees repeated words, so it holds
+ * each word once.
+ *
+ * @param words     The words.
+ * @param numWords  The number of words.
+ * @return The number of distinct words, or -1 if sorting ran out of memory.
+ */
+int uniqueWords(char **words, int numWords) {
+    if (sortWordsParallel(words, numWords) != 0) {
+        return -1;
+    }
+    int numUnique = 0;
+    for (int i = 0; i < numWords; i++) {
+        if (numUnique > 0 && strcmp(words[i], words[numUnique - 1]) == 0) {
+            trackMemory(MEMORY_WORDS, -(long)(strlen(words[i]) + 1 + MALLOC_OVERHEAD + sizeof(char *)));
+            free(words[i]);
+        } else {
+            words[numUnique++] = words[i];
+        }
+    }
+    return numUnique;
+}
+
+/**
+ * Reads a raw query log and counts how often each key was queried, as a frequency
+ * profile for the weighted engine. The first word of every line is the key; the rest of
+ * the line, such as the query bit of a query file, is ignored. The buffers are tracked as
+ * query memory in the same way as readQuery(), so freeWordsAndQueries() frees them.
+ *
+ * @param fileName  The query log.
+ * @param keys      Receives the distinct keys in sorted order, or NULL on failure.
+ * @param counts    Receives the number of queries of each key.
+ * @param length    Receives the number of distinct keys.
+ */
+void readQueryLog(const char *fileName, char ***keys, int **counts, int *length) {
+    *keys = NULL;
+    *counts = NULL;
+    *length = 0;
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        perror("Error opening file");
+        return;
+    }
+
+    char word[MAX_WORD_LENGTH];
+    int numQueries = 0;
+    long capacity = estimateRecordCount(file, NULL) * SIZING_HEADROOM + 1;
+    char **queries = (char **)malloc(capacity * sizeof(char *));
+    long stringBytes = 0;
+    int failed = queries == NULL;
+    while (!failed && readWord(file, word)) {
+        fscanf(file, "%*[^\n]");
+        if (numQueries == capacity) {
+            capacity *= 2;
+            char **grown = (char **)realloc(queries, capacity * sizeof(char *));
+            if (grown == NULL) {
+                failed = 1;
+                break;
+            }
+            queries = grown;
+        }
+        queries[numQueries] = strdup(word);
+        if (queries[numQueries] == NULL) {
+            failed = 1;
+            break;
         }
-        ppWordListArray[i] = strdup(word);
+        stringBytes += strlen(word) + 1 + MALLOC_OVERHEAD;
+        numQueries++;
     }
-
-    // Close file
     fclose(file);
+    trackMemory(MEMORY_QUERIES, stringBytes);
+    int *keyCounts = failed ? NULL : (int *)malloc(((size_t)numQueries + 1) * sizeof(int));
+    if (keyCounts == NULL || sortWordsParallel(queries, numQueries) != 0) {
+        perror("Memory allocation failed");
+        for (int i = 0; i < numQueries; i++) {
+            free(queries[i]);
+        }
+        free(queries);
+        free(keyCounts);
+        trackMemory(MEMORY_QUERIES, -stringBytes);
+        return;
+    }
 
-    // Update the wordListLength pointer
-    *wordListLength = length; // Set the word list length
-
-    return ppWordListArray;
+    // Repeated keys are adjacent once sorted
+    int numKeys = 0;
+    for (int i = 0; i < numQueries; i++) {
+        if (numKeys > 0 && strcmp(queries[i], queries[numKeys - 1]) == 0) {
+            trackMemory(MEMORY_QUERIES, -(long)(strlen(queries[i]) + 1 + MALLOC_OVERHEAD));
+            free(queries[i]);
+            keyCounts[numKeys - 1]++;
+        } else {
+            queries[numKeys] = queries[i];
+            keyCounts[numKeys++] = 1;
+        }
+    }
+    trackMemory(MEMORY_QUERIES, numKeys * (sizeof(char *) + sizeof(int)));
+    *keys = queries;
+    *counts = keyCounts;
+    *length = numKeys;
 }
 
 /**
- * Inserts words into a Bloom filter represented by a bit array.
- *
- * This function takes an array of words and inserts them into a Bloom filter
- * represented by a bit array. It uses multiple hash functions to set the bits
- * in the filter corresponding to the hashed values of each word.
+ * Lists the words only in one of two word files by exchanging invertible Bloom lookup
+ * tables instead of the files. The tables start sized for 'difference' keys and are
+ * doubled, as a reconciling peer would request, until the difference peels completely.
+ * Each file is treated as a set: repeated words are dropped before the tables are built.
  *
- * @param ppWordListArray  An array of strings containing words to insert.
- * @param numToInsert      The number of words to insert from the array.
- * @param bitArray         The bit array representing the Bloom filter.
- * @param m                The size of the bit array (modulo value for hashing).
+ * @param firstFilename   The first word file.
+ * @param secondFilename  The second word file.
+ * @param difference      The expected number of differing words, or 0 for the default.
+ * @return 0 on success, -1 on failure.
  */
-void insertWords(char **ppWordListArray, int numToInsert, int* bitArray, int m) {
-    // Passes Bernsteins' condition
-    #pragma omp parallel for collapse(2) schedule(static, 1)
-    for (int i = 0; i < numToInsert; i++) {
-        for (int h = 0; h < k; h++) {
-            // Calculate the hash using APHashWithSalt
-            unsigned int hash = APHashWithSalt(ppWordListArray[i], h, m);
-            
-            // Set the corresponding bit in the bit array to 1
-            bitArray[hash] = 1;
+int reconcileWordFiles(const char *firstFilename, const char *secondFilename, int difference) {
+    int numFirst = 0, numSecond = 0;
+    char **first = readWordsFromFile(firstFilename, &numFirst, NULL);
+    char **second = first != NULL ? readWordsFromFile(secondFilename, &numSecond, NULL) : NULL;
+    if (second == NULL) {
+        if (first != NULL) {
+            freeWordList(first, numFirst);
         }
+        return -1;
+    }
+    int numUniqueFirst = uniqueWords(first, numFirst);
+    int numUniqueSecond = numUniqueFirst >= 0 ? uniqueWords(second, numSecond) : -1;
+    if (numUniqueSecond < 0) {
+        printf("Memory allocation failed for sorting.\n");
+        freeWordList(first, numFirst);
+        freeWordList(second, numSecond);
+        return -1;
+    }
+    if (numUniqueFirst < numFirst || numUniqueSecond < numSecond) {
+        printf("Ignoring repeated words: %d in %s, %d in %s\n", numFirst - numUniqueFirst, firstFilename,
+               numSecond - numUniqueSecond, secondFilename);
+    }
+    numFirst = numUniqueFirst;
+    numSecond = numUniqueSecond;
+
+    struct timespec start, end;
+    char **onlyFirst = NULL, **onlySecond = NULL;
+    int numOnlyFirst = 0, numOnlySecond = 0, result = 1;
+    long expected = difference > 0 ? difference : IBLT_DEFAULT_DIFFERENCE;
+    for (int attempt = 1; attempt <= IBLT_MAX_ATTEMPTS && result == 1; attempt++, expected *= 2) {
+        unsigned int segmentLength = (unsigned int)ceil(expected * IBLT_OVERHEAD / 3) + IBLT_EXTRA_CELLS;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        IbltCell *firstCells = buildIblt(first, numFirst, segmentLength);
+        IbltCell *secondCells = firstCells != NULL ? buildIblt(second, numSecond, segmentLength) : NULL;
+        if (secondCells == NULL) {
+            free(firstCells);
+            result = -1;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double buildTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+        // Subtract the second table from the first and list what is left
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned int c = 0; c < 3 * segmentLength; c++) {
+            firstCells[c].count -= secondCells[c].count;
+            firstCells[c].hashSum ^= secondCells[c].hashSum;
+            for (int w = 0; w < IBLT_KEY_WORDS; w++) {
+                firstCells[c].keySum[w] ^= secondCells[c].keySum[w];
+            }
+        }
+        numOnlyFirst = numOnlySecond = 0;
+        result = peelIblt(firstCells, segmentLength, &onlyFirst, &numOnlyFirst, &onlySecond, &numOnlySecond);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Attempt %d: %u cells (%zu bytes per table), built in %lf s, decoded in %lf s: %s\n", attempt, 3 * segmentLength,
+               3 * segmentLength * sizeof(IbltCell), buildTime, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9,
+               result == 0 ? "complete" : result == 1 ? "stuck, doubling" : "out of memory");
+        free(firstCells);
+        free(secondCells);
+        // A stuck or failed peel leaves a partial listing; only the arrays are reused
+        if (result != 0) {
+            for (int i = 0; i < numOnlyFirst; i++) {
+                free(onlyFirst[i]);
+            }
+            for (int i = 0; i < numOnlySecond; i++) {
+                free(onlySecond[i]);
+            }
+            numOnlyFirst = numOnlySecond = 0;
+        }
+    }
+
+    if (result == 0) {
+        qsort(onlyFirst, numOnlyFirst, sizeof(char *), compareWords);
+        qsort(onlySecond, numOnlySecond, sizeof(char *), compareWords);
+        for (int i = 0; i < numOnlyFirst; i++) {
+            printf("< %s\n", onlyFirst[i]);
+        }
+        for (int i = 0; i < numOnlySecond; i++) {
+            printf("> %s\n", onlySecond[i]);
+        }
+        printf("Only in %s: %d, only in %s: %d\n", firstFilename, numOnlyFirst, secondFilename, numOnlySecond);
+    } else {
+        printf("Reconciliation failed.\n");
+    }
+    for (int i = 0; i < numOnlyFirst; i++) {
+        free(onlyFirst[i]);
     }
+    for (int i = 0; i < numOnlySecond; i++) {
+        free(onlySecond[i]);
+    }
+    free(onlyFirst);
+    free(onlySecond);
+    freeWordList(first, numFirst);
+    freeWordList(second, numSecond);
+    return result == 0 ? 0 : -1;
 }
 
 /**
- * Calculates the optimal size of a Bloom filter bit array based on the expected number of elements.
- *
- * This function calculates the optimal size (number of bits) for a Bloom filter's
- * bit array based on the expected number of elements to be inserted and the desired
- * maximum false positive rate.
- *
- * @param n The expected number of elements to be inserted into the Bloom filter.
- * @return The optimal size of the bit array for the given parameters.
+ * Program options collected from the command line.
  */
-int calculateOptimalArraySize(int n) {
-    // Calculate the optimal size using the formula for Bloom filter size
-    int m = ceil((n * log(MAX_FP)) / log(1 / pow(2, log(2))));
-    return m;
-}
+typedef struct {
+    char *insertFilename;   // File with the words to insert.
+    char *testFilename;     // File with the query words and their expected bits.
+    int topK;               // Number of most frequent query keys to report (0 disables the sketch).
+    int sizeByDistinct;     // Size the filter by the estimated number of distinct words instead of the word count.
+    int stream;             // Build a scalable filter in one streaming pass instead of loading the files.
+    const FilterEngine *engine; // Filter engine to use, or NULL for the classic bit array.
+    int capacity;           // Size the filter for this many words (e.g. peak load) instead of the loaded count.
+    int bench;              // Run the engine's benchmark after testing.
+    char *batchFilename;    // Manifest of filters to build in batch mode, or NULL.
+    long memoryBudget;      // Peak memory the run should stay under in bytes, or 0 for no limit.
+    char *traceFilename;    // Chrome trace JSON output, or NULL.
+    int metricsPort;        // Local TCP port of the metrics endpoint, or 0.
+    char *metricsSocket;    // Unix socket of the metrics endpoint, or NULL.
+    int lingerSeconds;      // Seconds to keep serving metrics after the work is done.
+    int verify;             // Check every engine and thread count against the serial reference.
+    char *profileFilename;  // Query frequency profile of the weighted engine, or NULL.
+    char *queryLogFilename; // Raw query log counted into a profile for the weighted engine, or NULL.
+    char *exportSbbf;       // Write a Parquet split-block filter of the word file here, or NULL.
+    char *querySbbf;        // Map this split-block filter and test the query file against it, or NULL.
+    char *fingerprintFilename;      // Write a fingerprint sidecar of the word file here, or NULL.
+    char *queryFingerprintFilename; // Write a labelled fingerprint sidecar of the query file here, or NULL.
+    char *rebuildFilename;  // Rebuild a filter from fingerprint sidecars and write it here, or NULL.
+    double targetFp;        // False positive rate of the rebuilt filter, or the limit for folding (0 if not given).
+    int rebuildHashes;      // Hash functions of the rebuilt filter, or 0 for the optimum.
+    int pow2;               // Round serialized filter sizes up to a power of two so they can be folded.
+    char *foldFilename;     // Write the folded serialized filter here, or NULL.
+    int foldTimes;          // Number of halvings when no false positive limit is given.
+    int rangeBench;         // Benchmark the prefix and range filters against searching the sorted words.
+    int prefixLengths[MAX_PREFIX_LENGTHS]; // Prefix lengths of the prefix filter, ascending.
+    int numPrefixLengths;   // Number of prefix lengths, 0 for the default.
+    int typoBench;          // Benchmark batched typo-tolerant lookups of the queries against the naive loop.
+    int retrieve;           // Build a retrieval table from a "word value" file and look up the queries.
+    int reconcile;          // List the words only in one of the two files with invertible Bloom lookup tables.
+    int difference;         // Expected number of differing words for --reconcile, or 0 for the default.
+} Options;
 
 /**
- * Checks whether a word is possibly in the Bloom filter's set based on its hashes.
+ * Parses the command line into an Options structure.
  *
- * This function checks whether a given word is possibly in the Bloom filter's set
- * based on its hash values for multiple hash functions.
+ * Flags may appear anywhere; the two remaining arguments are the word and query files.
  *
- * @param word                   The word to check.
- * @param bitArray               The Bloom filter's bit array.
- * @param m                      The size of the Bloom filter's bit array.
- * @return isPossiblyInSet       Returns 1 if the word is possibly in the set, 0 otherwise.
+ * @param argc     The argument count.
+ * @param argv     The argument vector.
+ * @param options  The options to fill in.
+ * @return 0 on success, -1 if the arguments are invalid.
  */
-int lookUp(char* word, int* bitArray, int m) {
-    int isPossiblyInSet = 1;
-    // Iterate through the hash functions and check the corresponding bit
-    //#pragma omp parallel for reduction(&&:isPossiblyInSet)
-    for (int h = 0; h < k; h++) {
-        int index = APHashWithSalt(word, h, m); // Compute the hash index
-        isPossiblyInSet = (bitArray[index] && isPossiblyInSet); // Perform a logical AND operation
+int parseArguments(int argc, char *argv[], Options *options) {
+    int numPositional = 0;
+    memset(options, 0, sizeof(Options));
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc) {
+            options->topK = atoi(argv[++i]);
+            if (options->topK < 0 || options->topK > MAX_TOP_K) {
+                printf("--top-k must be between 0 and %d.\n", MAX_TOP_K);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--size-by-distinct") == 0) {
+            options->sizeByDistinct = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            options->stream = 1;
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            options->metricsPort = atoi(argv[++i]);
+            if (options->metricsPort <= 0 || options->metricsPort > 65535) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--metrics-socket") == 0 && i + 1 < argc) {
+            options->metricsSocket = argv[++i];
+        } else if (strcmp(argv[i], "--linger") == 0 && i + 1 < argc) {
+            options->lingerSeconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            options->traceFilename = argv[++i];
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            options->memoryBudget = parseByteSize(argv[++i]);
+            if (options->memoryBudget < 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            options->batchFilename = argv[++i];
+        } else if (strcmp(argv[i], "--frequency-profile") == 0 && i + 1 < argc) {
+            options->profileFilename = argv[++i];
+        } else if (strcmp(argv[i], "--query-log") == 0 && i + 1 < argc) {
+            options->queryLogFilename = argv[++i];
+        } else if (strcmp(argv[i], "--export-sbbf") == 0 && i + 1 < argc) {
+            options->exportSbbf = argv[++i];
+        } else if (strcmp(argv[i], "--query-sbbf") == 0 && i + 1 < argc) {
+            options->querySbbf = argv[++i];
+        } else if (strcmp(argv[i], "--fingerprint") == 0 && i + 1 < argc) {
+            options->fingerprintFilename = argv[++i];
+        } else if (strcmp(argv[i], "--fingerprint-queries") == 0 && i + 1 < argc) {
+            options->queryFingerprintFilename = argv[++i];
+        } else if (strcmp(argv[i], "--rebuild") == 0 && i + 1 < argc) {
+            options->rebuildFilename = argv[++i];
+        } else if (strcmp(argv[i], "--fp") == 0 && i + 1 < argc) {
+            options->targetFp = atof(argv[++i]);
+            if (options->targetFp <= 0 || options->targetFp >= 1) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--pow2") == 0) {
+            options->pow2 = 1;
+        } else if (strcmp(argv[i], "--fold") == 0 && i + 1 < argc) {
+            options->foldFilename = argv[++i];
+        } else if (strcmp(argv[i], "--fold-times") == 0 && i + 1 < argc) {
+            options->foldTimes = atoi(argv[++i]);
+            if (options->foldTimes <= 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--hashes") == 0 && i + 1 < argc) {
+            options->rebuildHashes = atoi(argv[++i]);
+            if (options->rebuildHashes <= 0 || options->rebuildHashes > MAX_K) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--reconcile") == 0) {
+            options->reconcile = 1;
+        } else if (strcmp(argv[i], "--difference") == 0 && i + 1 < argc) {
+            options->difference = atoi(argv[++i]);
+            if (options->difference <= 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--retrieve") == 0) {
+            options->retrieve = 1;
+        } else if (strcmp(argv[i], "--typo-bench") == 0) {
+            options->typoBench = 1;
+        } else if (strcmp(argv[i], "--range-bench") == 0) {
+            options->rangeBench = 1;
+        } else if (strcmp(argv[i], "--prefix-lengths") == 0 && i + 1 < argc) {
+            // Comma-separated, strictly ascending lengths
+            char *list = argv[++i];
+            while (*list) {
+                char *next;
+                long length = strtol(list, &next, 10);
+                if (next == list || length <= 0 || length > MAX_WORD_LENGTH || options->numPrefixLengths == MAX_PREFIX_LENGTHS ||
+                    (options->numPrefixLengths > 0 && length <= options->prefixLengths[options->numPrefixLengths - 1])) {
+                    return -1;
+                }
+                options->prefixLengths[options->numPrefixLengths++] = length;
+                list = *next == ',' ? next + 1 : next;
+                if (*next != ',' && *next != '\0') {
+                    return -1;
+                }
+            }
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            options->verify = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            options->bench = 1;
+        } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            options->capacity = atoi(argv[++i]);
+            if (options->capacity <= 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "classic") != 0) {
+                options->engine = findEngine(argv[i]);
+                if (options->engine == NULL) {
+                    printf("Unknown engine: %s\n", argv[i]);
+                    return -1;
+                }
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown option: %s\n", argv[i]);
+            return -1;
+        } else if (numPositional == 0) {
+            options->insertFilename = argv[i];
+            numPositional++;
+        } else if (numPositional == 1) {
+            options->testFilename = argv[i];
+            numPositional++;
+        } else {
+            return -1;
+        }
     }
-    return isPossiblyInSet;
+    // The budget only chooses between the in-memory and the streaming classic run, and
+    // streaming has none of the other modes and reports
+    if (options->memoryBudget > 0 &&
+        (options->batchFilename != NULL || options->engine != NULL || options->verify || options->reconcile ||
+         options->retrieve || options->rangeBench || options->typoBench || options->rebuildFilename != NULL ||
+         options->foldFilename != NULL || options->exportSbbf != NULL || options->querySbbf != NULL ||
+         options->fingerprintFilename != NULL || options->queryFingerprintFilename != NULL || options->topK > 0)) {
+        printf("--memory-budget only applies to the plain classic run.\n");
+        return -1;
+    }
+    // The weighted engine takes one source of query frequencies
+    if (options->profileFilename != NULL && options->queryLogFilename != NULL) {
+        return -1;
+    }
+    // Folding reads one serialized filter
+    if (options->foldFilename != NULL) {
+        return numPositional == 1 ? 0 : -1;
+    }
+    // Rebuilds read a key sidecar and optionally a labelled query sidecar
+    if (options->rebuildFilename != NULL) {
+        if (options->targetFp == 0) {
+            options->targetFp = MAX_FP;
+        }
+        return numPositional >= 1 ? 0 : -1;
+    }
+    // Batch mode takes its files from the manifest
+    if (options->batchFilename != NULL) {
+        return numPositional == 0 ? 0 : -1;
+    }
+    // Split-block filter modes take a single file: the words to export or the queries to test
+    if (options->exportSbbf != NULL || options->querySbbf != NULL) {
+        if (options->querySbbf != NULL) {
+            options->testFilename = options->insertFilename;
+        }
+        return numPositional == 1 && (options->exportSbbf == NULL || options->querySbbf == NULL) ? 0 : -1;
+    }
+    return numPositional == 2 ? 0 : -1;
 }
 
-
 /**
- * Reads query words and query bits from a file into memory.
+ * Builds and tests a filter with an engine selected by --engine.
  *
- * This function reads words and their corresponding query bits from a file and
- * stores them in dynamically allocated memory. Each word[i] will have its respective
- * bit stored in bits[i], indicating whether the word actually exists in the filter or 
- * not.
+ * Prints the same timings as the classic path, plus the memory held by the filter.
  *
- * @param fileName     The name of the file to read.
- * @param wordsBuffer  A pointer to the buffer where word strings will be stored.
- * @param bits         A pointer to the buffer where query bits will be stored for each respective word.
- * @param length       A pointer to an integer that will store the length of the created arrays.
+ * @param engine     The engine to use.
+ * @param words      The words to insert.
+ * @param numWords   The number of words.
+ * @param input      The labelled queries and the query profile.
+ * @param m          The number of bits the filter is sized for.
+ * @param bench      1 to run the engine's benchmark after testing.
+ * @return The program exit code.
  */
-void readQuery(const char *fileName, char ***wordsBuffer, int **bits, int *length) {
-    FILE *file = fopen(fileName, "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        return;
-    }
-
-    char word[MAX_WORD_LENGTH];
-    int queryBit;
-    int fileLength = 0;
+int runEngine(const FilterEngine *engine, char **words, int numWords, const EngineInput *input, int m, int bench) {
+    char **queries = input->queries;
+    int *bits = input->bits;
+    int querySize = input->numQueries;
+    struct timespec start, end;
+    double time_taken;
 
-    // Count the number of words in the file
-    while (fscanf(file, "%s %d", word, &queryBit) == 2) {
-        fileLength++; // Increment for each word
+    // Time insertion of words into the filter
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double spanStart = traceNow();
+    void *filter = engine->build(words, numWords, m, input);
+    traceSpan("insert", spanStart);
+    metricsRecordInserts(numWords);
+    if (filter == NULL) {
+        printf("Building the %s filter failed.\n", engine->name);
+        return 1;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken = (end.tv_sec - start.tv_sec) * 1e9;
+    time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
+    printf("Inserting time (s): %lf \n", time_taken);
+    size_t filterBytes = engine->memoryBytes(filter);
+    trackMemory(MEMORY_FILTER, filterBytes);
+    printf("Filter memory (bytes): %zu \n", filterBytes);
+    printMemoryReport("inserting");
 
-    // Reset the file pointer to the beginning of the file
-    fseek(file, 0, SEEK_SET);
+    // Measure filter testing time
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    spanStart = traceNow();
+    testEngineWithQueries(engine, filter, queries, bits, querySize);
+    traceSpan("test", spanStart);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken = (end.tv_sec - start.tv_sec) * 1e9;
+    time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
+    printf("Testing time (s): %lf \n", time_taken);
+    printMemoryReport("testing");
 
-    *wordsBuffer = (char **)malloc(fileLength * sizeof(char *));
-    *bits = (int *)malloc(fileLength * sizeof(int));
+    if (bench && engine->benchmark != NULL) {
+        engine->benchmark(filter, queries, bits, querySize);
+    }
+    engine->destroy(filter);
+    trackMemory(MEMORY_FILTER, -(long)filterBytes);
+    return 0;
+}
 
-    if (*wordsBuffer == NULL || *bits == NULL) {
-        perror("Memory allocation failed");
+/**
+ * Estimates the peak memory of loading both files and building the classic bit array.
+ *
+ * Record counts come from estimateRecordCount(), so the files are not read in full.
+ * Both files are loaded at the same time, and the word file buffer is still held while
+ * its strings are copied, so everything is counted together.
+ *
+ * @param insertFilename  The word file.
+ * @param testFilename    The query file.
+ * @return The estimated peak in bytes, or -1 if a file cannot be opened.
+ */
+long estimateInMemoryBytes(const char *insertFilename, const char *testFilename) {
+    const char *filenames[2] = {insertFilename, testFilename};
+    long records[2], sizes[2];
+    for (int f = 0; f < 2; f++) {
+        FILE *file = fopen(filenames[f], "r");
+        if (file == NULL) {
+            return -1;
+        }
+        records[f] = estimateRecordCount(file, &sizes[f]);
         fclose(file);
-        
-        // Free memory allocated for words and bits in case of an error
-        free(*wordsBuffer);
-        free(*bits);
-        *wordsBuffer = NULL;
-        *bits = NULL;
-        
-        return;
     }
+    long wordBytes = 2 * sizes[0] + records[0] * (sizeof(char *) + MALLOC_OVERHEAD);
+    long queryBytes = sizes[1] + records[1] * (sizeof(char *) + sizeof(int) + MALLOC_OVERHEAD);
+    long filterBytes = (long)calculateOptimalArraySize(records[0]) * sizeof(int);
+    return wordBytes + queryBytes + filterBytes;
+}
 
-    // Read words and query bits into the buffer
-    for (int i = 0; i < fileLength; i++) {
-        if (fscanf(file, "%s %d", word, &queryBit) != 2) {
-            perror("Error reading word and bit from file");
-            break;
-        }
-        (*wordsBuffer)[i] = strdup(word);
-        (*bits)[i] = queryBit;
+/**
+ * Estimates the peak memory of runStreaming(): the first filter stage and the batch buffers.
+ *
+ * @param insertFilename  The word file.
+ * @return The estimated peak in bytes, or -1 if the file cannot be opened.
+ */
+long estimateStreamingBytes(const char *insertFilename) {
+    FILE *file = fopen(insertFilename, "r");
+    if (file == NULL) {
+        return -1;
     }
-    // Close file and then update the length of the query Array
+    long records = estimateRecordCount(file, NULL) * SIZING_HEADROOM;
     fclose(file);
-    *length = fileLength;
+    long filterBits = ceil(-records * log(MAX_FP * STAGE0_FP_SHARE) / (log(2) * log(2)));
+    return filterBits / 8 + STREAM_BATCH * (2 * MAX_WORD_LENGTH + sizeof(char *) + sizeof(int));
 }
 
 /**
- * Test words against a Bloom filter and calculate false positive and false negative percentages.
+ * Runs the whole program in streaming mode.
  *
- * This function tests words against a Bloom filter represented by the bitArray. It calculates
- * the false positive and false negative percentages based on the expected query bits.
- * @param bitArray        The Bloom filter represented as an array of bits.
- * @param words           An array of query words to test.
- * @param bits            An array of expected query bits.
- * @param length          The number of words and bits to test.
- * @param m               The size of the Bloom filter bitArray.
+ * The word file is inserted into a scalable Bloom filter in one pass and the query
+ * file is tested in a second streaming pass, so neither file is counted or kept in memory.
+ *
+ * @param options    The program options.
+ * @param all_start  The time the program started, for the total time.
+ * @return The program exit code.
  */
-void testBloomWithQueries(int *bitArray, char **words, int *bits, int length, int m) {
-    // Declare variables for fp and fn
-    int fPositive = 0;          // Number of False Positives
-    int fNegative = 0;          // Number of False Negatives
-    int totalPositive = 0;      // Total number of positives available inside the words list, not the filter.
-    int totalNegative = 0;      // Total number of negatives available inside the words list, not the filter.
-
-    // For-loop to iterate through each word & corresponding bit to test the filter.
-    #pragma omp parallel for reduction(+:fPositive, fNegative, totalPositive, totalNegative) schedule(static, 1)
-    for (int i = 0; i < length; i++) {
-        // Get the word and corresponding bit from the arrays.
-        char *tempWord = words[i];
-        int expectedBit = bits[i];
-        // Get the lookup result from the bloom filter.
-        int lookupResult = lookUp(tempWord, bitArray, m);
+int runStreaming(const Options *options, const struct timespec *all_start) {
+    struct timespec start, end;
+    double time_taken;
+    ScalableBloomFilter filter = {0};
+    filter.fp = MAX_FP;
 
-        // Test whether the ressult is true or false and check for any false positives or false negatives
-        if (expectedBit == 1) {
-            totalPositive++;
-            if (lookupResult == 0) {
-                printf("Word is %s \n", tempWord);
-                fNegative++;
-            }
-        } else if (expectedBit == 0) {
-            totalNegative++;
-            if (lookupResult == 1) {
-                fPositive++;
-            }
+    // Time reading and insertion, which are a single pass here
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long estimate = 0;
+    long inserted = buildScalableFromFile(options->insertFilename, &filter, &estimate);
+    if (inserted < 0) {
+        freeScalableFilter(&filter);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken = (end.tv_sec - start.tv_sec) * 1e9;
+    time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
+    printf("Streaming insert time (s): %lf \n", time_taken);
+    printf("Estimated words: %ld, inserted: %ld, filter stages: %d\n", estimate, inserted, filter.numStages);
+    if (metricsEnabled) {
+        // A query passes the filter if it passes any stage
+        double passNone = 1;
+        long setBits = 0, totalBits = 0;
+        for (int i = 0; i < filter.numStages; i++) {
+            long stageSet = countSetWords(filter.stages[i].words, (filter.stages[i].m + 63) / 64);
+            passNone *= 1 - pow((double)stageSet / filter.stages[i].m, filter.stages[i].k);
+            setBits += stageSet;
+            totalBits += filter.stages[i].m;
         }
-
+        metricsPublishFill(setBits, totalBits, 1);
+        metricsEstimatedFP = 1 - passNone;
     }
-    // Print the test result
-    printf("False Negative Percentage: %lf%%\n", (double)fNegative / totalPositive * 100);
-    printf("False Positive Percentage: %lf%%\n", (double)fPositive / totalNegative * 100);
+    printMemoryReport("inserting");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    testScalableWithQueryFile(&filter, options->testFilename);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken = (end.tv_sec - start.tv_sec) * 1e9;
+    time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
+    printf("Testing time (s): %lf \n", time_taken);
+    printMemoryReport("testing");
+
+    freeScalableFilter(&filter);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken = (end.tv_sec - all_start->tv_sec) * 1e9;
+    time_taken = (time_taken + (end.tv_nsec - all_start->tv_nsec)) * 1e-9;
+    printf("Total time (s): %lf \n", time_taken);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -280,18 +6811,99 @@ int main(int argc, char *argv[]) {
     double all_time;
     clock_gettime(CLOCK_MONOTONIC, &all_start);
 
-    // Check number of program arguments
-    if (argc != 3) {
-        printf("Usage: %s <words.txt> <query.txt>\n", argv[0]);
+    // Check program arguments
+    Options options;
+    if (parseArguments(argc, argv, &options) != 0) {
+        printf("Usage: %s --batch <manifest.txt> [--pow2]\n", argv[0]);
+        printf("       %s --export-sbbf <filter.sbbf> <words.txt>\n", argv[0]);
+        printf("       %s --query-sbbf <filter.sbbf> <query.txt>\n", argv[0]);
+        printf("       %s --rebuild <filter.bf> [--fp RATE] [--hashes K] [--pow2] <words.fp> [query.fp]\n", argv[0]);
+        printf("       %s --fold <folded.bf> [--fold-times N | --fp RATE] <filter.bf>\n", argv[0]);
+        printf("       %s [--top-k N] [--size-by-distinct] [--stream] [--engine classic|sparse|tiered|pattern|learned|weighted] [--frequency-profile FILE | --query-log FILE] [--capacity N] [--bench] [--verify] [--memory-budget SIZE] [--trace FILE]\n"
+               "         [--metrics-port N | --metrics-socket PATH] [--linger SECONDS] [--fingerprint FILE] [--fingerprint-queries FILE]\n"
+               "         <words.txt> <query.txt>\n", argv[0]);
+        printf("       %s --range-bench [--prefix-lengths L1,L2,...] <words.txt> <query.txt>\n", argv[0]);
+        printf("       %s --typo-bench <words.txt> <query.txt>\n", argv[0]);
+        printf("       %s --retrieve <values.txt> <query.txt>\n", argv[0]);
+        printf("       %s --reconcile [--difference N] <words.txt> <other-words.txt>\n", argv[0]);
         return -1;
     }
 
+    // Record per-thread spans from the start of the program and write them on exit
+    if (options.traceFilename != NULL) {
+        tracingEnabled = 1;
+        traceOrigin = all_start;
+        traceFilename = options.traceFilename;
+        atexit(writeTraceAtExit);
+    }
+
+    // Serve live counters while the program runs, and for a while after if asked to
+    if (options.metricsPort > 0 || options.metricsSocket != NULL) {
+        if (startMetricsServer(options.metricsPort, options.metricsSocket) != 0) {
+            return -1;
+        }
+        if (options.lingerSeconds > 0) {
+            lingerSeconds = options.lingerSeconds;
+            atexit(lingerAtExit);
+        }
+    }
+
     // Get the file names from program arguments
-    char *insertFilename = argv[1]; 
-    char *testFilename = argv[2];   
+    char *insertFilename = options.insertFilename;
+    char *testFilename = options.testFilename;
     
     struct timespec start, end;
     double time_taken;
+
+    // Fall back to the streaming path when loading everything would not fit in the budget
+    if (options.memoryBudget > 0 && !options.stream) {
+        long inMemory = estimateInMemoryBytes(insertFilename, testFilename);
+        if (inMemory > options.memoryBudget) {
+            long streaming = estimateStreamingBytes(insertFilename);
+            printf("Estimated in-memory peak %ld bytes exceeds the budget of %ld bytes, using streaming (estimated %ld bytes).\n",
+                   inMemory, options.memoryBudget, streaming);
+            if (streaming > options.memoryBudget) {
+                printf("Warning: the streaming path is also expected to exceed the budget.\n");
+            }
+            options.stream = 1;
+        }
+    }
+
+    if (options.stream) {
+        return runStreaming(&options, &all_start);
+    }
+
+    if (options.exportSbbf != NULL || options.querySbbf != NULL) {
+        int result = options.exportSbbf != NULL ? exportSplitBlockFilter(insertFilename, options.exportSbbf)
+                                                : querySplitBlockFilter(options.querySbbf, testFilename);
+        return result == 0 ? 0 : 1;
+    }
+
+    if (options.foldFilename != NULL) {
+        return foldFilterFile(insertFilename, options.foldFilename, options.foldTimes, options.targetFp) == 0 ? 0 : 1;
+    }
+
+    if (options.rebuildFilename != NULL) {
+        return rebuildFromFingerprints(insertFilename, testFilename, options.rebuildFilename, options.targetFp,
+                                       options.rebuildHashes, options.pow2) == 0 ? 0 : 1;
+    }
+
+    if (options.reconcile) {
+        return reconcileWordFiles(insertFilename, testFilename, options.difference) == 0 ? 0 : 1;
+    }
+
+    if (options.retrieve) {
+        return runRetrieval(insertFilename, testFilename) == 0 ? 0 : 1;
+    }
+
+    if (options.batchFilename != NULL) {
+        int failures = runBatch(options.batchFilename, options.pow2);
+        clock_gettime(CLOCK_MONOTONIC, &all_end);
+        all_time = (all_end.tv_sec - all_start.tv_sec) * 1e9;
+        all_time = (all_time + (all_end.tv_nsec - all_start.tv_nsec)) * 1e-9;
+        printf("Total time (s): %lf \n", all_time);
+        return failures == 0 ? 0 : 1;
+    }
     
     // Declare variables for words array, query array, bits array and their sizes
     int numToInsert = 0;
@@ -301,21 +6913,38 @@ int main(int argc, char *argv[]) {
     int *bits = NULL;
     int querySize = 0;
 
+    // Registers for the distinct word estimate, filled while the words are parsed
+    HyperLogLog *hll = NULL;
+    if (options.sizeByDistinct) {
+        hll = (HyperLogLog *)calloc(1, sizeof(HyperLogLog));
+        if (hll == NULL) {
+            printf("Memory allocation failed for HyperLogLog.\n");
+            return -1;
+        }
+    }
+
     // Time reading from file(s)
     clock_gettime(CLOCK_MONOTONIC, &start);
 
+    // Allow the word reader to parse in parallel while the query file is read by its own section
+    omp_set_max_active_levels(2);
     #pragma omp parallel sections
     {   
         #pragma omp section
         {
+            double spanStart = traceNow();
             readQuery(testFilename, &queries, &bits, &querySize);
+            traceSpan("read queries", spanStart);
         }
 
         #pragma omp section
         {
-            ppInsertWordListArray = readWordsFromFile(insertFilename, &numToInsert);
+            double spanStart = traceNow();
+            ppInsertWordListArray = readWordsFromFile(insertFilename, &numToInsert, hll);
+            traceSpan("read words", spanStart);
         }
     }
+    omp_set_max_active_levels(1);
 
     if (ppInsertWordListArray == NULL) {
         return -1;
@@ -325,49 +6954,130 @@ int main(int argc, char *argv[]) {
     time_taken = (end.tv_sec - start.tv_sec) * 1e9;
     time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
     printf("Reading time (s): %lf \n", time_taken);
+    printMemoryReport("reading");
+
+    // Sidecars let later rebuilds and FP sweeps skip reading and hashing the strings
+    if (options.fingerprintFilename != NULL && writeFingerprintFile(options.fingerprintFilename, ppInsertWordListArray, numToInsert, NULL) != 0) {
+        return 1;
+    }
+    if (options.queryFingerprintFilename != NULL && writeFingerprintFile(options.queryFingerprintFilename, queries, querySize, bits) != 0) {
+        return 1;
+    }
+
+    // Number of elements the filter is sized for
+    int numToSize = numToInsert;
+    if (hll != NULL) {
+        // Add one standard error (1.04 / sqrt(registers)) so an underestimate does not push FP past the target
+        double distinct = estimateHyperLogLog(hll) * (1 + 1.04 / sqrt(HLL_REGISTERS));
+        if (distinct < numToSize) {
+            numToSize = distinct > 1 ? (int)distinct : 1;
+        }
+        printf("Distinct words (estimated): %d of %d\n", numToSize, numToInsert);
+        free(hll);
+    }
+    if (options.capacity > 0) {
+        numToSize = options.capacity;
+    }
 
-    int m = calculateOptimalArraySize(numToInsert);
+    int m = calculateOptimalArraySize(numToSize);
     // update k global variable
-    k = (m/numToInsert) * log(2);
+    k = (m/numToSize) * log(2);
+
+    // The weighted engine takes its query frequencies from a profile of "key count" lines,
+    // or counts them from a raw query log
+    EngineInput input = {queries, bits, querySize, NULL, NULL, 0};
+    if (options.profileFilename != NULL || options.queryLogFilename != NULL) {
+        if (options.profileFilename != NULL) {
+            readQuery(options.profileFilename, &input.profileKeys, &input.profileCounts, &input.profileSize);
+        } else {
+            readQueryLog(options.queryLogFilename, &input.profileKeys, &input.profileCounts, &input.profileSize);
+        }
+        if (input.profileKeys == NULL) {
+            freeWordsAndQueries(ppInsertWordListArray, numToInsert, queries, bits, querySize);
+            return 1;
+        }
+    }
+
+    if (options.rangeBench) {
+        static const int defaultLengths[] = {2, 4, 6, 8};
+        int result = options.numPrefixLengths > 0
+                   ? benchmarkPrefixAndRange(ppInsertWordListArray, numToInsert, queries, querySize, options.prefixLengths, options.numPrefixLengths)
+                   : benchmarkPrefixAndRange(ppInsertWordListArray, numToInsert, queries, querySize, defaultLengths, 4);
+        freeWordsAndQueries(ppInsertWordListArray, numToInsert, queries, bits, querySize);
+        freeWordsAndQueries(NULL, 0, input.profileKeys, input.profileCounts, input.profileSize);
+        return result == 0 ? 0 : 1;
+    }
+
+    if (options.typoBench) {
+        int result = benchmarkTypos(ppInsertWordListArray, numToInsert, queries, querySize);
+        freeWordsAndQueries(ppInsertWordListArray, numToInsert, queries, bits, querySize);
+        freeWordsAndQueries(NULL, 0, input.profileKeys, input.profileCounts, input.profileSize);
+        return result == 0 ? 0 : 1;
+    }
+
+    if (options.verify) {
+        int failures = verifyEngines(ppInsertWordListArray, numToInsert, &input, m);
+        freeWordsAndQueries(ppInsertWordListArray, numToInsert, queries, bits, querySize);
+        freeWordsAndQueries(NULL, 0, input.profileKeys, input.profileCounts, input.profileSize);
+        return failures == 0 ? 0 : 1;
+    }
+
+    if (options.engine != NULL) {
+        int result = runEngine(options.engine, ppInsertWordListArray, numToInsert, &input, m, options.bench);
+        freeWordsAndQueries(ppInsertWordListArray, numToInsert, queries, bits, querySize);
+        freeWordsAndQueries(NULL, 0, input.profileKeys, input.profileCounts, input.profileSize);
+        clock_gettime(CLOCK_MONOTONIC, &all_end);
+        all_time = (all_end.tv_sec - all_start.tv_sec) * 1e9;
+        all_time = (all_time + (all_end.tv_nsec - all_start.tv_nsec)) * 1e-9;
+        printf("Total time (s): %lf \n", all_time);
+        return result;
+    }
 
-    int *bitArray = (int *)malloc(m*sizeof(int));
+    int *bitArray = (int *)calloc(m, sizeof(int));
     if (bitArray == NULL) {
         printf("Memory allocation failed for bitArray.\n");
         free(ppInsertWordListArray);
         return 1;
     }
+    trackMemory(MEMORY_FILTER, (long)m * sizeof(int));
 
     // Time insertion of words into the Bloom filter
     clock_gettime(CLOCK_MONOTONIC, &start);
     // Insert all the words from ppInsertWordListArray into bitArray
+    double spanStart = traceNow();
     insertWords(ppInsertWordListArray, numToInsert, bitArray, m);   
+    traceSpan("insert", spanStart);
     clock_gettime(CLOCK_MONOTONIC, &end);
     time_taken = (end.tv_sec - start.tv_sec) * 1e9;
     time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
     printf("Inserting time (s): %lf \n", time_taken);
+    // The fill scan is a metrics cost, kept out of the timed insert
+    if (metricsEnabled) {
+        long setBits = 0;
+        #pragma omp parallel for reduction(+:setBits)
+        for (int i = 0; i < m; i++) {
+            setBits += bitArray[i] != 0;
+        }
+        metricsPublishFill(setBits, m, k);
+    }
+    printMemoryReport("inserting");
 
     // Test words against the Bloom filter
     // Measure Bloom Filter Testing Time
     clock_gettime(CLOCK_MONOTONIC, &start);
-    testBloomWithQueries(bitArray, queries, bits, querySize, m);
+    spanStart = traceNow();
+    testBloomWithQueries(bitArray, queries, bits, querySize, m, options.topK);
+    traceSpan("test", spanStart);
     clock_gettime(CLOCK_MONOTONIC, &end);
     time_taken = (end.tv_sec - start.tv_sec) * 1e9;
     time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
     printf("Testing time (s): %lf \n", time_taken);
+    printMemoryReport("testing");
 
-   // Free memory for query words and bits
-    for (int i = 0; i < querySize; i++) {
-        free(queries[i]);
-    }
-    free(queries);
-    free(bits);
     free(bitArray);
-
-    // Free memory allocated for ppInsertWordListArray
-    for (int i = 0; i < numToInsert; i++) {
-        free(ppInsertWordListArray[i]);
-    }
-    free(ppInsertWordListArray);
+    trackMemory(MEMORY_FILTER, -(long)((long)m * sizeof(int)));
+    freeWordsAndQueries(ppInsertWordListArray, numToInsert, queries, bits, querySize);
+    freeWordsAndQueries(NULL, 0, input.profileKeys, input.profileCounts, input.profileSize);
 
     clock_gettime(CLOCK_MONOTONIC, &all_end);
     all_time = (all_end.tv_sec - all_start.tv_sec) * 1e9;
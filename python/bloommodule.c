@@ -0,0 +1,348 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <omp.h>
+#include "bloomfile.h"
+
+/*
+ * Python bindings for querying serialized Bloom filters in batches.
+ *
+ * Keys are read in place through the buffer protocol, so NumPy arrays and Arrow buffers are
+ * never copied; the lookup runs on OpenMP threads with the GIL released and writes one byte
+ * per key into a caller-supplied buffer such as a NumPy bool array.
+ */
+
+/**
+ * How the keys buffer is laid out.
+ */
+enum KeyLayout {
+    KEYS_FIXED_WIDTH, // NumPy 'S' arrays or raw bytes with an explicit width, NUL padded.
+    KEYS_OFFSETS,     // Arrow string arrays: a data buffer plus n + 1 offsets.
+    KEYS_SIGNED,      // Signed integers, hashed by their decimal string.
+    KEYS_UNSIGNED     // Unsigned integers, hashed by their decimal string.
+};
+
+typedef struct {
+    PyObject_HEAD
+    MappedFilter filter;
+    int activeLookups; // Lookups running with the GIL released; the mapping must outlive them.
+} FilterObject;
+
+/**
+ * Formats an integer as a decimal string.
+ *
+ * @param value     The magnitude of the integer.
+ * @param negative  Whether to prefix a minus sign.
+ * @param buffer    Receives the digits, at least 21 bytes.
+ * @return The number of characters written.
+ */
+static size_t formatDecimal(unsigned long long value, int negative, char *buffer) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    size_t length = 0;
+    if (negative) {
+        buffer[length++] = '-';
+    }
+    while (count > 0) {
+        buffer[length++] = digits[--count];
+    }
+    return length;
+}
+
+/**
+ * Reads integer key i and formats it as a decimal string.
+ *
+ * @param keys      The integer buffer.
+ * @param i         The key index.
+ * @param itemSize  The integer width in bytes.
+ * @param isSigned  Whether the integers are signed.
+ * @param buffer    Receives the digits, at least 21 bytes.
+ * @return The number of characters written.
+ */
+static size_t formatIntegerKey(const char *keys, Py_ssize_t i, Py_ssize_t itemSize, int isSigned, char *buffer) {
+    const char *item = keys + i * itemSize;
+    if (isSigned) {
+        long long value;
+        switch (itemSize) {
+            case 1: { int8_t v; memcpy(&v, item, 1); value = v; break; }
+            case 2: { int16_t v; memcpy(&v, item, 2); value = v; break; }
+            case 4: { int32_t v; memcpy(&v, item, 4); value = v; break; }
+            default: { int64_t v; memcpy(&v, item, 8); value = v; break; }
+        }
+        return value < 0 ? formatDecimal(-(unsigned long long)value, 1, buffer) : formatDecimal(value, 0, buffer);
+    }
+    unsigned long long value;
+    switch (itemSize) {
+        case 1: { uint8_t v; memcpy(&v, item, 1); value = v; break; }
+        case 2: { uint16_t v; memcpy(&v, item, 2); value = v; break; }
+        case 4: { uint32_t v; memcpy(&v, item, 4); value = v; break; }
+        default: { uint64_t v; memcpy(&v, item, 8); value = v; break; }
+    }
+    return formatDecimal(value, 0, buffer);
+}
+
+/**
+ * Reads Arrow offset i, which is either 32 or 64 bits wide.
+ */
+static inline long long readOffset(const char *offsets, Py_ssize_t i, Py_ssize_t itemSize) {
+    if (itemSize == 4) {
+        int32_t value;
+        memcpy(&value, offsets + 4 * i, 4);
+        return value;
+    }
+    int64_t value;
+    memcpy(&value, offsets + 8 * i, 8);
+    return value;
+}
+
+/**
+ * Looks up n keys in parallel. Runs without the GIL, so it must not touch Python objects.
+ *
+ * @param filter    The mapped filter.
+ * @param layout    How the keys are laid out.
+ * @param keys      The keys buffer (or Arrow data buffer).
+ * @param itemSize  Key width for fixed-width and integer keys.
+ * @param offsets   Arrow offsets, or NULL.
+ * @param offsetSize Width of each offset in bytes.
+ * @param n         The number of keys.
+ * @param out       Receives 1 for each key that may be present, 0 otherwise.
+ */
+static void lookUpBatch(const MappedFilter *filter, enum KeyLayout layout, const char *keys, Py_ssize_t itemSize,
+                        const char *offsets, Py_ssize_t offsetSize, Py_ssize_t n, unsigned char *out) {
+    #pragma omp parallel for schedule(static)
+    for (Py_ssize_t i = 0; i < n; i++) {
+        char digits[21];
+        switch (layout) {
+            case KEYS_FIXED_WIDTH:
+                out[i] = lookUpMapped(filter, keys + i * itemSize, itemSize);
+                break;
+            case KEYS_OFFSETS: {
+                long long start = readOffset(offsets, i, offsetSize);
+                long long end = readOffset(offsets, i + 1, offsetSize);
+                out[i] = lookUpMapped(filter, keys + start, end - start);
+                break;
+            }
+            default: {
+                size_t length = formatIntegerKey(keys, i, itemSize, layout == KEYS_SIGNED, digits);
+                out[i] = lookUpMapped(filter, digits, length);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Returns the struct format code of a buffer, skipping any byte-order prefix.
+ */
+static const char *formatCode(const Py_buffer *view) {
+    const char *format = view->format != NULL ? view->format : "B";
+    while (*format == '@' || *format == '=' || *format == '<' || *format == '>' || *format == '!') {
+        format++;
+    }
+    return format;
+}
+
+static int Filter_init(FilterObject *self, PyObject *args, PyObject *kwds) {
+    static char *keywords[] = {"path", NULL};
+    PyObject *path;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", keywords, PyUnicode_FSConverter, &path)) {
+        return -1;
+    }
+    if (self->activeLookups > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot reopen a filter while lookups are running");
+        Py_DECREF(path);
+        return -1;
+    }
+    unmapFilterFile(&self->filter);
+    int failed = mapFilterFile(PyBytes_AS_STRING(path), &self->filter);
+    if (failed) {
+        PyErr_Format(PyExc_ValueError, "%s is not a readable serialized Bloom filter", PyBytes_AS_STRING(path));
+    }
+    Py_DECREF(path);
+    return failed ? -1 : 0;
+}
+
+static void Filter_dealloc(FilterObject *self) {
+    unmapFilterFile(&self->filter);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Filter_close(FilterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (self->activeLookups > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot close a filter while lookups are running");
+        return NULL;
+    }
+    unmapFilterFile(&self->filter);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Filter_lookup(FilterObject *self, PyObject *args, PyObject *kwds) {
+    static char *keywords[] = {"keys", "out", "width", "offsets", NULL};
+    PyObject *keysObject, *outObject = Py_None, *offsetsObject = Py_None;
+    Py_ssize_t width = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OnO", keywords, &keysObject, &outObject, &width, &offsetsObject)) {
+        return NULL;
+    }
+    if (self->filter.header == NULL) {
+        PyErr_SetString(PyExc_ValueError, "lookup on a closed filter");
+        return NULL;
+    }
+
+    Py_buffer keys, offsets = {0}, out = {0};
+    if (PyObject_GetBuffer(keysObject, &keys, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+        return NULL;
+    }
+
+    enum KeyLayout layout;
+    Py_ssize_t itemSize = keys.itemsize, n = 0;
+    const char *code = formatCode(&keys);
+    PyObject *result = NULL;
+    if (offsetsObject != Py_None) {
+        if (PyObject_GetBuffer(offsetsObject, &offsets, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+            goto done;
+        }
+        if ((offsets.itemsize != 4 && offsets.itemsize != 8) || *formatCode(&offsets) == '\0' ||
+            strchr("ilqILQ", *formatCode(&offsets)) == NULL ||
+            offsets.len < offsets.itemsize) {
+            PyErr_SetString(PyExc_TypeError, "offsets must be a 32- or 64-bit integer buffer of n + 1 entries");
+            goto done;
+        }
+        layout = KEYS_OFFSETS;
+        n = offsets.len / offsets.itemsize - 1;
+        for (Py_ssize_t i = 0; i <= n; i++) {
+            long long offset = readOffset(offsets.buf, i, offsets.itemsize);
+            if (offset < 0 || offset > keys.len || (i > 0 && offset < readOffset(offsets.buf, i - 1, offsets.itemsize))) {
+                PyErr_SetString(PyExc_ValueError, "offsets must be non-decreasing and within the data buffer");
+                goto done;
+            }
+        }
+    } else if (width > 0) {
+        if (keys.itemsize != 1 || keys.len % width != 0) {
+            PyErr_SetString(PyExc_ValueError, "width requires a byte buffer whose length is a multiple of it");
+            goto done;
+        }
+        layout = KEYS_FIXED_WIDTH;
+        itemSize = width;
+        n = keys.len / width;
+    } else if (code[strspn(code, "0123456789")] == 's') {
+        layout = KEYS_FIXED_WIDTH;
+        n = keys.len / itemSize;
+    } else if (code[0] != '\0' && code[1] == '\0' && strchr("bhilqn", code[0]) != NULL && itemSize <= 8) {
+        layout = KEYS_SIGNED;
+        n = keys.len / itemSize;
+    } else if (code[0] != '\0' && code[1] == '\0' && strchr("BHILQN", code[0]) != NULL && itemSize <= 8) {
+        layout = KEYS_UNSIGNED;
+        n = keys.len / itemSize;
+    } else {
+        PyErr_Format(PyExc_TypeError, "unsupported key format '%s'; pass bytes ('S') or integer arrays, "
+                     "a byte buffer with width=, or Arrow data with offsets=", code);
+        goto done;
+    }
+
+    if (outObject == Py_None) {
+        outObject = PyByteArray_FromStringAndSize(NULL, n);
+        if (outObject == NULL) {
+            goto done;
+        }
+    } else {
+        Py_INCREF(outObject);
+    }
+    if (PyObject_GetBuffer(outObject, &out, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE) != 0) {
+        Py_DECREF(outObject);
+        goto done;
+    }
+    if (out.len != n) {
+        PyErr_Format(PyExc_ValueError, "out must hold exactly %zd bytes, one per key", n);
+        PyBuffer_Release(&out);
+        Py_DECREF(outObject);
+        goto done;
+    }
+
+    self->activeLookups++;
+    Py_BEGIN_ALLOW_THREADS
+    lookUpBatch(&self->filter, layout, keys.buf, itemSize, offsets.buf, offsets.itemsize, n, out.buf);
+    Py_END_ALLOW_THREADS
+    self->activeLookups--;
+
+    PyBuffer_Release(&out);
+    result = outObject;
+
+done:
+    if (offsets.obj != NULL) {
+        PyBuffer_Release(&offsets);
+    }
+    PyBuffer_Release(&keys);
+    return result;
+}
+
+static PyObject *Filter_get_m(FilterObject *self, void *closure) {
+    return self->filter.header ? PyLong_FromUnsignedLongLong(self->filter.header->m) : PyLong_FromLong(0);
+}
+
+static PyObject *Filter_get_k(FilterObject *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->filter.header ? self->filter.header->k : 0);
+}
+
+static PyObject *Filter_get_num_inserted(FilterObject *self, void *closure) {
+    return PyLong_FromUnsignedLongLong(self->filter.header ? self->filter.header->numInserted : 0);
+}
+
+static PyMethodDef Filter_methods[] = {
+    {"lookup", (PyCFunction)(void (*)(void))Filter_lookup, METH_VARARGS | METH_KEYWORDS,
+     "lookup(keys, out=None, width=0, offsets=None)\n\n"
+     "Tests every key and writes 1 (may be present) or 0 (absent) per key into 'out', a writable\n"
+     "one-byte-per-item buffer such as numpy.empty(n, dtype=bool); a bytearray is returned when\n"
+     "'out' is omitted. Keys may be a NumPy 'S' array, a byte buffer of 'width'-byte NUL-padded\n"
+     "keys, an integer array (hashed by decimal string), or an Arrow data buffer with 'offsets'.\n"
+     "The GIL is released while the lookup runs."},
+    {"close", (PyCFunction)Filter_close, METH_NOARGS, "Unmaps the filter file."},
+    {NULL}
+};
+
+static PyGetSetDef Filter_getset[] = {
+    {"m", (getter)Filter_get_m, NULL, "Number of bits.", NULL},
+    {"k", (getter)Filter_get_k, NULL, "Number of hash functions.", NULL},
+    {"num_inserted", (getter)Filter_get_num_inserted, NULL, "Number of words inserted at build time.", NULL},
+    {NULL}
+};
+
+static PyTypeObject FilterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "bloomfilter.Filter",
+    .tp_doc = "Filter(path)\n\nA serialized Bloom filter (see --batch) mapped read-only from 'path'.",
+    .tp_basicsize = sizeof(FilterObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Filter_init,
+    .tp_dealloc = (destructor)Filter_dealloc,
+    .tp_methods = Filter_methods,
+    .tp_getset = Filter_getset,
+};
+
+static struct PyModuleDef bloomfilterModule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "bloomfilter",
+    .m_doc = "Zero-copy batch queries against serialized Bloom filters.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_bloomfilter(void) {
+    if (PyType_Ready(&FilterType) < 0) {
+        return NULL;
+    }
+    PyObject *module = PyModule_Create(&bloomfilterModule);
+    if (module == NULL) {
+        return NULL;
+    }
+    Py_INCREF(&FilterType);
+    if (PyModule_AddObject(module, "Filter", (PyObject *)&FilterType) < 0) {
+        Py_DECREF(&FilterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,20 @@
+import os
+
+from setuptools import Extension, setup
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+setup(
+    name="bloomfilter",
+    version="0.1",
+    description="Zero-copy batch queries against serialized Bloom filters",
+    ext_modules=[
+        Extension(
+            "bloomfilter",
+            sources=[os.path.relpath(os.path.join(here, "bloommodule.c"))],
+            include_dirs=[os.path.dirname(here)],
+            extra_compile_args=["-O3", "-fopenmp"],
+            extra_link_args=["-fopenmp"],
+        )
+    ],
+)
@@ -4,42 +4,13 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include "serialinsert.h"
 
 #define MAX_WORD_LENGTH 100
 #define MAX_FP 0.01
 
 int k;
 
-/**
- *
- * This function calculates a hash value for the input string 'str' using the provided salt value.
- * It employs the APHash algorithm with added salting to generate different hashes for the same string.
- *
- * @param str   The input string for which the hash is computed.
- * @param salt  The salt value used to modify the hash calculation.
- * @param m     bitArray size, since the index will need to be limited to it.
- *
- * @return The computed hash value for the input string with the added salt value, modulo 'm'.
- */
-unsigned int APHashWithSalt(char *str, unsigned int salt, int m) {
-    unsigned int hash = salt; // Initialize the hash with the provided salt.
-
-    for (int i = 0; str[i]; i++) {
-        if (i % 2 == 1) { // Check if the current character's position is odd.
-            // Calculate a new hash by XOR-ing the current hash, left-shifting it by 7 bits,
-            // XOR-ing it with the current character, and right-shifting it by 3 bits.
-            hash ^= ((hash << 7) ^ str[i] ^ (hash >> 3));
-        } else {
-            // Calculate a new hash by XOR-ing the current hash with the bitwise complement of
-            // (left-shifting the hash by 11 bits, XOR-ing it with the current character, and right-shifting it by 5 bits).
-            hash ^= (~((hash << 11) ^ str[i] ^ (hash >> 5)));
-        }
-    }
-
-    // Return the computed hash value, limited to a the range of the bitArray.
-    return hash % m;
-}
-
 /**
  * Reads words from a file and stores them in an array of strings and updates the arrayLength pointer.
  *
@@ -93,30 +64,6 @@ char** readWordsFromFile(const char *filename, int *wordListLength) {
     return ppWordListArray;
 }
 
-/**
- * Inserts words into a Bloom filter represented by a bit array.
- *
- * This function takes an array of words and inserts them into a Bloom filter
- * represented by a bit array. It uses multiple hash functions to set the bits
- * in the filter corresponding to the hashed values of each word.
- *
- * @param ppWordListArray  An array of strings containing words to insert.
- * @param numToInsert      The number of words to insert from the array.
- * @param bitArray         The bit array representing the Bloom filter.
- * @param m                The size of the bit array (modulo value for hashing).
- */
-void insertWords(char **ppWordListArray, int numToInsert, int* bitArray, int m) {
-    for (int i = 0; i < numToInsert; i++) {
-        for (int h = 0; h < k; h++) {
-            // Calculate the hash using APHashWithSalt
-            unsigned int hash = APHashWithSalt(ppWordListArray[i], h, m);
-            
-            // Set the corresponding bit in the bit array to 1
-            bitArray[hash] = 1;
-        }
-    }
-}
-
 /**
  * Calculates the optimal size of a Bloom filter bit array based on the expected number of elements.
  *
@@ -150,7 +97,7 @@ int lookUp(char* word, int* bitArray, int m) {
 
     // Iterate through the hash functions and check the corresponding bit
     for (int h = 0; h < k; h++) {
-        int index = APHashWithSalt(word, h, m); // Compute the hash index
+        int index = APHashWithSaltSerial(word, h, m); // Compute the hash index
         isPossiblyInSet = (bitArray[index] && isPossiblyInSet); // Perform a logical AND operation
     }
 
@@ -323,7 +270,7 @@ int main(int argc, char *argv[]) {
     // Time insertion of words into the Bloom filter
     clock_gettime(CLOCK_MONOTONIC, &start);
     // Insert all the words from ppInsertWordListArray into bitArray
-    insertWords(ppInsertWordListArray, numToInsert, bitArray, m);   
+    insertWordsSerial(ppInsertWordListArray, numToInsert, bitArray, m, k);   
     clock_gettime(CLOCK_MONOTONIC, &end);
     time_taken = (end.tv_sec - start.tv_sec) * 1e9;
     time_taken = (time_taken + (end.tv_nsec - start.tv_nsec)) * 1e-9;
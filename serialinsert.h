@@ -0,0 +1,64 @@
+#ifndef SERIALINSERT_H
+#define SERIALINSERT_H
+
+/*
+ * The hash and insertion loop of the serial program, shared with the parallel one so its
+ * --verify checks compare every parallel path against the code serial.c actually runs.
+ */
+
+/**
+ *
+ * This function calculates a hash value for the input string 'str' using the provided salt value.
+ * It employs the APHash algorithm with added salting to generate different hashes for the same string.
+ *
+ * @param str   The input string for which the hash is computed.
+ * @param salt  The salt value used to modify the hash calculation.
+ * @param m     bitArray size, since the index will need to be limited to it.
+ *
+ * @return The computed hash value for the input string with the added salt value, modulo 'm'.
+ */
+static inline unsigned int APHashWithSaltSerial(char *str, unsigned int salt, int m) {
+    unsigned int hash = salt; // Initialize the hash with the provided salt.
+
+    for (int i = 0; str[i]; i++) {
+        if (i % 2 == 1) { // Check if the current character's position is odd.
+            // Calculate a new hash by XOR-ing the current hash, left-shifting it by 7 bits,
+            // XOR-ing it with the current character, and right-shifting it by 3 bits.
+            hash ^= ((hash << 7) ^ str[i] ^ (hash >> 3));
+        } else {
+            // Calculate a new hash by XOR-ing the current hash with the bitwise complement of
+            // (left-shifting the hash by 11 bits, XOR-ing it with the current character, and right-shifting it by 5 bits).
+            hash ^= (~((hash << 11) ^ str[i] ^ (hash >> 5)));
+        }
+    }
+
+    // Return the computed hash value, limited to a the range of the bitArray.
+    return hash % m;
+}
+
+/**
+ * Inserts words into a Bloom filter represented by a bit array.
+ *
+ * This function takes an array of words and inserts them into a Bloom filter
+ * represented by a bit array. It uses multiple hash functions to set the bits
+ * in the filter corresponding to the hashed values of each word.
+ *
+ * @param ppWordListArray  An array of strings containing words to insert.
+ * @param numToInsert      The number of words to insert from the array.
+ * @param bitArray         The bit array representing the Bloom filter.
+ * @param m                The size of the bit array (modulo value for hashing).
+ * @param numHashes        The number of hash functions.
+ */
+static inline void insertWordsSerial(char **ppWordListArray, int numToInsert, int* bitArray, int m, int numHashes) {
+    for (int i = 0; i < numToInsert; i++) {
+        for (int h = 0; h < numHashes; h++) {
+            // Calculate the hash using APHashWithSaltSerial
+            unsigned int hash = APHashWithSaltSerial(ppWordListArray[i], h, m);
+            
+            // Set the corresponding bit in the bit array to 1
+            bitArray[hash] = 1;
+        }
+    }
+}
+
+#endif